@@ -8,11 +8,11 @@ $ ./client zquery xxx 1 asdf 1 10
 (arr) len=0
 (arr) end
 $ ./client zadd zset 1 n1
-(int) 1
+(int)1
 $ ./client zadd zset 2 n2
-(int) 1
+(int)1
 $ ./client zadd zset 1.1 n1
-(int) 0
+(int)0
 $ ./client zscore zset n1
 (dbl) 1.1
 $ ./client zquery zset 1 "" 0 10
@@ -31,14 +31,99 @@ $ ./client zquery zset 1.1 "" 2 10
 (arr) len=0
 (arr) end
 $ ./client zrem zset adsf
-(int) 0
+(int)0
 $ ./client zrem zset n1
-(int) 1
+(int)1
 $ ./client zquery zset 1 "" 0 10
 (arr) len=2
 (str) n2
 (dbl) 2
 (arr) end
+$ ./client zadd zs 1 a 2 b 3 c 4 d 5 e
+(int)5
+$ ./client zadd zs 1 a 6 f
+(int)1
+$ ./client zrank zs c
+(int)2
+$ ./client zrevrank zs c
+(int)3
+$ ./client zrank zs x
+(nil)
+$ ./client zcount zs 2 4
+(int)3
+$ ./client zcount zs '(2' 4
+(int)2
+$ ./client zcount zs -inf +inf
+(int)6
+$ ./client zrangebyscore zs 2 5
+(arr) len=4
+(str) b
+(str) c
+(str) d
+(str) e
+(arr) end
+$ ./client zrangebyscore zs '(1' +inf withscores limit 1 2
+(arr) len=4
+(str) c
+(dbl) 3
+(str) d
+(dbl) 4
+(arr) end
+$ ./client zrevrangebyscore zs 5 '(2' limit 0 2
+(arr) len=2
+(str) e
+(str) d
+(arr) end
+$ ./client zrangebyscore zs -inf +inf limit 9223372036854775807 1
+(arr) len=0
+(arr) end
+$ ./client zrevrangebyscore zs +inf -inf limit 9223372036854775807 1
+(arr) len=0
+(arr) end
+$ ./client zremrangebyscore zs 2 3
+(int)2
+$ ./client zquery zs 0 "" 0 10
+(arr) len=8
+(str) a
+(dbl) 1
+(str) d
+(dbl) 4
+(str) e
+(dbl) 5
+(str) f
+(dbl) 6
+(arr) end
+$ ./client zremrangebyscore zs -inf +inf
+(int)4
+$ ./client zscore zs a
+(nil)
+$ ./client get zs
+(nil)
+$ ./client zadd zs 1 a 2 b
+(int)2
+$ ./client zremrangebyscore zs 1 1
+(int)1
+$ ./client zrem zs b
+(int)1
+$ ./client get zs
+(nil)
+$ ./client zremrangebyscore zs 1 2
+(int)0
+$ ./client set scan:k1 v
+(nil)
+$ ./client scan 0 match scan:*
+(arr) len=2
+(int)0
+(arr) len=1
+(str) scan:k1
+(arr) end
+(arr) end
+$ ./client unlink scan:k1
+(int)1
+$ ./client unlink scan:k1
+(int)0
+$ ./client get scan:k1
+(nil)
 '''
 
 
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// the append-only log: the commands that changed the keys, in the wire
+// format of the requests (u32 len, u32 nargs, then u32 len and the bytes of
+// each argument), replayed at startup.
+// the shards share one file. each one writes what it logged in a loop
+// iteration with a single aof_write(), and a background thread fsyncs it,
+// so the event loops never wait for the disk.
+
+enum
+{
+    AOF_FSYNC_NO = 0,       // the kernel writes it back when it wants
+    AOF_FSYNC_EVERYSEC = 1, // an fsync a second, if anything was written
+    AOF_FSYNC_ALWAYS = 2,   // an fsync for every batch, a reply waits for it
+};
+
+// open path for appending and start the fsync thread. notify is called on
+// that thread after each fsync with AOF_FSYNC_ALWAYS.
+bool aof_open(const char *path, int policy, void (*notify)());
+// append a batch in one write(), from any thread. returns its ticket: the
+// batch is on disk once aof_synced() >= ticket. 0 on a write error.
+uint64_t aof_write(const void *data, size_t len);
+// the last ticket that's on disk
+uint64_t aof_synced();
+// the size of the file, what's been written to it so far
+uint64_t aof_size();
+// write all of it to fd, false on an error
+bool aof_write_all(int fd, const void *data, size_t len);
+
+// a rewrite makes a new log out of the keys: a forked child writes them to
+// tmp as commands, while the shards go on appending to the old log. from
+// aof_rewrite_begin() on, the batches are also kept in memory. then
+// aof_rewrite_end() appends them to tmp, all but the last few while the
+// shards go on, switches the writes to it, then fsyncs it and renames it
+// over path. false on an error, and the old log goes on as if nothing happened.
+void aof_rewrite_begin();
+bool aof_rewrite_end(const char *tmp, const char *path, uint64_t *diff);
+// the child failed, drop what was kept
+void aof_rewrite_abort();
+
+struct AofStats
+{
+    uint64_t bytes = 0;  // written since the start
+    uint64_t writes = 0; // batches
+    uint64_t fsyncs = 0;
+    uint64_t fsync_us = 0; // in total
+    uint64_t fsync_max_us = 0;
+};
+
+void aof_stats(AofStats *out);
+
+// the log found at startup, mapped to be replayed. only its complete
+// records are kept: a crash can leave the last one cut short.
+struct AofLog
+{
+    const uint8_t *data = NULL;
+    size_t size = 0;
+    size_t tail = 0; // the bytes of the incomplete last record
+};
+
+// NULL if it's mapped, or what's wrong. errno is ENOENT if there's no file.
+const char *aof_map(AofLog *log, const char *path);
+void aof_unmap(AofLog *log);
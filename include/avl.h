@@ -19,6 +19,13 @@ inline void avl_init(AVLNode *node)
     node->left = node->right = node->parent = NULL;
 }
 
+inline uint32_t avl_cnt(AVLNode *node)
+{
+    return node ? node->cnt : 0;
+}
+
 AVLNode *avl_fix(AVLNode *node);
 AVLNode *avl_del(AVLNode *node);
-AVLNode *avl_offset(AVLNode *node, int64_t offset);
\ No newline at end of file
+AVLNode *avl_offset(AVLNode *node, int64_t offset);
+// a balanced tree of n nodes already in order, in O(n). returns the root.
+AVLNode *avl_build(AVLNode **nodes, size_t n);
\ No newline at end of file
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct ZNode;
+
+// a B+tree of ZNode pointers in (score, name) order, the other zset index.
+// a node keeps its keys in arrays: the scores, then the first 8 bytes of the
+// names as integers, so a search compares within a cache line or two and only
+// reads a ZNode when both are equal. an inner node has the item count of
+// each child, for ranks. the leaves are linked for range scans.
+
+const uint32_t k_bt_cap = 32; // items per leaf, children per inner node
+
+struct BNode
+{
+    uint16_t n = 0; // items or children
+    bool leaf = false;
+};
+
+// the keys of a node, one array per field
+struct BKeys
+{
+    double scores[k_bt_cap];
+    uint64_t prefixes[k_bt_cap];
+    ZNode *items[k_bt_cap];
+};
+
+struct BLeaf
+{
+    BNode base;
+    BLeaf *prev = NULL;
+    BLeaf *next = NULL;
+    BKeys keys;
+};
+
+// key i is the smallest item under child i, key 0 is unused.
+struct BInner
+{
+    BNode base;
+    uint32_t cnts[k_bt_cap];
+    BNode *kids[k_bt_cap];
+    BKeys keys;
+};
+
+struct BTree
+{
+    BNode *root = NULL;
+    size_t size = 0;
+};
+
+// a position in the tree, leaf is NULL when out of range
+struct BIter
+{
+    BLeaf *leaf = NULL;
+    uint32_t idx = 0;
+};
+
+// the item must not be in the tree, and not change its key while in it
+void bt_insert(BTree *tree, ZNode *item);
+// the item must be in the tree
+void bt_erase(BTree *tree, ZNode *item);
+// the first item >= (score, name)
+BIter bt_seek(BTree *tree, double score, const char *name, size_t len);
+// the item at a 0-based rank
+BIter bt_at(BTree *tree, uint64_t rank);
+uint64_t bt_rank(BTree *tree, ZNode *item);
+// move by offset items. a short move follows the leaf links, a long one
+// goes through the ranks, so it's O(log(n)) either way.
+void bt_offset(BTree *tree, BIter *it, int64_t offset);
+// build an empty tree from n items in order, in O(n)
+void bt_build(BTree *tree, ZNode **items, size_t n);
+// call f on every item and free the nodes
+void bt_dispose(BTree *tree, void (*f)(ZNode *));
+
+inline ZNode *bt_get(BIter it)
+{
+    return it.leaf ? it.leaf->keys.items[it.idx] : NULL;
+}
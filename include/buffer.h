@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// a growable byte buffer. the memory comes from a per-thread pool of power-of-2
+// size classes, so connections can give their buffers back whenever they're empty.
+struct Buffer
+{
+    uint8_t *data = NULL;
+    size_t cap = 0;
+};
+
+// make room for at least `need` bytes, keeping the first `used` bytes.
+// returns false if out of memory.
+bool buf_reserve(Buffer *buf, size_t used, size_t need);
+// give the memory back to the pool
+void buf_release(Buffer *buf);
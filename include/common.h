@@ -2,19 +2,91 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 
 #define my_container_of(ptr, type, member) ({                  \
     const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
     (type *)( (char *)__mptr - offsetof(type, member) ); })
 
+// set once at startup, before any key is hashed, so that clients
+// can't pick keys that all land in the same slot (hash flooding)
+inline uint64_t g_hash_seed = 0;
+
+inline uint64_t hash_read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+inline uint64_t hash_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// 64x64 -> 128 bit multiply, folded back to 64 bits
+inline uint64_t hash_mum(uint64_t a, uint64_t b)
+{
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+// a 64-bit hash in the style of wyhash: 8 bytes per multiply instead of 1.
+// keys up to 16 bytes take a few unaligned loads and 2 multiplies.
 inline uint64_t str_hash(const uint8_t *data, size_t len)
 {
-    uint32_t h = 0x811C9DC5;
-    for (size_t i = 0; i < len; i++)
+    const uint64_t k0 = 0xa0761d6478bd642full;
+    const uint64_t k1 = 0xe7037ed1a0b428dbull;
+    const uint64_t k2 = 0x8ebc6af09c88c6e3ull;
+    const uint64_t k3 = 0x589965cc75374cc3ull;
+    const uint8_t *p = data;
+    uint64_t seed = g_hash_seed ^ k0;
+    uint64_t a = 0, b = 0;
+    if (len <= 16)
+    {
+        if (len >= 4)
+        {
+            // 2 overlapping 4-byte loads from each end
+            size_t mid = (len >> 3) << 2;
+            a = (hash_read32(p) << 32) | hash_read32(p + mid);
+            b = (hash_read32(p + len - 4) << 32) | hash_read32(p + len - 4 - mid);
+        }
+        else if (len > 0)
+        {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+        }
+    }
+    else
     {
-        h = (h + data[i]) * 0x01000193;
+        size_t i = len;
+        if (i > 48)
+        {
+            // 3 independent lanes for long keys
+            uint64_t s1 = seed, s2 = seed;
+            do
+            {
+                seed = hash_mum(hash_read64(p) ^ k1, hash_read64(p + 8) ^ seed);
+                s1 = hash_mum(hash_read64(p + 16) ^ k2, hash_read64(p + 24) ^ s1);
+                s2 = hash_mum(hash_read64(p + 32) ^ k3, hash_read64(p + 40) ^ s2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= s1 ^ s2;
+        }
+        while (i > 16)
+        {
+            seed = hash_mum(hash_read64(p) ^ k1, hash_read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        // the last 16 bytes, overlapping what's already hashed
+        a = hash_read64(p + i - 16);
+        b = hash_read64(p + i - 8);
     }
-    return h;
+    __uint128_t r = (__uint128_t)(a ^ k1) * (b ^ seed);
+    return hash_mum((uint64_t)r ^ k0 ^ len, (uint64_t)(r >> 64) ^ k1);
 }
 
 enum
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct HNode;
+
+// an open addressing table of HNode pointers, swiss table style.
+// every slot has a 1-byte control tag: empty, deleted, or 7 bits of the hash.
+// a probe compares the tags of a group of 16 slots at once, and only
+// touches the nodes whose tag matches.
+struct FTab
+{
+    uint8_t *ctrl = NULL; // one tag per slot, the slots follow in the same block
+    HNode **slots = NULL;
+    size_t mask = 0; // number of slots - 1
+    size_t size = 0;
+    size_t growth_left = 0; // empty slots that can be used before it's too full
+};
+
+// like HMap, it keeps the older table around while resizing,
+// and moves a bounded number of slots on each operation.
+struct FMap
+{
+    FTab newer;
+    FTab older;
+    size_t migrate_pos = 0;
+};
+
+HNode *fm_lookup(FMap *fmap, HNode *key, bool (*eq)(HNode *, HNode *));
+void fm_insert(FMap *fmap, HNode *node);
+HNode *fm_pop(FMap *fmap, HNode *key, bool (*eq)(HNode *, HNode *));
+size_t fm_size(FMap *fmap);
+// make room for n nodes in total, the nodes there move over progressively
+void fm_reserve(FMap *fmap, size_t n);
+void fm_foreach(FMap *fmap, void (*f)(HNode *, void *), void *arg);
+// like hm_scan(), the cursor is over the groups by the hash. a group's nodes
+// are on its probe sequence up to the first group with an empty slot.
+uint64_t fm_scan(FMap *fmap, uint64_t cursor, void (*f)(HNode *, void *), void *arg);
+void fm_destroy(FMap *fmap);
@@ -10,6 +10,15 @@ struct HNode
     uint64_t hcode = 0;
 };
 
+#ifdef USE_FLATMAP
+#include "flatmap.h"
+
+// the open addressing table behind the same interface, see flatmap.h
+struct HMap
+{
+    FMap fm;
+};
+#else
 // a simple fixed-sized hashtable
 struct HTab
 {
@@ -26,9 +35,37 @@ struct HMap
     HTab ht2; // older
     size_t resizing_pos = 0;
 };
+#endif
 
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 void hm_insert(HMap *hmap, HNode *node);
 HNode *hm_pop(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 size_t hm_size(HMap *hmap);
+// make room for n nodes in total before a bulk insert
+void hm_reserve(HMap *hmap, size_t n);
+// call f on every node
+void hm_foreach(HMap *hmap, void (*f)(HNode *, void *), void *arg);
+// call f on the nodes of the bucket at the cursor, and while resizing, on the
+// buckets of the bigger table it splits into. returns the next cursor, 0 when
+// it's done. a node that's there for the whole scan is visited at least once,
+// even if the table is resized in between, so start at 0 and call it until it
+// returns 0. the cursor counts up from the highest bit of the mask down, the
+// buckets that one splits into when the table doubles come right after it.
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, void (*f)(HNode *, void *), void *arg);
 void hm_destroy(HMap *hmap);
+
+// reverse the bits
+inline uint64_t scan_reverse(uint64_t v)
+{
+    v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+    v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+    return __builtin_bswap64(v);
+}
+
+// add 1 to the bits of the mask in reverse order, 0 after the last bucket
+inline uint64_t scan_next(uint64_t cursor, uint64_t mask)
+{
+    cursor |= ~mask;
+    return scan_reverse(scan_reverse(cursor) + 1);
+}
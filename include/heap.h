@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// a binary min-heap. every item points to where its owner keeps the item's
+// position in the heap, it's kept up to date as items move, so the owner
+// can update or remove its item.
+struct HeapItem
+{
+    uint64_t val = 0;
+    uint32_t *ref = NULL;
+};
+
+// the position of an item that isn't in a heap
+const uint32_t k_heap_none = UINT32_MAX;
+
+void heap_push(std::vector<HeapItem> &heap, HeapItem item);
+// restore the order after heap[pos].val has changed
+void heap_fix(std::vector<HeapItem> &heap, size_t pos);
+// the ref of the removed item is set to k_heap_none
+void heap_remove(std::vector<HeapItem> &heap, size_t pos);
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stddef.h>
+
+// a background thread for the work too slow for an event loop,
+// like freeing a zset with millions of members.
+// the jobs run in the order they are submitted.
+
+void lazyfree_submit(void (*fn)(void *), void *arg);
+// the jobs submitted and not done yet
+size_t lazyfree_pending();
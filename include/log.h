@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+
+// a leveled logger.
+// the levels below LOG_LEVEL are removed at compile time, with their arguments.
+// a log call formats the line into a ring buffer of the calling thread,
+// without a lock or a syscall, and a background thread writes the rings
+// to stderr. when a ring is full, the line is dropped and counted.
+
+enum
+{
+    LL_TRACE = 0,
+    LL_DEBUG = 1,
+    LL_INFO = 2,
+    LL_WARN = 3,
+    LL_ERROR = 4,
+};
+
+// the lowest level compiled in
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LL_INFO
+#endif
+
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+// write out all the lines queued so far, from the calling thread
+void log_flush();
+// the lines logged and dropped so far, over all threads
+uint64_t log_lines();
+uint64_t log_dropped();
+
+#define log_at(level, ...)                  \
+    do                                      \
+    {                                       \
+        if ((level) >= LOG_LEVEL)           \
+        {                                   \
+            log_write((level), __VA_ARGS__); \
+        }                                   \
+    } while (0)
+
+#define log_trace(...) log_at(LL_TRACE, __VA_ARGS__)
+#define log_debug(...) log_at(LL_DEBUG, __VA_ARGS__)
+#define log_info(...) log_at(LL_INFO, __VA_ARGS__)
+#define log_warn(...) log_at(LL_WARN, __VA_ARGS__)
+#define log_error(...) log_at(LL_ERROR, __VA_ARGS__)
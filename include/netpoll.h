@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <poll.h>
+#include <vector>
+
+// readiness flags, independent of the backend
+enum
+{
+    NP_IN = 1,
+    NP_OUT = 2,
+    NP_ERR = 4,
+};
+
+enum
+{
+    NP_BACKEND_POLL = 0,
+    NP_BACKEND_EPOLL = 1, // linux only
+};
+
+struct NPEvent
+{
+    int fd = -1;
+    uint32_t events = 0;
+};
+
+// the event loop's poller.
+// a fd is registered once, and only touched again when its interest changes,
+// so the cost of one wait doesn't depend on the number of idle fds (epoll).
+struct NetPoll
+{
+    int backend = NP_BACKEND_POLL;
+    bool edge = false; // edge-triggered, epoll only
+    int epfd = -1;
+    // poll backend: the registered set is kept between waits
+    std::vector<struct pollfd> pfds;
+    std::vector<int> fd2idx; // fd -> index into pfds, -1 if not registered
+    // where the next wait starts looking at pfds. it's level-triggered, so
+    // starting at 0 each time would always return the same first max fds.
+    size_t next = 0;
+};
+
+bool np_init(NetPoll *np, int backend, bool edge);
+void np_close(NetPoll *np);
+bool np_add(NetPoll *np, int fd, uint32_t events);
+bool np_mod(NetPoll *np, int fd, uint32_t events);
+void np_del(NetPoll *np, int fd);
+int np_wait(NetPoll *np, NPEvent *out, int max, int timeout_ms);
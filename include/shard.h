@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "spsc.h"
+
+// a thread with its own event loop that owns a slice of the keyspace.
+// shards share nothing, they only talk by passing messages through their inboxes.
+struct Shard
+{
+    uint32_t id = 0;
+    // becomes readable when messages arrive (an eventfd, or a pipe)
+    int wake_rfd = -1;
+    int wake_wfd = -1;
+    // inbox[i]: messages from shard i
+    std::vector<SPSCQueue *> inbox;
+    size_t next_inbox = 0;
+    // only touched by the shard's own thread:
+    // messages that didn't fit in a full inbox, and the shards to wake up
+    std::vector<std::vector<void *>> backlog;
+    std::vector<bool> dirty;
+};
+
+bool shards_init(uint32_t n);
+uint32_t shard_count();
+Shard *shard_get(uint32_t id);
+// the shard that owns a key
+uint32_t shard_of(uint64_t hcode);
+// queue a message for another shard
+void shard_send(Shard *self, uint32_t dst, void *msg);
+// push the backlog and wake up the receivers, once per loop iteration.
+// returns true if some inbox is still full.
+bool shard_flush(Shard *self);
+// pop one message from any inbox, NULL if there's none
+void *shard_recv(Shard *self);
+// wake up a shard's event loop, from any thread
+void shard_wake(uint32_t id);
+// consume the wakeup notification
+void shard_clear_wake(Shard *self);
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// a size-class allocator for the small objects of the server (Entry, ZNode, Conn).
+// every thread has its own heap of 64 KB pages, a page holds objects of one
+// size class. an object freed by another thread goes back to its owner's heap.
+// objects larger than k_slab_max come from malloc.
+
+const size_t k_slab_max = 1024;
+
+void *slab_alloc(size_t size);
+// size is the one given to slab_alloc(), or anything up to slab_usable() of it
+void slab_free(void *ptr, size_t size);
+// the bytes actually available for an allocation of this size
+size_t slab_usable(size_t size);
+// give back to the calling thread's heap up to max objects freed by other
+// threads. returns true if there are more.
+bool slab_collect(size_t max);
+
+// a thread that's about to exit, with objects still in use, gives its heap
+// away. another thread adopts it, and gives the objects freed by anyone back
+// to it in slab_collect(). it's never allocated from again, and its pages go
+// as they become empty. NULL without USE_SLAB.
+struct SlabHeap;
+SlabHeap *slab_detach();
+void slab_adopt(SlabHeap *heap);
+
+struct SlabStats
+{
+    size_t live_objs = 0;   // allocated and not freed
+    size_t live_bytes = 0;  // their size classes
+    size_t page_bytes = 0;  // pages held by the heaps
+    size_t large_objs = 0;  // the ones from malloc
+    size_t large_bytes = 0;
+};
+
+// the totals over all threads
+void slab_stats(SlabStats *out);
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// a point-in-time dump of the keyspace, all numbers little endian:
+//   "SNAP", u32 version, i64 the wall clock time of the save in ms
+//   the records, a record per key:
+//     u8 type, i64 the deadline in wall clock ms or 0, u32 klen, the key
+//     SNAP_STR:  u32 vlen, the value
+//     SNAP_INT:  i64 the value
+//     SNAP_ZSET: u64 n, then n times f64 score, u32 len, the name,
+//                in (score, name) order
+//   u8 SNAP_EOF, u64 the number of records
+//   since version 2, the index of the chunks: u64 offset of each chunk, u64 n
+// a chunk is the records from its offset to the next one, or to SNAP_EOF.
+// each one decodes on its own, so they're loaded in parallel.
+enum
+{
+    SNAP_STR = 0,
+    SNAP_INT = 1,
+    SNAP_ZSET = 2,
+    SNAP_EOF = 0xff,
+};
+
+const uint32_t k_snap_version = 2;
+// a new chunk starts at the first record past this many bytes
+const size_t k_snap_chunk = 4 << 20;
+
+// buffered writes to a new file. an error sticks, and fails snap_commit().
+struct SnapWriter
+{
+    int fd = -1;
+    uint8_t *buf = NULL;
+    size_t used = 0;
+    uint64_t bytes = 0; // written to the file so far
+    bool failed = false;
+    std::vector<uint64_t> chunks;
+};
+
+// create path, nothing is written to it until snap_commit()
+bool snap_create(SnapWriter *w, const char *path);
+void snap_put(SnapWriter *w, const void *data, size_t len);
+void snap_u8(SnapWriter *w, uint8_t v);
+void snap_u32(SnapWriter *w, uint32_t v);
+void snap_u64(SnapWriter *w, uint64_t v);
+// before a record: start a chunk if the current one is big enough
+void snap_record(SnapWriter *w);
+// SNAP_EOF, the count and the index
+void snap_end(SnapWriter *w, uint64_t nrecords);
+// flush, fsync and close, then rename tmp to path and fsync its directory.
+// false on any error.
+bool snap_commit(SnapWriter *w, const char *tmp, const char *path);
+// close and remove tmp
+void snap_abort(SnapWriter *w, const char *tmp);
+// fsync the directory of path, a rename in it is only durable after.
+// the log's rewrite uses it too.
+bool sync_dir(const char *path);
+
+// reads from a chunk. going past its end sets failed,
+// and the reads after it return zeros.
+struct SnapCursor
+{
+    const uint8_t *pos = NULL;
+    const uint8_t *end = NULL;
+    bool failed = false;
+};
+
+// len bytes, NULL if failed
+const uint8_t *snap_get(SnapCursor *c, size_t len);
+uint8_t snap_get_u8(SnapCursor *c);
+uint32_t snap_get_u32(SnapCursor *c);
+uint64_t snap_get_u64(SnapCursor *c);
+
+// a snapshot mapped into memory
+struct SnapFile
+{
+    const uint8_t *data = NULL;
+    size_t size = 0;
+    int64_t time_ms = 0;
+    uint64_t nrecords = 0;
+    std::vector<SnapCursor> chunks;
+};
+
+// map a snapshot and find its chunks. NULL if it's fine, or what's wrong
+// with it. errno is ENOENT if there's no file.
+const char *snap_map(SnapFile *f, const char *path);
+void snap_unmap(SnapFile *f);
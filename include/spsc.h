@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <atomic>
+
+// a bounded lock-free queue of pointers, one producer thread and one consumer thread.
+// head and tail are on separate cache lines so the two sides don't bounce them.
+struct SPSCQueue
+{
+    alignas(64) std::atomic<size_t> head{0}; // next slot to pop, owned by the consumer
+    alignas(64) std::atomic<size_t> tail{0}; // next slot to push, owned by the producer
+    alignas(64) size_t mask = 0;
+    void **slots = NULL;
+};
+
+inline void spsc_init(SPSCQueue *q, size_t n)
+{
+    // n must be a power of 2
+    q->slots = (void **)calloc(n, sizeof(void *));
+    q->mask = n - 1;
+}
+
+// returns false if the queue is full
+inline bool spsc_push(SPSCQueue *q, void *item)
+{
+    size_t tail = q->tail.load(std::memory_order_relaxed);
+    if (tail - q->head.load(std::memory_order_acquire) > q->mask)
+    {
+        return false;
+    }
+    q->slots[tail & q->mask] = item;
+    q->tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+// returns NULL if the queue is empty
+inline void *spsc_pop(SPSCQueue *q)
+{
+    size_t head = q->head.load(std::memory_order_relaxed);
+    if (head == q->tail.load(std::memory_order_acquire))
+    {
+        return NULL;
+    }
+    void *item = q->slots[head & q->mask];
+    q->head.store(head + 1, std::memory_order_release);
+    return item;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "list.h"
+
+// a hierarchical timing wheel with a resolution of 1 ms.
+// level l has 64 slots of 64^l ms each, 4 levels cover 2^24 ms (4.6 hours),
+// the timers further than that wait in a separate list.
+// adding and canceling a timer are O(1), and finding the next deadline
+// doesn't scan the timers, only a bitmap per level.
+
+const size_t k_tw_bits = 6;
+const size_t k_tw_slots = 1 << k_tw_bits;
+const size_t k_tw_levels = 4;
+
+struct Timer
+{
+    DList link;
+    uint64_t expire_ms = 0;
+    uint32_t slot = 0; // where the timer is, to update the bitmap on cancel
+};
+
+struct TimerWheel
+{
+    // every timer that expires at or before now_ms has been handed out
+    uint64_t now_ms = 0;
+    size_t size = 0;
+    // a bit per slot that has timers
+    uint64_t occupied[k_tw_levels] = {};
+    DList slots[k_tw_levels][k_tw_slots];
+    // the timers too far for the wheel
+    DList far;
+};
+
+void tw_init(TimerWheel *tw, uint64_t now_ms);
+// a timer in the past expires on the next tw_advance()
+void tw_add(TimerWheel *tw, Timer *timer, uint64_t expire_ms);
+// does nothing if the timer isn't pending
+void tw_cancel(TimerWheel *tw, Timer *timer);
+inline bool tw_pending(Timer *timer)
+{
+    return timer->link.next != NULL;
+}
+// the time of the next thing to do: the earliest expiry, or moving the timers
+// of a slot down a level. UINT64_MAX if there are no timers.
+uint64_t tw_next(TimerWheel *tw);
+// move the timers that expire by now_ms to the list `due`.
+// they stay pending until tw_cancel() is called on them.
+void tw_advance(TimerWheel *tw, uint64_t now_ms, DList *due);
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// a minimal io_uring wrapper on top of the raw syscalls, linux only.
+// only what the server needs: multishot accept, recv into provided
+// buffers, send, poll, and batched submit/wait.
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+struct URCqe
+{
+    uint64_t user_data = 0;
+    int32_t res = 0;
+    uint32_t flags = 0;
+};
+
+struct URing
+{
+    int fd = -1;
+    // submission queue
+    unsigned *sq_head = NULL;
+    unsigned *sq_tail = NULL;
+    unsigned *sq_array = NULL;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    unsigned sq_pending = 0; // filled but not yet submitted
+    io_uring_sqe *sqes = NULL;
+    // completion queue
+    unsigned *cq_head = NULL;
+    unsigned *cq_tail = NULL;
+    unsigned cq_mask = 0;
+    io_uring_cqe *cqes = NULL;
+    // mmap'ed regions
+    void *sq_ptr = NULL;
+    size_t sq_size = 0;
+    void *cq_ptr = NULL;
+    size_t cq_size = 0;
+    size_t sqes_size = 0;
+    // provided buffers for recv
+    uint16_t bgid = 0;
+    uint32_t nbufs = 0;
+    uint32_t buf_size = 0;
+    uint8_t *bufs = NULL;
+    // the buffers the kernel didn't take back, provided again on the next submit
+    uint16_t *retry = NULL;
+    uint32_t nretry = 0;
+    // how many were given back so far, a recv waiting for one can go again
+    uint64_t recycled = 0;
+};
+
+bool ur_init(URing *ur, unsigned entries);
+bool ur_setup_bufs(URing *ur, uint16_t bgid, uint32_t nbufs, uint32_t buf_size);
+void ur_close(URing *ur);
+
+// prepare requests, they are submitted by the next ur_submit_and_wait()
+bool ur_accept(URing *ur, int fd, bool multishot, uint64_t user_data);
+bool ur_recv(URing *ur, int fd, size_t len, uint64_t user_data);
+bool ur_send(URing *ur, int fd, const void *buf, size_t len, uint64_t user_data);
+// one-shot readability notification
+bool ur_poll(URing *ur, int fd, uint64_t user_data);
+
+// submit everything prepared, and wait for at least 1 completion or a timeout
+int ur_submit_and_wait(URing *ur, int timeout_ms);
+bool ur_pop_cqe(URing *ur, URCqe *out);
+// a multishot request stays armed if this is true
+bool ur_cqe_more(const URCqe *cqe);
+// the provided buffer used by a recv completion
+bool ur_cqe_buffer(const URCqe *cqe, uint16_t *bid);
+
+// the provided buffer picked by a recv completion
+uint8_t *ur_buf(URing *ur, uint16_t bid);
+// give it back, it's provided to the kernel by the next submit
+void ur_recycle_buf(URing *ur, uint16_t bid);
@@ -1,28 +1,115 @@
 #pragma once
 
 #include "avl.h"
+#include "btree.h"
 #include "hashtable.h"
 #include <string>
 
-struct ZSet
+// a small zset, in one block with the members in (score, name) order:
+// the scores, then where each name starts, a byte of the hash of each
+// name, then the names back to back.
+struct ZPack
+{
+    uint32_t n = 0;    // members
+    uint32_t cap = 0;  // members that fit
+    uint32_t used = 0; // bytes of names
+    uint32_t room = 0; // bytes of names that fit
+    // double scores[cap];
+    // uint32_t offs[cap + 1];
+    // uint8_t tags[cap];
+    // char names[room];
+};
+
+// a big zset, indexed by name and by (score, name).
+// the second index is an AVL tree of the nodes,
+// or a B+tree of pointers to them with USE_BTREE (btree.h)
+struct ZTree
 {
+#ifdef USE_BTREE
+    BTree tree;
+#else
     AVLNode *tree = NULL;
+#endif
     HMap hmap;
 };
 
+// packed until it outgrows the limits, then a tree for good
+struct ZSet
+{
+    ZPack *pack = NULL;
+    ZTree *tree = NULL;
+};
+
 struct ZNode
 {
+#ifndef USE_BTREE
     AVLNode tree; // index by (score, name)
+#endif
     HNode hmap;   // index by name
     double score = 0;
     size_t len = 0;
     char name[0]; // variable length
 };
 
+// a zset stays packed up to this many members, with names up to this long
+struct ZSetLimits
+{
+    uint32_t pack_members = 64;
+    uint32_t pack_name = 64;
+};
+
+extern ZSetLimits g_zset_limits;
+
+// add a new (score, name) tuple, or update the score. true if added.
 bool zset_add(ZSet *zset, const char *name, size_t len, double score);
-ZNode *zset_lookup(ZSet *zset, const char *name, size_t len);
-ZNode *zset_pop(ZSet *zset, const char *name, size_t len);
-ZNode *zset_query(ZSet *zset, double score, const char *name, size_t len);
+bool zset_score(ZSet *zset, const char *name, size_t len, double *score);
+// true if removed
+bool zset_rem(ZSet *zset, const char *name, size_t len);
+size_t zset_size(ZSet *zset);
+
+// a tuple for zset_add_many()
+struct ZTuple
+{
+    double score = 0;
+    const char *name = NULL;
+    size_t len = 0;
+};
+
+// add or update many tuples, a later tuple of the same name wins. return how
+// many were added. a batch at least as big as the zset, and past the packed
+// limit, rebuilds the tree in O(n) instead of n inserts: O(n) comparisons
+// when the tuples are in (score, name) order, O(n log(n)) when not.
+size_t zset_add_many(ZSet *zset, const ZTuple *tuples, size_t n);
 void zset_dispose(ZSet *zset);
-ZNode *znode_offset(ZNode *node, int64_t offset);
-void znode_del(ZNode *node);
\ No newline at end of file
+
+// a position in the (score, name) order. the tuple is copied out,
+// valid is false when out of range.
+struct ZIter
+{
+    bool valid = false;
+    double score = 0;
+    const char *name = NULL;
+    size_t len = 0;
+    // packed
+    uint32_t idx = 0;
+    // tree
+    ZNode *node = NULL;
+#ifdef USE_BTREE
+    BIter pos;
+#endif
+};
+
+// the first tuple >= (score, name)
+ZIter zset_query(ZSet *zset, double score, const char *name, size_t len);
+// move to the succeeding or preceding tuple, O(log(n)) however far
+void zset_offset(ZSet *zset, ZIter *it, int64_t offset);
+// the 0-based position of a member, -1 if it's not there
+int64_t zset_rank(ZSet *zset, const char *name, size_t len);
+// the tuple at a position
+ZIter zset_at(ZSet *zset, int64_t rank);
+// the number of tuples with a score < score, or <= score if inclusive.
+// the tuples between 2 scores are the ranks between the 2 counts.
+int64_t zset_count_below(ZSet *zset, double score, bool inclusive);
+// remove the tuples at the positions [start, stop), return how many.
+// a big range rebuilds the tree from the rest.
+size_t zset_rem_range(ZSet *zset, int64_t start, int64_t stop);
@@ -0,0 +1,354 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include "aof.h"
+#include "snapshot.h"
+
+static struct
+{
+    int fd = -1;
+    int policy = AOF_FSYNC_NO;
+    void (*notify)() = NULL;
+    // the writes of the shards don't interleave, and take their tickets in order
+    std::mutex write_mu;
+    uint64_t written = 0; // the last ticket, under write_mu
+    std::atomic<uint64_t> synced{0};
+    // held by the fsync thread for each fsync, and by a rewrite while the
+    // new file isn't synced under its name yet
+    std::mutex sync_mu;
+    // the fsync thread waits on this, for a batch or for the next second
+    std::mutex mu;
+    std::condition_variable cv;
+    // written and read under mu
+    uint64_t fsyncs = 0;
+    uint64_t fsync_us = 0;
+    uint64_t fsync_max_us = 0;
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> writes{0};
+    std::atomic<uint64_t> size{0}; // of the file
+    // while a rewrite runs, the batches are kept for the new file too
+    bool rewriting = false; // under write_mu
+    std::string rewrite_buf;
+} g_aof;
+
+static uint64_t get_monotonic_usec()
+{
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+static uint64_t last_written()
+{
+    std::lock_guard<std::mutex> lock(g_aof.write_mu);
+    return g_aof.written;
+}
+
+static int sync_fd(int fd)
+{
+#ifdef __linux__
+    return fdatasync(fd);
+#else
+    return fsync(fd);
+#endif
+}
+
+static void *aof_main(void *)
+{
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(g_aof.mu);
+            if (g_aof.policy == AOF_FSYNC_ALWAYS)
+            {
+                g_aof.cv.wait(lock, [] { return last_written() > g_aof.synced.load(); });
+            }
+            else
+            {
+                g_aof.cv.wait_for(lock, std::chrono::seconds(1));
+            }
+        }
+        std::unique_lock<std::mutex> sync_lock(g_aof.sync_mu);
+        // everything written before this point is in the fsync
+        uint64_t ticket = last_written();
+        if (ticket == g_aof.synced.load())
+        {
+            continue;
+        }
+        uint64_t start_us = get_monotonic_usec();
+        if (sync_fd(g_aof.fd) != 0)
+        {
+            // the data may be lost, don't reply as if it weren't
+            fprintf(stderr, "aof: fsync: %s\n", strerror(errno));
+            abort();
+        }
+        uint64_t us = get_monotonic_usec() - start_us;
+        g_aof.synced.store(ticket, std::memory_order_release);
+        sync_lock.unlock();
+        {
+            std::lock_guard<std::mutex> lock(g_aof.mu);
+            g_aof.fsyncs++;
+            g_aof.fsync_us += us;
+            g_aof.fsync_max_us = us > g_aof.fsync_max_us ? us : g_aof.fsync_max_us;
+        }
+        if (g_aof.policy == AOF_FSYNC_ALWAYS && g_aof.notify)
+        {
+            g_aof.notify();
+        }
+    }
+    return NULL;
+}
+
+bool aof_open(const char *path, int policy, void (*notify)())
+{
+    g_aof.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (g_aof.fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat(g_aof.fd, &st) != 0)
+    {
+        return false;
+    }
+    g_aof.size = (uint64_t)st.st_size;
+    g_aof.policy = policy;
+    g_aof.notify = notify;
+    if (policy == AOF_FSYNC_NO)
+    {
+        return true;
+    }
+    pthread_t tid;
+    if (0 != pthread_create(&tid, NULL, &aof_main, NULL))
+    {
+        return false;
+    }
+    pthread_detach(tid);
+    return true;
+}
+
+bool aof_write_all(int fd, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    while (len > 0)
+    {
+        ssize_t rv = write(fd, p, len);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv <= 0)
+        {
+            return false;
+        }
+        p += rv;
+        len -= (size_t)rv;
+    }
+    return true;
+}
+
+uint64_t aof_write(const void *data, size_t len)
+{
+    uint64_t ticket = 0;
+    {
+        std::lock_guard<std::mutex> lock(g_aof.write_mu);
+        if (!aof_write_all(g_aof.fd, data, len))
+        {
+            return 0;
+        }
+        if (g_aof.rewriting)
+        {
+            g_aof.rewrite_buf.append((const char *)data, len);
+        }
+        g_aof.bytes.fetch_add(len, std::memory_order_relaxed);
+        g_aof.size.fetch_add(len, std::memory_order_relaxed);
+        ticket = ++g_aof.written;
+    }
+    g_aof.writes.fetch_add(1, std::memory_order_relaxed);
+    if (g_aof.policy == AOF_FSYNC_ALWAYS)
+    {
+        // under mu, or the fsync thread can miss it between its check and its wait
+        std::lock_guard<std::mutex> lock(g_aof.mu);
+        g_aof.cv.notify_one();
+    }
+    return ticket;
+}
+
+uint64_t aof_synced()
+{
+    return g_aof.synced.load(std::memory_order_acquire);
+}
+
+uint64_t aof_size()
+{
+    return g_aof.size.load(std::memory_order_relaxed);
+}
+
+void aof_rewrite_begin()
+{
+    std::lock_guard<std::mutex> lock(g_aof.write_mu);
+    g_aof.rewriting = true;
+    g_aof.rewrite_buf.clear();
+}
+
+void aof_rewrite_abort()
+{
+    std::lock_guard<std::mutex> lock(g_aof.write_mu);
+    g_aof.rewriting = false;
+    std::string().swap(g_aof.rewrite_buf);
+}
+
+// the batches kept are moved to tmp and synced outside the lock while there
+// are more than this, up to k_rewrite_rounds times
+const size_t k_rewrite_tail = 64 * 1024;
+const int k_rewrite_rounds = 8;
+
+bool aof_rewrite_end(const char *tmp, const char *path, uint64_t *diff)
+{
+    *diff = 0;
+    int fd = open(tmp, O_WRONLY | O_APPEND | O_CLOEXEC);
+    bool ok = fd >= 0;
+    // the shards go on writing meanwhile, each round takes what they added
+    std::string chunk;
+    for (int round = 0; ok && round < k_rewrite_rounds; round++)
+    {
+        {
+            std::lock_guard<std::mutex> lock(g_aof.write_mu);
+            if (g_aof.rewrite_buf.size() <= k_rewrite_tail)
+            {
+                break;
+            }
+            chunk.swap(g_aof.rewrite_buf);
+        }
+        *diff += chunk.size();
+        ok = aof_write_all(fd, chunk.data(), chunk.size()) && sync_fd(fd) == 0;
+        chunk.clear();
+    }
+    // a batch synced from here on is only in the new file, it isn't reported
+    // synced until the file is, under the name of the log
+    std::lock_guard<std::mutex> sync_lock(g_aof.sync_mu);
+    {
+        // the rest, with the shards held: they can't write in between, or
+        // it'd be in the old file only
+        std::lock_guard<std::mutex> lock(g_aof.write_mu);
+        *diff += g_aof.rewrite_buf.size();
+        struct stat st;
+        ok = ok && aof_write_all(fd, g_aof.rewrite_buf.data(), g_aof.rewrite_buf.size()) &&
+             fstat(fd, &st) == 0;
+        g_aof.rewriting = false;
+        std::string().swap(g_aof.rewrite_buf);
+        if (!ok)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            unlink(tmp);
+            return false;
+        }
+        // the same fd number, the fsync thread syncs the batches it hasn't
+        // yet in the new file, they're all there
+#ifdef __linux__
+        int rv = dup3(fd, g_aof.fd, O_CLOEXEC);
+#else
+        int rv = dup2(fd, g_aof.fd);
+        if (rv >= 0)
+        {
+            rv = fcntl(g_aof.fd, F_SETFD, FD_CLOEXEC);
+        }
+#endif
+        if (rv < 0)
+        {
+            fprintf(stderr, "aof: dup: %s\n", strerror(errno));
+            abort();
+        }
+        g_aof.size = (uint64_t)st.st_size;
+    }
+    // the shards write to the new file, the old one is the log until the rename
+    if (sync_fd(fd) != 0 || rename(tmp, path) != 0 || !sync_dir(path))
+    {
+        // the writes go to a file that isn't the log, or may not be after a crash
+        fprintf(stderr, "aof: rewrite: %s\n", strerror(errno));
+        abort();
+    }
+    close(fd);
+    return true;
+}
+
+void aof_stats(AofStats *out)
+{
+    out->bytes = g_aof.bytes.load(std::memory_order_relaxed);
+    out->writes = g_aof.writes.load(std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(g_aof.mu);
+    out->fsyncs = g_aof.fsyncs;
+    out->fsync_us = g_aof.fsync_us;
+    out->fsync_max_us = g_aof.fsync_max_us;
+}
+
+const char *aof_map(AofLog *log, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return strerror(errno);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return strerror(errno);
+    }
+    size_t size = (size_t)st.st_size;
+    if (size == 0)
+    {
+        close(fd);
+        return NULL; // nothing to replay
+    }
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return strerror(errno);
+    }
+    (void)madvise(data, size, MADV_SEQUENTIAL);
+    log->data = (const uint8_t *)data;
+    // the records that are all there
+    size_t pos = 0;
+    while (size - pos >= 4)
+    {
+        uint32_t len = 0;
+        memcpy(&len, &log->data[pos], 4);
+        if (len > size - pos - 4)
+        {
+            break;
+        }
+        pos += 4 + len;
+    }
+    log->size = pos;
+    log->tail = size - pos;
+    return NULL;
+}
+
+void aof_unmap(AofLog *log)
+{
+    if (log->data)
+    {
+        munmap((void *)log->data, log->size + log->tail);
+    }
+    log->data = NULL;
+    log->size = log->tail = 0;
+}
@@ -8,11 +8,6 @@ static uint32_t avl_depth(AVLNode *node)
     return node ? node->depth : 0;
 }
 
-static uint32_t avl_cnt(AVLNode *node)
-{
-    return node ? node->cnt : 0;
-}
-
 static uint32_t max(uint32_t l, uint32_t r)
 {
     return l < r ? r : l;
@@ -230,13 +225,13 @@ AVLNode *avl_offset(AVLNode *node, int64_t offset)
         {
             // the node is inside the right subtree
             node = node->right;
-            pos += avl_cnt(node->left) - 1;
+            pos += avl_cnt(node->left) + 1;
         }
         else if (pos > offset && pos - avl_cnt(node->left) <= offset)
         {
             // target is inside the left subtree
             node = node->left;
-            pos -= avl_cnt(node->left) + 1;
+            pos -= avl_cnt(node->right) + 1;
         }
         else
         {
@@ -258,4 +253,27 @@ AVLNode *avl_offset(AVLNode *node, int64_t offset)
         }
     }
     return node;
-}
\ No newline at end of file
+}
+// the middle node is the root, so the depths of the 2 sides differ by 1 at most
+AVLNode *avl_build(AVLNode **nodes, size_t n)
+{
+    if (n == 0)
+    {
+        return NULL;
+    }
+    size_t mid = n / 2;
+    AVLNode *root = nodes[mid];
+    root->parent = NULL;
+    root->left = avl_build(nodes, mid);
+    root->right = avl_build(nodes + mid + 1, n - mid - 1);
+    if (root->left)
+    {
+        root->left->parent = root;
+    }
+    if (root->right)
+    {
+        root->right->parent = root;
+    }
+    avl_update(root);
+    return root;
+}
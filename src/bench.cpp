@@ -0,0 +1,1202 @@
+/*
+** bench.cpp -- load generator for the server
+**
+** ./bench idle <nconns> <nreqs>
+**      open nconns idle connections, then measure GET round trips on one more
+** ./bench conc <nconns> <rounds>
+**      nconns connections each send a GET per round, report the throughput
+** ./bench pipeline <nconns> <depth> <rounds>
+**      like conc, but each connection sends depth GETs per round in one write
+** ./bench kv <nthreads> <nconns> <seconds>
+**      nthreads client threads, each with nconns connections, send random
+**      GET/SET for some seconds, report the total throughput
+** ./bench storm <nconns>
+**      open nconns connections at once, like clients reconnecting after a
+**      deploy, report the time from connect() to the first response
+** ./bench churn <nkeys> <rounds>
+**      fill nkeys keys and zset members, then replace and delete them at
+**      random with values of random sizes for rounds of 10k requests,
+**      then delete everything. prints the server's MEMSTATS after each step
+** ./bench lazyfree <nmembers>
+**      fill a zset with nmembers members, then delete it with DEL and
+**      with UNLINK while another connection sends GETs, report the GET
+**      latencies and the time to the DEL/UNLINK reply
+** ./bench zrange <nmembers> <width> <nqueries>
+**      fill a zset with the scores 0 to nmembers-1, then time ZRANK, ZCOUNT,
+**      ZRANGEBYSCORE, ZREVRANGEBYSCORE and ZREMRANGEBYSCORE over width
+**      scores against the same answer from ZQUERY pages and ZREMs, the
+**      way a client did it before. the client side ZRANK pages from the
+**      start, so it's only timed for 100 queries at most.
+** ./bench zload <nmembers> <batch>
+**      load nmembers members into an empty zset with one ZADD per member,
+**      pipelined, then with ZADDs of batch members, in order and shuffled.
+**      reports the time to load each.
+** ./bench save <nkeys> <vsize>
+**      fill nkeys keys with values of vsize bytes, and a zset of nkeys/4
+**      members, then BGSAVE. reports the GET latency before and during the
+**      save, with another connection overwriting keys meanwhile, the time
+**      of the fork, and the child's write throughput and copy-on-write.
+** ./bench aof <nconns> <depth> <seconds>
+**      nconns connections each send depth SETs of 100 bytes per round trip,
+**      for some seconds. reports the SETs/s, the round trip latencies, and
+**      from AOFSTATS the fsync policy of the server, its writes and fsyncs:
+**      start the server with each --appendfsync to compare them.
+*/
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "common.h"
+
+#define PORT "3490"
+#define IP "127.0.0.1"
+
+static void die(const char *msg)
+{
+    int err = errno;
+    fprintf(stderr, "[%d] %s\n", err, msg);
+    abort();
+}
+
+static uint64_t get_monotonic_usec()
+{
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+// blocking connection to the server
+static int connect_server()
+{
+    struct addrinfo hints, *servinfo, *p;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(IP, PORT, &hints, &servinfo) != 0)
+    {
+        die("getaddrinfo");
+    }
+    int fd = -1;
+    for (p = servinfo; p != NULL; p = p->ai_next)
+    {
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd == -1)
+        {
+            continue;
+        }
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == -1)
+        {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        break;
+    }
+    freeaddrinfo(servinfo);
+    if (fd < 0)
+    {
+        die("connect");
+    }
+    int yes = 1;
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    return fd;
+}
+
+// append one request in the wire format: len, nargs, (len, arg)...
+static void append_req(std::string &buf, const std::vector<std::string> &cmd)
+{
+    uint32_t len = 4;
+    for (const std::string &s : cmd)
+    {
+        len += 4 + s.size();
+    }
+    uint32_t n = (uint32_t)cmd.size();
+    buf.append((char *)&len, 4);
+    buf.append((char *)&n, 4);
+    for (const std::string &s : cmd)
+    {
+        uint32_t sz = (uint32_t)s.size();
+        buf.append((char *)&sz, 4);
+        buf.append(s);
+    }
+}
+
+static void write_all(int fd, const char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t rv = send(fd, buf, n, 0);
+        if (rv < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            die("send");
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+}
+
+static void read_full(int fd, char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t rv = recv(fd, buf, n, 0);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv <= 0)
+        {
+            die("recv");
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+}
+
+// read one response, return its payload
+static void read_res(int fd, std::string &out)
+{
+    uint32_t len = 0;
+    read_full(fd, (char *)&len, 4);
+    out.resize(len);
+    read_full(fd, &out[0], len);
+}
+
+// read n responses, with as few recv() as possible
+static void read_n_res(int fd, size_t n, std::string &buf)
+{
+    buf.clear();
+    size_t pos = 0;
+    char tmp[64 * 1024];
+    while (n > 0)
+    {
+        // consume the complete responses in buf
+        while (n > 0 && buf.size() - pos >= 4)
+        {
+            uint32_t len = 0;
+            memcpy(&len, &buf[pos], 4);
+            if (buf.size() - pos < 4 + len)
+            {
+                break;
+            }
+            pos += 4 + len;
+            n--;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        ssize_t rv = recv(fd, tmp, sizeof(tmp), 0);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv <= 0)
+        {
+            die("recv");
+        }
+        buf.append(tmp, rv);
+    }
+}
+
+static void report(const char *name, std::vector<uint64_t> &lat_us)
+{
+    if (lat_us.empty())
+    {
+        return;
+    }
+    std::sort(lat_us.begin(), lat_us.end());
+    uint64_t sum = 0;
+    for (uint64_t v : lat_us)
+    {
+        sum += v;
+    }
+    printf("%s: n=%zu avg=%.2fus p50=%luus p99=%luus max=%luus\n",
+           name, lat_us.size(), (double)sum / lat_us.size(),
+           (unsigned long)lat_us[lat_us.size() / 2],
+           (unsigned long)lat_us[lat_us.size() * 99 / 100],
+           (unsigned long)lat_us.back());
+}
+
+// connect, and make sure the server has accepted it with one round trip,
+// so opening many connections doesn't overflow the listen backlog.
+static int connect_accepted()
+{
+    int fd = connect_server();
+    std::string req, res;
+    append_req(req, {"get", "bench:key"});
+    write_all(fd, req.data(), req.size());
+    read_res(fd, res);
+    return fd;
+}
+
+// per-request cost while many other connections sit idle.
+// with epoll this should stay flat as nconns grows, with poll it grows linearly.
+static void bench_idle(int nconns, int nreqs)
+{
+    std::vector<int> idle;
+    for (int i = 0; i < nconns; ++i)
+    {
+        idle.push_back(connect_accepted());
+    }
+    int fd = connect_server();
+    std::string req, res;
+    append_req(req, {"set", "bench:key", "value"});
+    write_all(fd, req.data(), req.size());
+    read_res(fd, res);
+
+    req.clear();
+    append_req(req, {"get", "bench:key"});
+    std::vector<uint64_t> lat_us;
+    for (int i = 0; i < nreqs; ++i)
+    {
+        uint64_t start = get_monotonic_usec();
+        write_all(fd, req.data(), req.size());
+        read_res(fd, res);
+        lat_us.push_back(get_monotonic_usec() - start);
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "get with %d idle conns", nconns);
+    report(name, lat_us);
+
+    close(fd);
+    for (int c : idle)
+    {
+        close(c);
+    }
+}
+
+// many active connections at once, each round sends one GET on every
+// connection before reading the replies, so the server sees them in batches.
+static void bench_conc(int nconns, int rounds)
+{
+    std::vector<int> fds;
+    for (int i = 0; i < nconns; ++i)
+    {
+        fds.push_back(connect_accepted());
+    }
+    std::string req, res;
+    append_req(req, {"get", "bench:key"});
+    uint64_t start = get_monotonic_usec();
+    for (int r = 0; r < rounds; ++r)
+    {
+        for (int fd : fds)
+        {
+            write_all(fd, req.data(), req.size());
+        }
+        for (int fd : fds)
+        {
+            read_res(fd, res);
+        }
+    }
+    uint64_t elapsed = get_monotonic_usec() - start;
+    double nreqs = (double)nconns * rounds;
+    printf("%d conns: %.0f reqs in %.3fs, %.0f req/s\n",
+           nconns, nreqs, elapsed / 1e6, nreqs * 1e6 / elapsed);
+    for (int fd : fds)
+    {
+        close(fd);
+    }
+}
+
+// pipelined requests, the server can batch the responses of a round
+static void bench_pipeline(int nconns, int depth, int rounds)
+{
+    std::vector<int> fds;
+    for (int i = 0; i < nconns; ++i)
+    {
+        fds.push_back(connect_accepted());
+    }
+    std::string req, buf;
+    for (int i = 0; i < depth; ++i)
+    {
+        append_req(req, {"get", "bench:key"});
+    }
+    uint64_t start = get_monotonic_usec();
+    for (int r = 0; r < rounds; ++r)
+    {
+        for (int fd : fds)
+        {
+            write_all(fd, req.data(), req.size());
+        }
+        for (int fd : fds)
+        {
+            read_n_res(fd, (size_t)depth, buf);
+        }
+    }
+    uint64_t elapsed = get_monotonic_usec() - start;
+    double nreqs = (double)nconns * depth * rounds;
+    printf("%d conns, depth %d: %.0f reqs in %.3fs, %.0f req/s\n",
+           nconns, depth, nreqs, elapsed / 1e6, nreqs * 1e6 / elapsed);
+    for (int fd : fds)
+    {
+        close(fd);
+    }
+}
+
+struct KVWorker
+{
+    pthread_t tid;
+    int nconns = 0;
+    uint64_t deadline_us = 0;
+    uint64_t ops = 0;
+};
+
+static void *kv_worker(void *arg)
+{
+    KVWorker *w = (KVWorker *)arg;
+    std::vector<int> fds;
+    for (int i = 0; i < w->nconns; ++i)
+    {
+        fds.push_back(connect_accepted());
+    }
+    unsigned seed = (unsigned)(uintptr_t)w;
+    std::string req, res;
+    while (get_monotonic_usec() < w->deadline_us)
+    {
+        for (int fd : fds)
+        {
+            req.clear();
+            std::string key = "kv:" + std::to_string(rand_r(&seed) % 100000);
+            if (rand_r(&seed) % 2)
+            {
+                append_req(req, {"get", key});
+            }
+            else
+            {
+                append_req(req, {"set", key, "value"});
+            }
+            write_all(fd, req.data(), req.size());
+        }
+        for (int fd : fds)
+        {
+            read_res(fd, res);
+        }
+        w->ops += fds.size();
+    }
+    for (int fd : fds)
+    {
+        close(fd);
+    }
+    return NULL;
+}
+
+// GET/SET throughput from many client threads, to see it scale with --shards
+static void bench_kv(int nthreads, int nconns, int seconds)
+{
+    std::vector<KVWorker> workers(nthreads);
+    uint64_t start = get_monotonic_usec();
+    for (KVWorker &w : workers)
+    {
+        w.nconns = nconns;
+        w.deadline_us = start + (uint64_t)seconds * 1000000;
+        if (0 != pthread_create(&w.tid, NULL, &kv_worker, &w))
+        {
+            die("pthread_create");
+        }
+    }
+    uint64_t ops = 0;
+    for (KVWorker &w : workers)
+    {
+        pthread_join(w.tid, NULL);
+        ops += w.ops;
+    }
+    uint64_t elapsed = get_monotonic_usec() - start;
+    printf("%d threads x %d conns: %lu ops in %.3fs, %.0f ops/s\n",
+           nthreads, nconns, (unsigned long)ops, elapsed / 1e6, ops * 1e6 / elapsed);
+}
+
+struct StormConn
+{
+    int fd = -1;
+    uint64_t start_us = 0;
+    bool sent = false;
+    std::string res;
+};
+
+// a reconnect storm: every client connects at the same time and sends a GET
+// as soon as it's connected, so this measures the accept latency under load.
+static void bench_storm(int nconns)
+{
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)atoi(PORT));
+    inet_pton(AF_INET, IP, &addr.sin_addr);
+    std::string req;
+    append_req(req, {"get", "bench:key"});
+
+    std::vector<StormConn> conns(nconns);
+    std::vector<struct pollfd> pfds(nconns);
+    uint64_t start = get_monotonic_usec();
+    for (int i = 0; i < nconns; ++i)
+    {
+        StormConn &c = conns[i];
+        c.fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (c.fd < 0)
+        {
+            die("socket");
+        }
+        fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL, 0) | O_NONBLOCK);
+        c.start_us = get_monotonic_usec();
+        if (connect(c.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+        {
+            die("connect");
+        }
+        pfds[i] = {c.fd, POLLOUT, 0};
+    }
+
+    std::vector<uint64_t> lat_us;
+    int failed = 0;
+    int remain = nconns;
+    while (remain > 0)
+    {
+        if (poll(pfds.data(), pfds.size(), 10000) <= 0)
+        {
+            fprintf(stderr, "timeout with %d connections left\n", remain);
+            break;
+        }
+        for (int i = 0; i < nconns; ++i)
+        {
+            StormConn &c = conns[i];
+            struct pollfd &pfd = pfds[i];
+            if (pfd.fd < 0 || !pfd.revents)
+            {
+                continue;
+            }
+            bool done = false;
+            if (!c.sent)
+            {
+                // connected, the request is small enough for one send
+                c.sent = send(c.fd, req.data(), req.size(), MSG_NOSIGNAL) == (ssize_t)req.size();
+                done = !c.sent;
+                pfd.events = POLLIN;
+            }
+            else
+            {
+                char buf[256];
+                ssize_t rv = recv(c.fd, buf, sizeof(buf), 0);
+                if (rv > 0)
+                {
+                    c.res.append(buf, rv);
+                }
+                uint32_t len = 0;
+                if (c.res.size() >= 4)
+                {
+                    memcpy(&len, c.res.data(), 4);
+                }
+                if (c.res.size() >= 4 && c.res.size() >= 4 + len)
+                {
+                    lat_us.push_back(get_monotonic_usec() - c.start_us);
+                    done = true;
+                }
+                else if (rv == 0 || (rv < 0 && errno != EAGAIN))
+                {
+                    done = true;
+                    c.sent = false;
+                }
+            }
+            if (done)
+            {
+                failed += c.sent ? 0 : 1;
+                close(c.fd);
+                pfd.fd = -1;
+                remain--;
+            }
+        }
+    }
+    uint64_t elapsed = get_monotonic_usec() - start;
+    char name[64];
+    snprintf(name, sizeof(name), "first response of %d conns", nconns);
+    report(name, lat_us);
+    printf("all done in %.3fs, %d failed\n", elapsed / 1e6, failed + remain);
+    for (int i = 0; i < nconns; ++i)
+    {
+        if (pfds[i].fd >= 0)
+        {
+            close(pfds[i].fd);
+        }
+    }
+}
+
+// print a MEMSTATS response: an array of (name, number) pairs
+static void print_memstats(int fd, const char *step)
+{
+    std::string req, res;
+    append_req(req, {"memstats"});
+    write_all(fd, req.data(), req.size());
+    read_res(fd, res);
+    printf("%s:", step);
+    size_t pos = 5; // SER_ARR and the length
+    while (pos < res.size())
+    {
+        uint32_t len = 0;
+        memcpy(&len, &res[pos + 1], 4);
+        std::string name = res.substr(pos + 5, len);
+        pos += 5 + len;
+        if (res[pos] == SER_INT)
+        {
+            int64_t val = 0;
+            memcpy(&val, &res[pos + 1], 8);
+            printf(" %s=%lld", name.c_str(), (long long)val);
+        }
+        else
+        {
+            double val = 0;
+            memcpy(&val, &res[pos + 1], 8);
+            printf(" %s=%.3f", name.c_str(), val);
+        }
+        pos += 9;
+    }
+    printf("\n");
+}
+
+// send the requests in batches of 1000
+static void send_batched(int fd, std::vector<std::vector<std::string>> &cmds)
+{
+    std::string req, buf;
+    for (size_t i = 0; i < cmds.size(); i += 1000)
+    {
+        req.clear();
+        size_t n = std::min(cmds.size() - i, (size_t)1000);
+        for (size_t j = 0; j < n; ++j)
+        {
+            append_req(req, cmds[i + j]);
+        }
+        write_all(fd, req.data(), req.size());
+        read_n_res(fd, n, buf);
+    }
+    cmds.clear();
+}
+
+static std::string churn_val(unsigned *seed)
+{
+    return std::string(1 + rand_r(seed) % 200, 'v');
+}
+
+// SET/DEL and ZADD/ZREM with objects of many sizes
+static void bench_churn(int nkeys, int rounds)
+{
+    int fd = connect_server();
+    unsigned seed = 1;
+    std::vector<std::vector<std::string>> cmds;
+    print_memstats(fd, "start");
+    uint64_t start = get_monotonic_usec();
+    for (int i = 0; i < nkeys; ++i)
+    {
+        std::string id = std::to_string(i);
+        cmds.push_back({"set", "churn:" + id, churn_val(&seed)});
+        cmds.push_back({"zadd", "churn:z" + std::to_string(i % 100), id,
+                        std::string(1 + rand_r(&seed) % 100, 'm') + id});
+    }
+    send_batched(fd, cmds);
+    print_memstats(fd, "filled");
+    for (int r = 0; r < rounds; ++r)
+    {
+        for (int i = 0; i < 10000; ++i)
+        {
+            std::string id = std::to_string(rand_r(&seed) % nkeys);
+            switch (rand_r(&seed) % 4)
+            {
+            case 0:
+                cmds.push_back({"set", "churn:" + id, churn_val(&seed)});
+                break;
+            case 1:
+                cmds.push_back({"del", "churn:" + id});
+                break;
+            case 2:
+                cmds.push_back({"zadd", "churn:z" + std::to_string(rand_r(&seed) % 100), id,
+                                std::string(1 + rand_r(&seed) % 100, 'm') + id});
+                break;
+            default:
+                cmds.push_back({"zrem", "churn:z" + std::to_string(rand_r(&seed) % 100),
+                                std::string(1 + rand_r(&seed) % 100, 'm') + id});
+                break;
+            }
+        }
+        send_batched(fd, cmds);
+    }
+    print_memstats(fd, "churned");
+    for (int i = 0; i < nkeys; ++i)
+    {
+        cmds.push_back({"del", "churn:" + std::to_string(i)});
+    }
+    for (int i = 0; i < 100; ++i)
+    {
+        cmds.push_back({"del", "churn:z" + std::to_string(i)});
+    }
+    send_batched(fd, cmds);
+    print_memstats(fd, "deleted");
+    printf("%.3fs\n", (get_monotonic_usec() - start) / 1e6);
+    close(fd);
+}
+
+struct GetLoop
+{
+    pthread_t tid;
+    volatile bool stop = false;
+    std::vector<uint64_t> lat_us;
+};
+
+// GETs one at a time until stopped
+static void *get_loop(void *arg)
+{
+    GetLoop *g = (GetLoop *)arg;
+    int fd = connect_accepted();
+    std::string req, res;
+    append_req(req, {"get", "lazy:key"});
+    while (!g->stop)
+    {
+        uint64_t start = get_monotonic_usec();
+        write_all(fd, req.data(), req.size());
+        read_res(fd, res);
+        g->lat_us.push_back(get_monotonic_usec() - start);
+    }
+    close(fd);
+    return NULL;
+}
+
+// the GET latency while a large zset is deleted
+static void bench_lazyfree(int nmembers)
+{
+    int fd = connect_server();
+    std::vector<std::vector<std::string>> cmds;
+    std::string req, res;
+    append_req(req, {"set", "lazy:key", "value"});
+    write_all(fd, req.data(), req.size());
+    read_res(fd, res);
+    for (const char *del : {"del", "unlink"})
+    {
+        uint64_t start = get_monotonic_usec();
+        for (int i = 0; i < nmembers; ++i)
+        {
+            cmds.push_back({"zadd", "lazy:z", std::to_string(i), "m" + std::to_string(i)});
+        }
+        send_batched(fd, cmds);
+        printf("%s: filled %d members in %.3fs\n", del, nmembers, (get_monotonic_usec() - start) / 1e6);
+
+        GetLoop g;
+        if (0 != pthread_create(&g.tid, NULL, &get_loop, &g))
+        {
+            die("pthread_create");
+        }
+        usleep(200 * 1000);
+        req.clear();
+        append_req(req, {del, "lazy:z"});
+        start = get_monotonic_usec();
+        write_all(fd, req.data(), req.size());
+        read_res(fd, res);
+        uint64_t del_us = get_monotonic_usec() - start;
+        usleep(1000 * 1000);
+        g.stop = true;
+        pthread_join(g.tid, NULL);
+
+        printf("%s: reply in %.3fms\n", del, del_us / 1e3);
+        char name[64];
+        snprintf(name, sizeof(name), "%s: get", del);
+        report(name, g.lat_us);
+        print_memstats(fd, del);
+    }
+    close(fd);
+}
+
+typedef std::vector<std::pair<std::string, double>> Pairs;
+
+const char *k_zrange_key = "zrange:z";
+const size_t k_zrange_page = 100;
+
+static void round_trip(int fd, const std::vector<std::string> &cmd, std::string &res)
+{
+    std::string req;
+    append_req(req, cmd);
+    write_all(fd, req.data(), req.size());
+    read_res(fd, res);
+}
+
+static std::string dbl2str(double val)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.17g", val);
+    return buf;
+}
+
+// the (name, score) pairs of a ZQUERY reply
+static void parse_pairs(const std::string &res, Pairs &out)
+{
+    out.clear();
+    uint32_t n = 0;
+    memcpy(&n, &res[1], 4);
+    size_t pos = 5; // SER_ARR and the length
+    for (uint32_t i = 0; i < n; i += 2)
+    {
+        uint32_t len = 0;
+        memcpy(&len, &res[pos + 1], 4);
+        std::string name = res.substr(pos + 5, len);
+        pos += 5 + len;
+        double score = 0;
+        memcpy(&score, &res[pos + 1], 8);
+        pos += 9;
+        out.emplace_back(name, score);
+    }
+}
+
+// the members with min <= score <= max from ZQUERY pages,
+// each page starts after the last member of the one before
+static void client_range(int fd, double min, double max, Pairs &out)
+{
+    out.clear();
+    std::string score = dbl2str(min), name, res;
+    const char *offset = "0";
+    Pairs page;
+    while (true)
+    {
+        // the limit counts the names and the scores
+        round_trip(fd, {"zquery", k_zrange_key, score, name, offset, std::to_string(2 * k_zrange_page)}, res);
+        parse_pairs(res, page);
+        for (auto &p : page)
+        {
+            if (p.second > max)
+            {
+                return;
+            }
+            out.push_back(p);
+        }
+        if (page.size() < k_zrange_page)
+        {
+            return;
+        }
+        score = dbl2str(page.back().second);
+        name = page.back().first;
+        offset = "1";
+    }
+}
+
+static void bench_zrange(int nmembers, int width, int nqueries)
+{
+    int fd = connect_server();
+    std::vector<std::vector<std::string>> cmds;
+    std::string res;
+    round_trip(fd, {"del", k_zrange_key}, res);
+    for (int i = 0; i < nmembers; ++i)
+    {
+        cmds.push_back({"zadd", k_zrange_key, std::to_string(i), "m" + std::to_string(i)});
+    }
+    send_batched(fd, cmds);
+    unsigned seed = 1;
+    Pairs pairs;
+    std::vector<uint64_t> lat, lat_client;
+
+    // the rank of a random member
+    for (int q = 0; q < nqueries; ++q)
+    {
+        std::string name = "m" + std::to_string(rand_r(&seed) % nmembers);
+        uint64_t start = get_monotonic_usec();
+        round_trip(fd, {"zrank", k_zrange_key, name}, res);
+        lat.push_back(get_monotonic_usec() - start);
+        if (q >= 100)
+        {
+            continue;
+        }
+        start = get_monotonic_usec();
+        round_trip(fd, {"zscore", k_zrange_key, name}, res);
+        double score = 0;
+        memcpy(&score, &res[1], 8);
+        client_range(fd, -INFINITY, score, pairs);
+        lat_client.push_back(get_monotonic_usec() - start);
+    }
+    report("zrank", lat);
+    report("zrank client", lat_client);
+
+    // count, forward and reverse ranges of width scores
+    for (const char *cmd : {"zcount", "zrangebyscore", "zrevrangebyscore"})
+    {
+        lat.clear();
+        lat_client.clear();
+        bool rev = 0 == strcmp(cmd, "zrevrangebyscore");
+        for (int q = 0; q < nqueries; ++q)
+        {
+            int lo = rand_r(&seed) % nmembers;
+            std::string min = std::to_string(lo), max = std::to_string(lo + width - 1);
+            std::vector<std::string> req = {cmd, k_zrange_key, rev ? max : min, rev ? min : max};
+            if (0 != strcmp(cmd, "zcount"))
+            {
+                req.push_back("withscores");
+            }
+            uint64_t start = get_monotonic_usec();
+            round_trip(fd, req, res);
+            lat.push_back(get_monotonic_usec() - start);
+
+            start = get_monotonic_usec();
+            client_range(fd, lo, lo + width - 1, pairs);
+            if (rev)
+            {
+                std::reverse(pairs.begin(), pairs.end());
+            }
+            lat_client.push_back(get_monotonic_usec() - start);
+        }
+        std::string name = std::string(cmd) + " client";
+        report(cmd, lat);
+        report(name.c_str(), lat_client);
+    }
+
+    // remove width scores, put them back untimed
+    lat.clear();
+    lat_client.clear();
+    for (int q = 0; q < nqueries; ++q)
+    {
+        for (int client = 0; client < 2; ++client)
+        {
+            int lo = rand_r(&seed) % nmembers;
+            uint64_t start = get_monotonic_usec();
+            if (client)
+            {
+                client_range(fd, lo, lo + width - 1, pairs);
+                for (auto &p : pairs)
+                {
+                    cmds.push_back({"zrem", k_zrange_key, p.first});
+                }
+                send_batched(fd, cmds);
+            }
+            else
+            {
+                round_trip(fd, {"zremrangebyscore", k_zrange_key, std::to_string(lo), std::to_string(lo + width - 1)},
+                           res);
+            }
+            (client ? lat_client : lat).push_back(get_monotonic_usec() - start);
+            for (int i = lo; i < lo + width && i < nmembers; ++i)
+            {
+                cmds.push_back({"zadd", k_zrange_key, std::to_string(i), "m" + std::to_string(i)});
+            }
+            send_batched(fd, cmds);
+        }
+    }
+    report("zremrangebyscore", lat);
+    report("zremrangebyscore client", lat_client);
+    round_trip(fd, {"del", k_zrange_key}, res);
+    close(fd);
+}
+
+static void zload_one(int fd, const char *step, std::vector<std::vector<std::string>> &cmds, int nmembers)
+{
+    std::string res;
+    round_trip(fd, {"del", k_zrange_key}, res);
+    uint64_t start = get_monotonic_usec();
+    send_batched(fd, cmds);
+    uint64_t usec = get_monotonic_usec() - start;
+    printf("%s: %.3fs, %.0f ns/member\n", step, usec / 1e6, usec * 1e3 / nmembers);
+}
+
+static void bench_zload(int nmembers, int batch)
+{
+    int fd = connect_server();
+    std::vector<int> ids(nmembers);
+    for (int i = 0; i < nmembers; ++i)
+    {
+        ids[i] = i;
+    }
+    std::vector<std::vector<std::string>> cmds;
+    unsigned seed = 1;
+    for (int shuffled = 0; shuffled < 2; ++shuffled)
+    {
+        if (shuffled)
+        {
+            for (int i = nmembers - 1; i > 0; --i)
+            {
+                std::swap(ids[i], ids[rand_r(&seed) % (i + 1)]);
+            }
+        }
+        for (int i = 0; i < nmembers; ++i)
+        {
+            cmds.push_back({"zadd", k_zrange_key, std::to_string(ids[i]), "m" + std::to_string(ids[i])});
+        }
+        zload_one(fd, shuffled ? "zadd 1, shuffled" : "zadd 1, in order", cmds, nmembers);
+        for (int i = 0; i < nmembers; i += batch)
+        {
+            std::vector<std::string> cmd = {"zadd", k_zrange_key};
+            for (int k = i; k < i + batch && k < nmembers; ++k)
+            {
+                cmd.push_back(std::to_string(ids[k]));
+                cmd.push_back("m" + std::to_string(ids[k]));
+            }
+            cmds.push_back(std::move(cmd));
+        }
+        char step[64];
+        snprintf(step, sizeof(step), "zadd %d, %s", batch, shuffled ? "shuffled" : "in order");
+        zload_one(fd, step, cmds, nmembers);
+    }
+    std::string res;
+    round_trip(fd, {"del", k_zrange_key}, res);
+    close(fd);
+}
+
+// a number from a MEMSTATS-like response, -1 if it's not there
+static int64_t get_stat(int fd, const char *cmd, const char *name)
+{
+    std::string req, res;
+    append_req(req, {cmd});
+    write_all(fd, req.data(), req.size());
+    read_res(fd, res);
+    size_t pos = 5; // SER_ARR and the length
+    while (pos < res.size())
+    {
+        uint32_t len = 0;
+        memcpy(&len, &res[pos + 1], 4);
+        bool found = res.compare(pos + 5, len, name) == 0 && len == strlen(name);
+        pos += 5 + len;
+        int64_t val = 0;
+        memcpy(&val, &res[pos + 1], 8);
+        if (found && res[pos] == SER_INT)
+        {
+            return val;
+        }
+        pos += 9;
+    }
+    return -1;
+}
+
+struct SetLoop
+{
+    pthread_t tid;
+    int nkeys = 0;
+    volatile bool stop = false;
+    uint64_t nsets = 0;
+};
+
+// overwrite random keys, 100 per round trip, so the parent's pages get copied
+static void *set_loop(void *arg)
+{
+    SetLoop *w = (SetLoop *)arg;
+    int fd = connect_accepted();
+    unsigned seed = 2;
+    std::string req, buf;
+    while (!w->stop)
+    {
+        req.clear();
+        for (int i = 0; i < 100; ++i)
+        {
+            append_req(req, {"set", "save:" + std::to_string(rand_r(&seed) % w->nkeys), "overwritten"});
+        }
+        write_all(fd, req.data(), req.size());
+        read_n_res(fd, 100, buf);
+        w->nsets += 100;
+    }
+    close(fd);
+    return NULL;
+}
+
+// BGSAVE while serving: the fork stalls every shard, then the child writes
+static void bench_save(int nkeys, int vsize)
+{
+    int fd = connect_server();
+    std::vector<std::vector<std::string>> cmds;
+    uint64_t start = get_monotonic_usec();
+    for (int i = 0; i < nkeys; ++i)
+    {
+        cmds.push_back({"set", "save:" + std::to_string(i), std::string(vsize, 'v')});
+    }
+    send_batched(fd, cmds);
+    for (int i = 0; i < nkeys / 4; i += 1000)
+    {
+        std::vector<std::string> cmd = {"zadd", "save:z"};
+        for (int k = i; k < i + 1000 && k < nkeys / 4; ++k)
+        {
+            cmd.push_back(std::to_string(k));
+            cmd.push_back("member:" + std::to_string(k));
+        }
+        cmds.push_back(std::move(cmd));
+    }
+    send_batched(fd, cmds);
+    printf("filled %d keys of %d bytes and %d members in %.3fs\n", nkeys, vsize, nkeys / 4,
+           (get_monotonic_usec() - start) / 1e6);
+    print_memstats(fd, "memstats");
+
+    for (int saving = 0; saving < 2; ++saving)
+    {
+        GetLoop g;
+        SetLoop w;
+        w.nkeys = nkeys;
+        if (0 != pthread_create(&g.tid, NULL, &get_loop, &g) ||
+            0 != pthread_create(&w.tid, NULL, &set_loop, &w))
+        {
+            die("pthread_create");
+        }
+        usleep(200 * 1000);
+        start = get_monotonic_usec();
+        if (!saving)
+        {
+            usleep(1000 * 1000);
+        }
+        else
+        {
+            std::string res;
+            round_trip(fd, {"bgsave"}, res);
+            while (get_stat(fd, "savestats", "in_progress") == 1)
+            {
+                usleep(10 * 1000);
+            }
+        }
+        uint64_t usec = get_monotonic_usec() - start;
+        usleep(200 * 1000);
+        g.stop = w.stop = true;
+        pthread_join(g.tid, NULL);
+        pthread_join(w.tid, NULL);
+        report(saving ? "get, saving" : "get, before", g.lat_us);
+        printf("%s: %.0f sets/s\n", saving ? "saving" : "before", w.nsets * 1e6 / (usec + 400 * 1000));
+    }
+    int64_t bytes = get_stat(fd, "savestats", "bytes");
+    int64_t write_us = get_stat(fd, "savestats", "write_us");
+    printf("fork: %lldus, child: %lld bytes in %.3fs, %.2f GB/s, copy-on-write %lld bytes\n",
+           (long long)get_stat(fd, "savestats", "fork_us"), (long long)bytes, write_us / 1e6,
+           write_us > 0 ? bytes / (write_us * 1e3) : 0, (long long)get_stat(fd, "savestats", "cow_bytes"));
+    close(fd);
+}
+
+// SET throughput with the append-only log, the policy is the server's
+static void bench_aof(int nconns, int depth, int seconds)
+{
+    int fd = connect_server();
+    int64_t policy = get_stat(fd, "aofstats", "policy");
+    int64_t writes = get_stat(fd, "aofstats", "writes");
+    int64_t fsyncs = get_stat(fd, "aofstats", "fsyncs");
+    std::vector<int> fds;
+    for (int i = 0; i < nconns; ++i)
+    {
+        fds.push_back(connect_accepted());
+    }
+    unsigned seed = 3;
+    std::string val(100, 'v');
+    std::string req, buf;
+    std::vector<uint64_t> lat_us;
+    uint64_t nsets = 0;
+    uint64_t start = get_monotonic_usec();
+    uint64_t deadline = start + (uint64_t)seconds * 1000000;
+    while (get_monotonic_usec() < deadline)
+    {
+        uint64_t sent_us = get_monotonic_usec();
+        for (int cfd : fds)
+        {
+            req.clear();
+            for (int i = 0; i < depth; ++i)
+            {
+                append_req(req, {"set", "aof:" + std::to_string(rand_r(&seed) % 100000), val});
+            }
+            write_all(cfd, req.data(), req.size());
+        }
+        for (int cfd : fds)
+        {
+            read_n_res(cfd, depth, buf);
+        }
+        lat_us.push_back(get_monotonic_usec() - sent_us);
+        nsets += (uint64_t)nconns * depth;
+    }
+    uint64_t elapsed = get_monotonic_usec() - start;
+    static const char *const names[] = {"no", "everysec", "always"};
+    printf("appendfsync %s, %d conns x %d sets: %.0f sets/s\n",
+           policy >= 0 && policy <= 2 ? names[policy] : "off (no log)", nconns, depth,
+           nsets * 1e6 / elapsed);
+    report("round trip", lat_us);
+    writes = get_stat(fd, "aofstats", "writes") - writes;
+    fsyncs = get_stat(fd, "aofstats", "fsyncs") - fsyncs;
+    printf("log: %lld writes, %.1f sets per write, %lld fsyncs, fsync avg %lldus max %lldus\n",
+           (long long)writes, writes > 0 ? (double)nsets / writes : 0, (long long)fsyncs,
+           (long long)get_stat(fd, "aofstats", "fsync_avg_us"),
+           (long long)get_stat(fd, "aofstats", "fsync_max_us"));
+    for (int cfd : fds)
+    {
+        close(cfd);
+    }
+    close(fd);
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: bench idle <nconns> <nreqs>\n"
+                    "       bench conc <nconns> <rounds>\n"
+                    "       bench pipeline <nconns> <depth> <rounds>\n"
+                    "       bench kv <nthreads> <nconns> <seconds>\n"
+                    "       bench storm <nconns>\n"
+                    "       bench churn <nkeys> <rounds>\n"
+                    "       bench lazyfree <nmembers>\n"
+                    "       bench zrange <nmembers> <width> <nqueries>\n"
+                    "       bench zload <nmembers> <batch>\n"
+                    "       bench save <nkeys> <vsize>\n"
+                    "       bench aof <nconns> <depth> <seconds>\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        usage();
+    }
+    std::string mode = argv[1];
+    if (mode == "idle" && argc == 4)
+    {
+        bench_idle(atoi(argv[2]), atoi(argv[3]));
+    }
+    else if (mode == "conc" && argc == 4)
+    {
+        bench_conc(atoi(argv[2]), atoi(argv[3]));
+    }
+    else if (mode == "pipeline" && argc == 5)
+    {
+        bench_pipeline(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]));
+    }
+    else if (mode == "kv" && argc == 5)
+    {
+        bench_kv(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]));
+    }
+    else if (mode == "storm" && argc == 3)
+    {
+        bench_storm(atoi(argv[2]));
+    }
+    else if (mode == "churn" && argc == 4)
+    {
+        bench_churn(atoi(argv[2]), atoi(argv[3]));
+    }
+    else if (mode == "lazyfree" && argc == 3)
+    {
+        bench_lazyfree(atoi(argv[2]));
+    }
+    else if (mode == "zrange" && argc == 5 && atoi(argv[2]) > 0 && atoi(argv[3]) > 0)
+    {
+        bench_zrange(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]));
+    }
+    else if (mode == "zload" && argc == 4 && atoi(argv[2]) > 0 && atoi(argv[3]) > 0)
+    {
+        bench_zload(atoi(argv[2]), atoi(argv[3]));
+    }
+    else if (mode == "save" && argc == 4 && atoi(argv[2]) > 0 && atoi(argv[3]) >= 0)
+    {
+        bench_save(atoi(argv[2]), atoi(argv[3]));
+    }
+    else if (mode == "aof" && argc == 5 && atoi(argv[2]) > 0 && atoi(argv[3]) > 0)
+    {
+        bench_aof(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]));
+    }
+    else
+    {
+        usage();
+    }
+    return 0;
+}
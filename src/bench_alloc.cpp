@@ -0,0 +1,262 @@
+/*
+** bench_alloc.cpp -- count heap allocations on the request path
+**
+** ./bench_alloc [nreqs] [nkeys]
+**      runs requests through a connection over a socketpair, and reports
+**      the heap allocations per request (operator new and malloc).
+**      then sets nkeys keys and reports the heap bytes per key, against
+**      the old Entry with 2 std::string.
+**      then adds nkeys members to a zset and reports the ns per member,
+**      and the lines logged meanwhile.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <new>
+
+static size_t g_nalloc = 0;
+
+void *operator new(size_t n)
+{
+    g_nalloc++;
+    void *p = malloc(n);
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+static void *count_malloc(size_t n)
+{
+    g_nalloc++;
+    return malloc(n);
+}
+
+static void *count_realloc(void *p, size_t n)
+{
+    g_nalloc++;
+    return realloc(p, n);
+}
+
+#define malloc count_malloc
+#include "buffer.cpp" // lazy
+#define realloc count_realloc
+#define main server_main
+#include "server.cpp" // lazy
+#undef main
+#undef realloc
+#undef malloc
+
+static void append_req(std::string &buf, const std::vector<std::string> &cmd)
+{
+    uint32_t len = 4;
+    for (const std::string &s : cmd)
+    {
+        len += 4 + s.size();
+    }
+    uint32_t n = (uint32_t)cmd.size();
+    buf.append((char *)&len, 4);
+    buf.append((char *)&n, 4);
+    for (const std::string &s : cmd)
+    {
+        uint32_t sz = (uint32_t)s.size();
+        buf.append((char *)&sz, 4);
+        buf.append(s);
+    }
+}
+
+// send one request, let the server handle it, and read the response back
+static void round_trip(Conn *conn, int fd, const std::string &req)
+{
+    if (write(fd, req.data(), req.size()) != (ssize_t)req.size())
+    {
+        die("write");
+    }
+    connection_io(conn);
+    assert(conn->state == STATE_REQ);
+    char res[4096];
+    if (read(fd, res, sizeof(res)) <= 0)
+    {
+        die("read");
+    }
+}
+
+static void bench(const char *name, Conn *conn, int fd, const std::vector<std::string> &cmd, int nreqs)
+{
+    std::string req;
+    append_req(req, cmd);
+    // warm up the buffer pool and the reused vectors
+    for (int i = 0; i < 100; ++i)
+    {
+        round_trip(conn, fd, req);
+    }
+    g_nalloc = 0;
+    for (int i = 0; i < nreqs; ++i)
+    {
+        round_trip(conn, fd, req);
+    }
+    printf("%s: %.3f allocations per request\n", name, (double)g_nalloc / nreqs);
+}
+
+// the Entry before it was packed into one allocation
+struct OldEntry
+{
+    struct HNode node;
+    std::string key;
+    std::string val;
+    uint32_t type = 0;
+    ZSet *zset = NULL;
+};
+
+static bool old_entry_eq(HNode *node, HNode *key)
+{
+    OldEntry *ent = my_container_of(node, OldEntry, node);
+    LookupKey *lk = my_container_of(key, LookupKey, node);
+    return ent->key == lk->key;
+}
+
+static void cb_collect(HNode *node, void *arg)
+{
+    ((std::vector<HNode *> *)arg)->push_back(node);
+}
+
+// free a whole table, f frees a node
+static void clear_db(HMap *db, void (*f)(HNode *))
+{
+    std::vector<HNode *> nodes;
+    hm_foreach(db, &cb_collect, &nodes);
+    for (HNode *node : nodes)
+    {
+        f(node);
+    }
+    hm_destroy(db);
+}
+
+static void old_entry_del(HNode *node)
+{
+    delete my_container_of(node, OldEntry, node);
+}
+
+static void new_entry_del(HNode *node)
+{
+    entry_del(my_container_of(node, Entry, node), k_lazyfree_auto);
+}
+
+// malloc's and the slab pages
+static size_t heap_used()
+{
+    SlabStats st;
+    slab_stats(&st);
+    return mallinfo2().uordblks + st.page_bytes;
+}
+
+// the heap bytes per key of nkeys keys, the hashtable included
+static void bench_mem(const char *name, size_t nkeys, const char *vfmt)
+{
+    std::vector<std::string> keys(nkeys), vals(nkeys);
+    for (size_t i = 0; i < nkeys; ++i)
+    {
+        char buf[128];
+        keys[i].assign(buf, snprintf(buf, sizeof(buf), "key:%08zu", i));
+        vals[i].assign(buf, snprintf(buf, sizeof(buf), vfmt, i));
+    }
+
+    HMap db;
+    size_t before = heap_used();
+    for (size_t i = 0; i < nkeys; ++i)
+    {
+        LookupKey key;
+        key_init(&key, keys[i]);
+        if (!hm_lookup(&db, &key.node, &old_entry_eq))
+        {
+            OldEntry *ent = new OldEntry();
+            ent->key.assign(keys[i]);
+            ent->val.assign(vals[i]);
+            ent->node.hcode = key.node.hcode;
+            hm_insert(&db, &ent->node);
+        }
+    }
+    double old_size = double(heap_used() - before) / nkeys;
+    clear_db(&db, &old_entry_del);
+
+    before = heap_used();
+    Buffer buf;
+    for (size_t i = 0; i < nkeys; ++i)
+    {
+        Out out;
+        out_init(out, &buf, 0);
+        std::vector<std::string_view> cmd = {"set", keys[i], vals[i]};
+        do_set(cmd, out);
+    }
+    buf_release(&buf);
+    double new_size = double(heap_used() - before) / nkeys;
+    clear_db(&g_data.db, &new_entry_del);
+    printf("%s: %.1f bytes per key, was %.1f\n", name, new_size, old_size);
+}
+
+// zset_add() alone, the log calls on its path are compiled out below LOG_LEVEL
+static void bench_zadd(size_t n)
+{
+    ZSet zset;
+    uint64_t lines = log_lines();
+    char name[32];
+    uint64_t start = get_monotonic_usec();
+    for (size_t i = 0; i < n; i++)
+    {
+        // in an order that isn't sorted
+        int len = snprintf(name, sizeof(name), "m%zu", i * 7919 % n);
+        zset_add(&zset, name, (size_t)len, (double)(i % 1000));
+    }
+    double ns = (get_monotonic_usec() - start) * 1000.0 / n;
+    printf("zadd: %.1f ns per new member, %llu lines logged\n",
+           ns, (unsigned long long)(log_lines() - lines));
+    zset_dispose(&zset);
+}
+
+int main(int argc, char **argv)
+{
+    int nreqs = argc > 1 ? atoi(argv[1]) : 100000;
+    size_t nkeys = argc > 2 ? strtoull(argv[2], NULL, 10) : 1000000;
+    if (!shards_init(1))
+    {
+        die("shards_init");
+    }
+    g_data.shard = shard_get(0);
+    tw_init(&g_data.timers, get_monotonic_msec());
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    {
+        die("socketpair");
+    }
+    fd_set_nb(fds[0]);
+    Conn *conn = conn_new(g_data.fd2conn, fds[0]);
+
+    std::string req;
+    append_req(req, {"set", "key", "value"});
+    round_trip(conn, fds[1], req);
+
+    bench("get hit", conn, fds[1], {"get", "key"}, nreqs);
+    bench("get miss", conn, fds[1], {"get", "nokey"}, nreqs);
+    bench("set existing key", conn, fds[1], {"set", "key", "value"}, nreqs);
+    bench("zadd existing member", conn, fds[1], {"zadd", "zkey", "1", "m"}, nreqs);
+    clear_db(&g_data.db, &new_entry_del);
+
+    // 12-byte keys
+    bench_mem("integer value", nkeys, "%zu");
+    bench_mem("10-byte value", nkeys, "val:%06zu");
+    bench_mem("40-byte value", nkeys, "value:%034zu");
+    bench_zadd(nkeys);
+    return 0;
+}
@@ -0,0 +1,329 @@
+/*
+** bench_hash.cpp -- hashtables and the hash function
+**
+** ./bench_hash table [nkeys]
+**      the chained HMap vs the open addressing FMap: insert nkeys keys,
+**      look them up (hits and misses) in random order, then delete them.
+**      reports ns per operation, the slowest single insert, and the
+**      memory per key of the table and the node.
+** ./bench_hash speed
+**      str_hash vs the old 32-bit FNV hash, by key length
+** ./bench_hash collide [nkeys]
+**      hash nkeys keys like "key:123" with both, count the keys
+**      whose full hash is shared with another key
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+#include "common.h"
+#include "hashtable.h"
+#include "flatmap.h"
+
+struct BKey
+{
+    HNode node;
+    uint64_t val = 0;
+};
+
+static bool bkey_eq(HNode *lhs, HNode *rhs)
+{
+    return my_container_of(lhs, BKey, node)->val == my_container_of(rhs, BKey, node)->val;
+}
+
+// what str_hash used to be
+static uint64_t fnv_hash(const uint8_t *data, size_t len)
+{
+    uint32_t h = 0x811C9DC5;
+    for (size_t i = 0; i < len; i++)
+    {
+        h = (h + data[i]) * 0x01000193;
+    }
+    return h;
+}
+
+static uint64_t get_monotonic_nsec()
+{
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+// the two tables behind the same calls
+struct Table
+{
+    const char *name;
+    void *(*create)();
+    void (*insert)(void *, HNode *);
+    HNode *(*lookup)(void *, HNode *);
+    HNode *(*pop)(void *, HNode *);
+    size_t (*mem)(void *); // bytes used by the table itself
+    void (*destroy)(void *);
+};
+
+static void *hmap_create()
+{
+    return new HMap();
+}
+
+static void hmap_insert(void *m, HNode *node)
+{
+    hm_insert((HMap *)m, node);
+}
+
+static HNode *hmap_lookup(void *m, HNode *key)
+{
+    return hm_lookup((HMap *)m, key, &bkey_eq);
+}
+
+static HNode *hmap_pop(void *m, HNode *key)
+{
+    return hm_pop((HMap *)m, key, &bkey_eq);
+}
+
+static size_t hmap_mem(void *m)
+{
+    HMap *hmap = (HMap *)m;
+    size_t n = hmap->ht1.tab ? hmap->ht1.mask + 1 : 0;
+    n += hmap->ht2.tab ? hmap->ht2.mask + 1 : 0;
+    return n * sizeof(HNode *);
+}
+
+static void hmap_destroy(void *m)
+{
+    hm_destroy((HMap *)m);
+    delete (HMap *)m;
+}
+
+static void *fmap_create()
+{
+    return new FMap();
+}
+
+static void fmap_insert(void *m, HNode *node)
+{
+    fm_insert((FMap *)m, node);
+}
+
+static HNode *fmap_lookup(void *m, HNode *key)
+{
+    return fm_lookup((FMap *)m, key, &bkey_eq);
+}
+
+static HNode *fmap_pop(void *m, HNode *key)
+{
+    return fm_pop((FMap *)m, key, &bkey_eq);
+}
+
+static size_t fmap_mem(void *m)
+{
+    FMap *fmap = (FMap *)m;
+    size_t n = fmap->newer.ctrl ? fmap->newer.mask + 1 : 0;
+    n += fmap->older.ctrl ? fmap->older.mask + 1 : 0;
+    return n * (1 + sizeof(HNode *));
+}
+
+static void fmap_destroy(void *m)
+{
+    fm_destroy((FMap *)m);
+    delete (FMap *)m;
+}
+
+static const Table k_tables[] = {
+    {"HMap", &hmap_create, &hmap_insert, &hmap_lookup, &hmap_pop, &hmap_mem, &hmap_destroy},
+    {"FMap", &fmap_create, &fmap_insert, &fmap_lookup, &fmap_pop, &fmap_mem, &fmap_destroy},
+};
+
+static void bench_table(const Table &t, std::vector<BKey> &keys, std::vector<BKey> &misses,
+                        const std::vector<size_t> &order)
+{
+    size_t n = keys.size();
+    void *m = t.create();
+
+    uint64_t start = get_monotonic_nsec();
+    for (size_t i = 0; i < n; i++)
+    {
+        t.insert(m, &keys[i].node);
+    }
+    double insert_ns = double(get_monotonic_nsec() - start) / n;
+    double mem = double(t.mem(m)) / n;
+
+    size_t found = 0;
+    start = get_monotonic_nsec();
+    for (size_t i : order)
+    {
+        found += t.lookup(m, &keys[i].node) != NULL;
+    }
+    double hit_ns = double(get_monotonic_nsec() - start) / n;
+
+    start = get_monotonic_nsec();
+    for (size_t i : order)
+    {
+        found += t.lookup(m, &misses[i].node) != NULL;
+    }
+    double miss_ns = double(get_monotonic_nsec() - start) / n;
+
+    start = get_monotonic_nsec();
+    for (size_t i : order)
+    {
+        found += t.pop(m, &keys[i].node) != NULL;
+    }
+    double del_ns = double(get_monotonic_nsec() - start) / n;
+    if (found != 2 * n)
+    {
+        fprintf(stderr, "%s: bad result %zu\n", t.name, found);
+        exit(1);
+    }
+    t.destroy(m);
+
+    // again, timing every insert to find the worst stall
+    m = t.create();
+    uint64_t worst = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        start = get_monotonic_nsec();
+        t.insert(m, &keys[i].node);
+        worst = std::max(worst, get_monotonic_nsec() - start);
+    }
+    t.destroy(m);
+
+    printf("%-5s insert %6.1f  hit %6.1f  miss %6.1f  del %6.1f ns/op  "
+           "worst insert %6.1f us  mem %5.1f + %zu B/key\n",
+           t.name, insert_ns, hit_ns, miss_ns, del_ns, worst / 1e3, mem, sizeof(HNode));
+}
+
+static void bench_tables(size_t n)
+{
+    std::vector<BKey> keys(n), misses(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        keys[i].val = i;
+        keys[i].node.hcode = str_hash((uint8_t *)&keys[i].val, sizeof(uint64_t));
+        misses[i].val = n + i;
+        misses[i].node.hcode = str_hash((uint8_t *)&misses[i].val, sizeof(uint64_t));
+    }
+    std::vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), std::mt19937_64(1));
+
+    printf("%zu keys\n", n);
+    for (const Table &t : k_tables)
+    {
+        bench_table(t, keys, misses, order);
+    }
+}
+
+static void bench_speed()
+{
+    const size_t k_lens[] = {3, 8, 16, 24, 32, 64, 256, 1024, 4096};
+    std::vector<uint8_t> buf(4096 + 64);
+    std::mt19937_64 rng(1);
+    for (uint8_t &c : buf)
+    {
+        c = (uint8_t)rng();
+    }
+    uint64_t sink = 0;
+    printf("%6s %20s %20s\n", "len", "str_hash", "fnv");
+    for (size_t len : k_lens)
+    {
+        size_t iters = std::max<size_t>((256u << 20) / len, 1) / 8;
+        double ns[2];
+        uint64_t (*hashes[2])(const uint8_t *, size_t) = {&str_hash, &fnv_hash};
+        for (int h = 0; h < 2; h++)
+        {
+            uint64_t start = get_monotonic_nsec();
+            for (size_t i = 0; i < iters; i++)
+            {
+                // move the key around so the hash isn't hoisted out of the loop
+                sink += hashes[h](&buf[i & 63], len);
+            }
+            ns[h] = double(get_monotonic_nsec() - start) / iters;
+        }
+        printf("%6zu %8.1f ns %5.2f GB/s %8.1f ns %5.2f GB/s\n",
+               len, ns[0], len / ns[0], ns[1], len / ns[1]);
+    }
+    if (sink == 42)
+    {
+        printf("\n");
+    }
+}
+
+// the number of keys that share their hash with another key
+static size_t count_collisions(std::vector<uint64_t> &hashes)
+{
+    std::sort(hashes.begin(), hashes.end());
+    size_t n = 0;
+    for (size_t i = 0; i < hashes.size(); i++)
+    {
+        bool dup = (i > 0 && hashes[i] == hashes[i - 1]) ||
+                   (i + 1 < hashes.size() && hashes[i] == hashes[i + 1]);
+        n += dup;
+    }
+    return n;
+}
+
+static void bench_collide(size_t n)
+{
+    std::vector<uint64_t> hashes(n);
+    uint64_t (*fns[2])(const uint8_t *, size_t) = {&str_hash, &fnv_hash};
+    const char *names[2] = {"str_hash", "fnv"};
+    for (int h = 0; h < 2; h++)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            char key[32];
+            int len = snprintf(key, sizeof(key), "key:%zu", i);
+            hashes[i] = fns[h]((uint8_t *)key, len);
+        }
+        printf("%-8s %zu of %zu keys collide\n", names[h], count_collisions(hashes), n);
+    }
+    // about n^2 / 2^(bits+1) pairs for a random hash
+    printf("expected pairs: %.1f for 32 bits, %.2g for 64 bits\n",
+           double(n) * n / 8589934592.0, double(n) * n / 36893488147419103232.0);
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: bench_hash table [nkeys]\n"
+                    "       bench_hash speed\n"
+                    "       bench_hash collide [nkeys]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        usage();
+    }
+    std::string mode = argv[1];
+    size_t n = argc > 2 ? strtoull(argv[2], NULL, 10) : 1000000;
+    if (n == 0)
+    {
+        usage();
+    }
+    g_hash_seed = std::random_device()();
+    if (mode == "table")
+    {
+        bench_tables(n);
+    }
+    else if (mode == "speed")
+    {
+        bench_speed();
+    }
+    else if (mode == "collide")
+    {
+        bench_collide(n);
+    }
+    else
+    {
+        usage();
+    }
+    return 0;
+}
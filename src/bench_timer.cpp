@@ -0,0 +1,146 @@
+/*
+** bench_timer.cpp -- the timing wheel vs the binary heap
+**
+** ./bench_timer [ntimers]
+**      adds ntimers timers due in the next 10 s, resets every one of them
+**      once (what an idle timer does on each request), then advances the
+**      clock 1 ms at a time until all have expired.
+**      reports ns per timer for each step.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <random>
+#include <vector>
+#include "common.h"
+#include "heap.h"
+#include "timerwheel.h"
+
+const uint64_t k_range_ms = 10 * 1000;
+
+struct BTimer
+{
+    Timer timer;
+    uint32_t heap_idx = k_heap_none;
+};
+
+static uint64_t get_monotonic_nsec()
+{
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static void report(const char *name, const char *step, uint64_t start, size_t n)
+{
+    printf("%-5s %-7s %6.1f ns/timer\n", name, step, double(get_monotonic_nsec() - start) / n);
+}
+
+static void bench_wheel(std::vector<BTimer> &timers, const std::vector<uint64_t> &deadlines,
+                        const std::vector<uint64_t> &resets)
+{
+    size_t n = timers.size();
+    TimerWheel *tw = new TimerWheel();
+    tw_init(tw, 0);
+
+    uint64_t start = get_monotonic_nsec();
+    for (size_t i = 0; i < n; i++)
+    {
+        tw_add(tw, &timers[i].timer, deadlines[i]);
+    }
+    report("wheel", "add", start, n);
+
+    start = get_monotonic_nsec();
+    for (size_t i = 0; i < n; i++)
+    {
+        tw_cancel(tw, &timers[i].timer);
+        tw_add(tw, &timers[i].timer, resets[i]);
+    }
+    report("wheel", "reset", start, n);
+
+    start = get_monotonic_nsec();
+    size_t expired = 0;
+    for (uint64_t now = 1; now <= 2 * k_range_ms; now++)
+    {
+        DList due;
+        dlist_init(&due);
+        tw_advance(tw, now, &due);
+        while (!dlist_empty(&due))
+        {
+            tw_cancel(tw, my_container_of(due.next, Timer, link));
+            expired++;
+        }
+    }
+    report("wheel", "expire", start, n);
+    if (expired != n)
+    {
+        fprintf(stderr, "wheel: %zu of %zu expired\n", expired, n);
+        exit(1);
+    }
+    delete tw;
+}
+
+static void bench_heap(std::vector<BTimer> &timers, const std::vector<uint64_t> &deadlines,
+                       const std::vector<uint64_t> &resets)
+{
+    size_t n = timers.size();
+    std::vector<HeapItem> heap;
+
+    uint64_t start = get_monotonic_nsec();
+    for (size_t i = 0; i < n; i++)
+    {
+        HeapItem item;
+        item.val = deadlines[i];
+        item.ref = &timers[i].heap_idx;
+        heap_push(heap, item);
+    }
+    report("heap", "add", start, n);
+
+    start = get_monotonic_nsec();
+    for (size_t i = 0; i < n; i++)
+    {
+        heap[timers[i].heap_idx].val = resets[i];
+        heap_fix(heap, timers[i].heap_idx);
+    }
+    report("heap", "reset", start, n);
+
+    start = get_monotonic_nsec();
+    size_t expired = 0;
+    for (uint64_t now = 1; now <= 2 * k_range_ms; now++)
+    {
+        while (!heap.empty() && heap[0].val <= now)
+        {
+            heap_remove(heap, 0);
+            expired++;
+        }
+    }
+    report("heap", "expire", start, n);
+    if (expired != n)
+    {
+        fprintf(stderr, "heap: %zu of %zu expired\n", expired, n);
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    if (n == 0)
+    {
+        fprintf(stderr, "usage: bench_timer [ntimers]\n");
+        return 1;
+    }
+    std::mt19937_64 rng(1);
+    std::vector<uint64_t> deadlines(n), resets(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        deadlines[i] = 1 + rng() % k_range_ms;
+        resets[i] = deadlines[i] + rng() % k_range_ms;
+    }
+    std::vector<BTimer> timers(n);
+
+    printf("%zu timers\n", n);
+    bench_wheel(timers, deadlines, resets);
+    bench_heap(timers, deadlines, resets);
+    return 0;
+}
@@ -0,0 +1,276 @@
+/*
+** bench_zset.cpp -- the zset index: the AVL tree or the B+tree
+**
+** ./bench_zset [nmembers] [nscans]
+**      built twice: bench_zset with the AVL tree, bench_zset_btree with
+**      USE_BTREE. adds nmembers members with random scores, then reports
+**      the ns per operation for
+**      - insert: zset_add() of a new member, the hashtable included
+**      - rank:   zset_rank() of a random member, the hashtable included
+**      - offset: the member at a random rank, from the first one
+**      - scan:   zset_query() at a random score, then 1000 members in order
+**      and the bytes per member held by the allocator.
+** ./bench_zset small [nzsets] [nmembers]
+**      nzsets zsets of nmembers members, packed and as trees. reports the
+**      heap bytes per zset, and the ns per zadd, per zscore, and per zquery
+**      of 10 members.
+** ./bench_zset load [nmembers] [batch]
+**      fill an empty zset with nmembers members, by zset_add() one at a
+**      time, then by zset_add_many() with the members in order, shuffled,
+**      and in batches of batch members. reports the ns per member.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+#include "zset.h"
+#include "slab.h"
+
+const size_t k_scan_len = 1000;
+
+#ifdef USE_BTREE
+static const char *k_index = "btree";
+#else
+static const char *k_index = "avl";
+#endif
+
+static uint64_t get_monotonic_nsec()
+{
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static void report(const char *name, const char *step, uint64_t start, size_t n)
+{
+    printf("%-5s %-6s %8.1f ns/op\n", name, step, double(get_monotonic_nsec() - start) / n);
+}
+
+static size_t heap_bytes()
+{
+    SlabStats st;
+    slab_stats(&st);
+    return mallinfo2().uordblks + st.page_bytes;
+}
+
+static void bench_small(size_t nzsets, size_t nmembers)
+{
+    std::vector<std::string> names(nmembers);
+    for (size_t i = 0; i < nmembers; i++)
+    {
+        names[i] = "member:" + std::to_string(i);
+    }
+    uint32_t pack_members = g_zset_limits.pack_members;
+    printf("%zu zsets of %zu members\n", nzsets, nmembers);
+    for (int packed = 1; packed >= 0; packed--)
+    {
+        const char *name = packed ? "pack" : k_index;
+        g_zset_limits.pack_members = packed ? pack_members : 0;
+        std::mt19937_64 rng(1);
+        std::vector<ZSet *> zsets(nzsets);
+        size_t before = heap_bytes();
+        uint64_t start = get_monotonic_nsec();
+        for (size_t i = 0; i < nzsets; i++)
+        {
+            zsets[i] = new ZSet();
+            for (size_t j = 0; j < nmembers; j++)
+            {
+                zset_add(zsets[i], names[j].data(), names[j].size(), double(rng() % 1000));
+            }
+        }
+        report(name, "zadd", start, nzsets * nmembers);
+        printf("%-5s %-6s %8.1f bytes/zset\n", name, "memory", double(heap_bytes() - before) / nzsets);
+
+        double sum = 0;
+        start = get_monotonic_nsec();
+        for (size_t i = 0; i < nzsets; i++)
+        {
+            const std::string &member = names[rng() % nmembers];
+            double score = 0;
+            zset_score(zsets[i], member.data(), member.size(), &score);
+            sum += score;
+        }
+        report(name, "zscore", start, nzsets);
+
+        start = get_monotonic_nsec();
+        for (size_t i = 0; i < nzsets; i++)
+        {
+            ZIter it = zset_query(zsets[i], double(rng() % 1000), "", 0);
+            for (size_t k = 0; k < 10 && it.valid; k++)
+            {
+                sum += it.score + it.len;
+                zset_offset(zsets[i], &it, +1);
+            }
+        }
+        report(name, "zquery", start, nzsets);
+        printf("checksum %.0f\n", sum);
+
+        for (ZSet *zset : zsets)
+        {
+            zset_dispose(zset);
+            delete zset;
+        }
+    }
+    g_zset_limits.pack_members = pack_members;
+}
+
+static void load_one(const char *step, std::vector<ZTuple> &tuples, size_t batch)
+{
+    ZSet *zset = new ZSet();
+    uint64_t start = get_monotonic_nsec();
+    for (size_t i = 0; i < tuples.size(); i += batch)
+    {
+        size_t n = tuples.size() - i < batch ? tuples.size() - i : batch;
+        if (batch == 1)
+        {
+            zset_add(zset, tuples[i].name, tuples[i].len, tuples[i].score);
+        }
+        else
+        {
+            zset_add_many(zset, &tuples[i], n);
+        }
+    }
+    report(k_index, step, start, tuples.size());
+    if (zset_size(zset) != tuples.size())
+    {
+        fprintf(stderr, "%s: %zu members, want %zu\n", step, zset_size(zset), tuples.size());
+        exit(1);
+    }
+    zset_dispose(zset);
+    delete zset;
+}
+
+static void bench_load(size_t n, size_t batch)
+{
+    std::vector<std::string> names(n);
+    std::vector<ZTuple> tuples(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "member:%012zu", i);
+        names[i] = name;
+        tuples[i].score = double(i / 4);
+        tuples[i].name = names[i].data();
+        tuples[i].len = names[i].size();
+    }
+    printf("%zu members\n", n);
+    std::mt19937_64 rng(1);
+    std::vector<ZTuple> shuffled = tuples;
+    std::shuffle(shuffled.begin(), shuffled.end(), rng);
+    load_one("incr", shuffled, 1);
+    load_one("sorted", tuples, n);
+    load_one("random", shuffled, n);
+    char step[32];
+    snprintf(step, sizeof(step), "b%zu", batch);
+    load_one(step, shuffled, batch);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && 0 == strcmp(argv[1], "load"))
+    {
+        size_t n = argc > 2 ? strtoull(argv[2], NULL, 10) : 1000000;
+        size_t batch = argc > 3 ? strtoull(argv[3], NULL, 10) : 1000;
+        if (n == 0 || batch == 0)
+        {
+            fprintf(stderr, "usage: bench_zset load [nmembers] [batch]\n");
+            return 1;
+        }
+        bench_load(n, batch);
+        return 0;
+    }
+    if (argc > 1 && 0 == strcmp(argv[1], "small"))
+    {
+        size_t nzsets = argc > 2 ? strtoull(argv[2], NULL, 10) : 100000;
+        size_t nmembers = argc > 3 ? strtoull(argv[3], NULL, 10) : 16;
+        if (nzsets == 0 || nmembers == 0)
+        {
+            fprintf(stderr, "usage: bench_zset small [nzsets] [nmembers]\n");
+            return 1;
+        }
+        bench_small(nzsets, nmembers);
+        return 0;
+    }
+    size_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    size_t nscans = argc > 2 ? strtoull(argv[2], NULL, 10) : 10000;
+    if (n == 0)
+    {
+        fprintf(stderr, "usage: bench_zset [nmembers] [nscans] | small [nzsets] [nmembers]\n");
+        return 1;
+    }
+    std::mt19937_64 rng(1);
+    std::vector<double> scores(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        scores[i] = double(rng() % (n * 10));
+    }
+    size_t nops = n < 1000000 ? n : 1000000;
+    printf("%zu members\n", n);
+
+    ZSet *zset = new ZSet();
+    SlabStats before;
+    slab_stats(&before);
+    uint64_t start = get_monotonic_nsec();
+    for (size_t i = 0; i < n; i++)
+    {
+        char name[32];
+        int len = snprintf(name, sizeof(name), "member:%zu", i);
+        zset_add(zset, name, (size_t)len, scores[i]);
+    }
+    report(k_index, "insert", start, n);
+    SlabStats after;
+    slab_stats(&after);
+
+    // the names aren't timed
+    std::vector<std::string> names(nops);
+    for (size_t i = 0; i < nops; i++)
+    {
+        names[i] = "member:" + std::to_string(rng() % n);
+    }
+    int64_t sum = 0;
+    start = get_monotonic_nsec();
+    for (size_t i = 0; i < nops; i++)
+    {
+        sum += zset_rank(zset, names[i].data(), names[i].size());
+    }
+    report(k_index, "rank", start, nops);
+
+    ZIter first = zset_query(zset, -1, "", 0);
+    start = get_monotonic_nsec();
+    for (size_t i = 0; i < nops; i++)
+    {
+        ZIter it = first;
+        zset_offset(zset, &it, (int64_t)(rng() % n));
+        sum += it.valid ? (int64_t)it.score : 0;
+    }
+    report(k_index, "offset", start, nops);
+
+    start = get_monotonic_nsec();
+    size_t visited = 0;
+    for (size_t i = 0; i < nscans; i++)
+    {
+        ZIter it = zset_query(zset, double(rng() % (n * 10)), "", 0);
+        for (size_t k = 0; k < k_scan_len && it.valid; k++)
+        {
+            sum += (int64_t)it.score;
+            zset_offset(zset, &it, +1);
+            visited++;
+        }
+    }
+    report(k_index, "scan", start, visited);
+    printf("%-5s %-6s %8.1f ns per %zu members\n", k_index, "", double(get_monotonic_nsec() - start) / nscans,
+           k_scan_len);
+
+    // the nodes, the tree nodes of the B+tree, not the hashtable
+    size_t bytes = (after.live_bytes + after.large_bytes) - (before.live_bytes + before.large_bytes);
+    printf("%-5s %-6s %8.1f bytes/member\n", k_index, "memory", double(bytes) / n);
+    printf("checksum %lld\n", (long long)sum);
+    zset_dispose(zset);
+    delete zset;
+    return 0;
+}
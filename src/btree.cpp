@@ -0,0 +1,628 @@
+#include <assert.h>
+#include <string.h>
+#include <vector>
+#include "btree.h"
+#include "zset.h"
+#include "slab.h"
+
+/*
+- a full node splits in two halves, except at the right end of the tree:
+  appending to the last leaf starts a new leaf, so items added in order
+  leave full nodes behind. every node but the root has at least 1 item or
+  2 children.
+- a delete that leaves a node less than half full takes items from a
+  sibling, or merges with it when both fit in one node.
+- key i of an inner node is the smallest item under child i, exactly. the
+  search reads that ZNode when the score and the prefix are equal, so it
+  must never be freed while it's a key: deleting the smallest item of a
+  subtree replaces the key.
+- key 0 of an inner node carries the smallest item of a node while it's
+  split or shares children with a sibling.
+*/
+
+const uint32_t k_bt_min = k_bt_cap / 2;
+
+// the key being searched for
+struct BKey
+{
+    double score = 0;
+    uint64_t prefix = 0;
+    const char *name = NULL;
+    size_t len = 0;
+};
+
+// the first 8 bytes of the name, zero padded, big endian.
+// they compare as integers like memcmp() does.
+static uint64_t name_prefix(const char *name, size_t len)
+{
+    uint64_t prefix = 0;
+    for (size_t i = 0; i < 8; i++)
+    {
+        prefix = (prefix << 8) | (i < len ? (uint8_t)name[i] : 0);
+    }
+    return prefix;
+}
+
+static BKey key_of(ZNode *item)
+{
+    BKey key;
+    key.score = item->score;
+    key.prefix = name_prefix(item->name, item->len);
+    key.name = item->name;
+    key.len = item->len;
+    return key;
+}
+
+// compare the key with key i, by the (score, name) tuple
+static int key_cmp(const BKey &key, BKeys *keys, uint32_t i)
+{
+    if (key.score != keys->scores[i])
+    {
+        return key.score < keys->scores[i] ? -1 : 1;
+    }
+    if (key.prefix != keys->prefixes[i])
+    {
+        return key.prefix < keys->prefixes[i] ? -1 : 1;
+    }
+    // the first 8 bytes are equal
+    ZNode *item = keys->items[i];
+    size_t len = key.len < item->len ? key.len : item->len;
+    if (len > 8)
+    {
+        int rv = memcmp(key.name + 8, item->name + 8, len - 8);
+        if (rv != 0)
+        {
+            return rv < 0 ? -1 : 1;
+        }
+    }
+    return key.len < item->len ? -1 : key.len > item->len ? 1 : 0;
+}
+
+static void keys_set(BKeys *keys, uint32_t i, ZNode *item)
+{
+    keys->scores[i] = item->score;
+    keys->prefixes[i] = name_prefix(item->name, item->len);
+    keys->items[i] = item;
+}
+
+static void keys_move(BKeys *dst, uint32_t di, BKeys *src, uint32_t si, uint32_t n)
+{
+    memmove(&dst->scores[di], &src->scores[si], n * sizeof(double));
+    memmove(&dst->prefixes[di], &src->prefixes[si], n * sizeof(uint64_t));
+    memmove(&dst->items[di], &src->items[si], n * sizeof(ZNode *));
+}
+
+static BLeaf *leaf_new()
+{
+    BLeaf *leaf = (BLeaf *)slab_alloc(sizeof(BLeaf));
+    leaf->base.n = 0;
+    leaf->base.leaf = true;
+    leaf->prev = leaf->next = NULL;
+    return leaf;
+}
+
+static BInner *inner_new()
+{
+    BInner *inner = (BInner *)slab_alloc(sizeof(BInner));
+    inner->base.n = 0;
+    inner->base.leaf = false;
+    return inner;
+}
+
+static void node_free(BNode *node)
+{
+    slab_free(node, node->leaf ? sizeof(BLeaf) : sizeof(BInner));
+}
+
+static uint32_t node_count(BNode *node)
+{
+    if (node->leaf)
+    {
+        return node->n;
+    }
+    BInner *inner = (BInner *)node;
+    uint32_t cnt = 0;
+    for (uint32_t i = 0; i < node->n; i++)
+    {
+        cnt += inner->cnts[i];
+    }
+    return cnt;
+}
+
+// the smallest item under a non-empty node
+static ZNode *node_min(BNode *node)
+{
+    while (!node->leaf)
+    {
+        node = ((BInner *)node)->kids[0];
+    }
+    return ((BLeaf *)node)->keys.items[0];
+}
+
+// the first item >= key
+static uint32_t leaf_lower(BLeaf *leaf, const BKey &key)
+{
+    uint32_t lo = 0, hi = leaf->base.n;
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if (key_cmp(key, &leaf->keys, mid) > 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// the child that covers the key: the last one whose key is <= key
+static uint32_t inner_find(BInner *inner, const BKey &key)
+{
+    uint32_t lo = 1, hi = inner->base.n;
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if (key_cmp(key, &inner->keys, mid) >= 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+// move children with their counts and keys
+static void kids_move(BInner *dst, uint32_t di, BInner *src, uint32_t si, uint32_t n)
+{
+    memmove(&dst->kids[di], &src->kids[si], n * sizeof(BNode *));
+    memmove(&dst->cnts[di], &src->cnts[si], n * sizeof(uint32_t));
+    keys_move(&dst->keys, di, &src->keys, si, n);
+}
+
+static void leaf_insert_at(BLeaf *leaf, uint32_t pos, ZNode *item)
+{
+    keys_move(&leaf->keys, pos + 1, &leaf->keys, pos, leaf->base.n - pos);
+    keys_set(&leaf->keys, pos, item);
+    leaf->base.n++;
+}
+
+static void inner_insert_at(BInner *inner, uint32_t pos, BNode *kid, ZNode *min)
+{
+    kids_move(inner, pos + 1, inner, pos, inner->base.n - pos);
+    inner->kids[pos] = kid;
+    inner->cnts[pos] = node_count(kid);
+    keys_set(&inner->keys, pos, min);
+    inner->base.n++;
+}
+
+static void inner_remove_at(BInner *inner, uint32_t pos)
+{
+    kids_move(inner, pos, inner, pos + 1, inner->base.n - pos - 1);
+    inner->base.n--;
+}
+
+// the new right sibling of a node that split, its smallest item is key 0
+static BNode *leaf_insert(BLeaf *leaf, const BKey &key, ZNode *item)
+{
+    uint32_t pos = leaf_lower(leaf, key);
+    if (leaf->base.n < k_bt_cap)
+    {
+        leaf_insert_at(leaf, pos, item);
+        return NULL;
+    }
+    uint32_t half = (pos == k_bt_cap && !leaf->next) ? k_bt_cap : k_bt_cap / 2;
+    BLeaf *right = leaf_new();
+    keys_move(&right->keys, 0, &leaf->keys, half, k_bt_cap - half);
+    right->base.n = (uint16_t)(k_bt_cap - half);
+    leaf->base.n = (uint16_t)half;
+    right->prev = leaf;
+    right->next = leaf->next;
+    if (leaf->next)
+    {
+        leaf->next->prev = right;
+    }
+    leaf->next = right;
+    if (half < k_bt_cap && pos <= half)
+    {
+        leaf_insert_at(leaf, pos, item);
+    }
+    else
+    {
+        leaf_insert_at(right, pos - half, item);
+    }
+    return &right->base;
+}
+
+// last: the node is the rightmost one of its level
+static BNode *node_insert(BNode *node, const BKey &key, ZNode *item, bool last)
+{
+    if (node->leaf)
+    {
+        return leaf_insert((BLeaf *)node, key, item);
+    }
+    BInner *inner = (BInner *)node;
+    uint32_t i = inner_find(inner, key);
+    BNode *sub = node_insert(inner->kids[i], key, item, last && i + 1 == node->n);
+    inner->cnts[i]++;
+    if (!sub)
+    {
+        return NULL;
+    }
+    // the new child goes after child i
+    ZNode *min = sub->leaf ? ((BLeaf *)sub)->keys.items[0] : ((BInner *)sub)->keys.items[0];
+    inner->cnts[i] = node_count(inner->kids[i]);
+    uint32_t pos = i + 1;
+    if (node->n < k_bt_cap)
+    {
+        inner_insert_at(inner, pos, sub, min);
+        return NULL;
+    }
+    // at the right end, the new node starts with the last child and the new one
+    uint32_t half = (last && pos == k_bt_cap) ? k_bt_cap - 1 : k_bt_cap / 2;
+    BInner *right = inner_new();
+    kids_move(right, 0, inner, half, k_bt_cap - half);
+    right->base.n = (uint16_t)(k_bt_cap - half);
+    inner->base.n = (uint16_t)half;
+    if (pos <= half)
+    {
+        inner_insert_at(inner, pos, sub, min);
+    }
+    else
+    {
+        inner_insert_at(right, pos - half, sub, min);
+    }
+    return &right->base;
+}
+
+void bt_insert(BTree *tree, ZNode *item)
+{
+    if (!tree->root)
+    {
+        tree->root = &leaf_new()->base;
+    }
+    BNode *right = node_insert(tree->root, key_of(item), item, true);
+    if (right)
+    {
+        // the tree grows a level
+        BInner *root = inner_new();
+        root->kids[0] = tree->root;
+        root->cnts[0] = node_count(tree->root);
+        root->base.n = 1;
+        ZNode *min = right->leaf ? ((BLeaf *)right)->keys.items[0] : ((BInner *)right)->keys.items[0];
+        inner_insert_at(root, 1, right, min);
+        tree->root = &root->base;
+    }
+    tree->size++;
+}
+
+static void leaf_unlink(BLeaf *leaf)
+{
+    if (leaf->prev)
+    {
+        leaf->prev->next = leaf->next;
+    }
+    if (leaf->next)
+    {
+        leaf->next->prev = leaf->prev;
+    }
+}
+
+// child j and j + 1 are merged when they fit in one node, or share their items evenly
+static void leaves_balance(BInner *inner, uint32_t j)
+{
+    BLeaf *l = (BLeaf *)inner->kids[j];
+    BLeaf *r = (BLeaf *)inner->kids[j + 1];
+    uint32_t ln = l->base.n, rn = r->base.n;
+    if (ln + rn <= k_bt_cap)
+    {
+        keys_move(&l->keys, ln, &r->keys, 0, rn);
+        l->base.n = (uint16_t)(ln + rn);
+        leaf_unlink(r);
+        node_free(&r->base);
+        inner_remove_at(inner, j + 1);
+        inner->cnts[j] = l->base.n;
+        return;
+    }
+    uint32_t want = (ln + rn) / 2;
+    if (ln < want)
+    {
+        keys_move(&l->keys, ln, &r->keys, 0, want - ln);
+        keys_move(&r->keys, 0, &r->keys, want - ln, rn - (want - ln));
+    }
+    else
+    {
+        keys_move(&r->keys, ln - want, &r->keys, 0, rn);
+        keys_move(&r->keys, 0, &l->keys, want, ln - want);
+    }
+    l->base.n = (uint16_t)want;
+    r->base.n = (uint16_t)(ln + rn - want);
+    inner->cnts[j] = l->base.n;
+    inner->cnts[j + 1] = r->base.n;
+    keys_set(&inner->keys, j + 1, r->keys.items[0]);
+}
+
+static void inners_balance(BInner *inner, uint32_t j)
+{
+    BInner *l = (BInner *)inner->kids[j];
+    BInner *r = (BInner *)inner->kids[j + 1];
+    uint32_t ln = l->base.n, rn = r->base.n;
+    // the smallest item of r goes along with its first child.
+    // key j + 1 can be the item being deleted, so look it up.
+    keys_set(&r->keys, 0, node_min(&r->base));
+    if (ln + rn <= k_bt_cap)
+    {
+        kids_move(l, ln, r, 0, rn);
+        l->base.n = (uint16_t)(ln + rn);
+        node_free(&r->base);
+        inner_remove_at(inner, j + 1);
+        inner->cnts[j] = node_count(&l->base);
+        return;
+    }
+    uint32_t want = (ln + rn) / 2;
+    if (ln < want)
+    {
+        kids_move(l, ln, r, 0, want - ln);
+        kids_move(r, 0, r, want - ln, rn - (want - ln));
+    }
+    else
+    {
+        kids_move(r, ln - want, r, 0, rn);
+        kids_move(r, 0, l, want, ln - want);
+    }
+    l->base.n = (uint16_t)want;
+    r->base.n = (uint16_t)(ln + rn - want);
+    inner->cnts[j] = node_count(&l->base);
+    inner->cnts[j + 1] = node_count(&r->base);
+    keys_set(&inner->keys, j + 1, r->keys.items[0]);
+}
+
+static void node_erase(BNode *node, const BKey &key, ZNode *item)
+{
+    if (node->leaf)
+    {
+        BLeaf *leaf = (BLeaf *)node;
+        uint32_t pos = leaf_lower(leaf, key);
+        assert(pos < node->n && leaf->keys.items[pos] == item);
+        keys_move(&leaf->keys, pos, &leaf->keys, pos + 1, node->n - pos - 1);
+        node->n--;
+        return;
+    }
+    BInner *inner = (BInner *)node;
+    uint32_t i = inner_find(inner, key);
+    BNode *kid = inner->kids[i];
+    node_erase(kid, key, item);
+    inner->cnts[i]--;
+    if (kid->n < k_bt_min)
+    {
+        assert(node->n >= 2);
+        // the keys it changes are set from the nodes
+        uint32_t j = i > 0 ? i - 1 : i;
+        if (kid->leaf)
+        {
+            leaves_balance(inner, j);
+        }
+        else
+        {
+            inners_balance(inner, j);
+        }
+    }
+    else if (i > 0 && inner->keys.items[i] == item)
+    {
+        keys_set(&inner->keys, i, node_min(kid));
+    }
+}
+
+void bt_erase(BTree *tree, ZNode *item)
+{
+    node_erase(tree->root, key_of(item), item);
+    tree->size--;
+    // the tree loses a level
+    while (!tree->root->leaf && tree->root->n == 1)
+    {
+        BNode *root = tree->root;
+        tree->root = ((BInner *)root)->kids[0];
+        node_free(root);
+    }
+    if (tree->root->leaf && tree->root->n == 0)
+    {
+        node_free(tree->root);
+        tree->root = NULL;
+    }
+}
+
+BIter bt_seek(BTree *tree, double score, const char *name, size_t len)
+{
+    BIter it;
+    if (!tree->root)
+    {
+        return it;
+    }
+    BKey key;
+    key.score = score;
+    key.prefix = name_prefix(name, len);
+    key.name = name;
+    key.len = len;
+    BNode *node = tree->root;
+    while (!node->leaf)
+    {
+        BInner *inner = (BInner *)node;
+        node = inner->kids[inner_find(inner, key)];
+    }
+    BLeaf *leaf = (BLeaf *)node;
+    uint32_t idx = leaf_lower(leaf, key);
+    if (idx == node->n)
+    {
+        // it's the first item of the next leaf, if any
+        leaf = leaf->next;
+        idx = 0;
+    }
+    it.leaf = leaf;
+    it.idx = idx;
+    return it;
+}
+
+BIter bt_at(BTree *tree, uint64_t rank)
+{
+    BIter it;
+    if (rank >= tree->size)
+    {
+        return it;
+    }
+    BNode *node = tree->root;
+    while (!node->leaf)
+    {
+        BInner *inner = (BInner *)node;
+        uint32_t i = 0;
+        while (rank >= inner->cnts[i])
+        {
+            rank -= inner->cnts[i];
+            i++;
+        }
+        node = inner->kids[i];
+    }
+    it.leaf = (BLeaf *)node;
+    it.idx = (uint32_t)rank;
+    return it;
+}
+
+uint64_t bt_rank(BTree *tree, ZNode *item)
+{
+    BKey key = key_of(item);
+    uint64_t rank = 0;
+    BNode *node = tree->root;
+    while (!node->leaf)
+    {
+        BInner *inner = (BInner *)node;
+        uint32_t i = inner_find(inner, key);
+        for (uint32_t k = 0; k < i; k++)
+        {
+            rank += inner->cnts[k];
+        }
+        node = inner->kids[i];
+    }
+    return rank + leaf_lower((BLeaf *)node, key);
+}
+
+void bt_offset(BTree *tree, BIter *it, int64_t offset)
+{
+    BLeaf *leaf = it->leaf;
+    if (!leaf)
+    {
+        return;
+    }
+    int64_t pos = (int64_t)it->idx + offset;
+    int64_t n = leaf->base.n;
+    if (pos >= 0 && pos < n)
+    {
+        it->idx = (uint32_t)pos;
+        return;
+    }
+    // the neighbour leaves
+    if (pos >= n && (!leaf->next || pos - n < leaf->next->base.n))
+    {
+        it->leaf = leaf->next;
+        it->idx = leaf->next ? (uint32_t)(pos - n) : 0;
+        return;
+    }
+    if (pos < 0 && (!leaf->prev || pos + leaf->prev->base.n >= 0))
+    {
+        it->leaf = leaf->prev;
+        it->idx = leaf->prev ? (uint32_t)(pos + leaf->prev->base.n) : 0;
+        return;
+    }
+    int64_t rank = (int64_t)bt_rank(tree, leaf->keys.items[it->idx]) + offset;
+    *it = rank < 0 ? BIter() : bt_at(tree, (uint64_t)rank);
+}
+
+// level by level from the leaves, with full nodes like appending in order
+// leaves them. the last inner node of a level gets 2 children at least.
+void bt_build(BTree *tree, ZNode **items, size_t n)
+{
+    assert(!tree->root);
+    if (n == 0)
+    {
+        return;
+    }
+    std::vector<BNode *> level;
+    BLeaf *prev = NULL;
+    for (size_t i = 0; i < n; i += k_bt_cap)
+    {
+        BLeaf *leaf = leaf_new();
+        uint32_t cnt = n - i < k_bt_cap ? (uint32_t)(n - i) : k_bt_cap;
+        for (uint32_t k = 0; k < cnt; k++)
+        {
+            keys_set(&leaf->keys, k, items[i + k]);
+        }
+        leaf->base.n = (uint16_t)cnt;
+        leaf->prev = prev;
+        if (prev)
+        {
+            prev->next = leaf;
+        }
+        prev = leaf;
+        level.push_back(&leaf->base);
+    }
+    while (level.size() > 1)
+    {
+        std::vector<BNode *> up;
+        for (size_t i = 0; i < level.size();)
+        {
+            size_t cnt = level.size() - i < k_bt_cap ? level.size() - i : k_bt_cap;
+            if (level.size() - i - cnt == 1)
+            {
+                cnt--;
+            }
+            BInner *inner = inner_new();
+            for (uint32_t k = 0; k < cnt; k++)
+            {
+                BNode *kid = level[i + k];
+                inner->kids[k] = kid;
+                inner->cnts[k] = node_count(kid);
+                keys_set(&inner->keys, k, node_min(kid));
+            }
+            inner->base.n = (uint16_t)cnt;
+            up.push_back(&inner->base);
+            i += cnt;
+        }
+        level.swap(up);
+    }
+    tree->root = level[0];
+    tree->size = n;
+}
+
+static void node_dispose(BNode *node, void (*f)(ZNode *))
+{
+    if (node->leaf)
+    {
+        BLeaf *leaf = (BLeaf *)node;
+        for (uint32_t i = 0; i < node->n; i++)
+        {
+            f(leaf->keys.items[i]);
+        }
+    }
+    else
+    {
+        BInner *inner = (BInner *)node;
+        for (uint32_t i = 0; i < node->n; i++)
+        {
+            node_dispose(inner->kids[i], f);
+        }
+    }
+    node_free(node);
+}
+
+void bt_dispose(BTree *tree, void (*f)(ZNode *))
+{
+    if (tree->root)
+    {
+        node_dispose(tree->root, f);
+    }
+    tree->root = NULL;
+    tree->size = 0;
+}
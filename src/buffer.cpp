@@ -0,0 +1,75 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "buffer.h"
+
+const uint32_t k_min_class = 10;           // 1 KB
+const uint32_t k_max_class = 20;           // 1 MB, larger buffers aren't pooled
+const size_t k_class_bytes = 4 * 1024 * 1024; // max cached bytes per class
+
+// free buffers of each size class, one pool per thread (shard)
+static thread_local std::vector<uint8_t *> g_free[k_max_class + 1];
+
+static uint32_t size_class(size_t n)
+{
+    uint32_t c = k_min_class;
+    while (((size_t)1 << c) < n)
+    {
+        c++;
+    }
+    return c;
+}
+
+static uint8_t *pool_get(uint32_t c)
+{
+    if (c <= k_max_class && !g_free[c].empty())
+    {
+        uint8_t *p = g_free[c].back();
+        g_free[c].pop_back();
+        return p;
+    }
+    return (uint8_t *)malloc((size_t)1 << c);
+}
+
+static void pool_put(uint8_t *p, uint32_t c)
+{
+    if (c <= k_max_class && (g_free[c].size() << c) < k_class_bytes)
+    {
+        g_free[c].push_back(p);
+        return;
+    }
+    free(p);
+}
+
+bool buf_reserve(Buffer *buf, size_t used, size_t need)
+{
+    assert(used <= buf->cap);
+    if (need <= buf->cap)
+    {
+        return true;
+    }
+    uint32_t c = size_class(need);
+    uint8_t *data = pool_get(c);
+    if (!data)
+    {
+        return false;
+    }
+    if (buf->data)
+    {
+        memcpy(data, buf->data, used);
+        pool_put(buf->data, size_class(buf->cap));
+    }
+    buf->data = data;
+    buf->cap = (size_t)1 << c;
+    return true;
+}
+
+void buf_release(Buffer *buf)
+{
+    if (buf->data)
+    {
+        pool_put(buf->data, size_class(buf->cap));
+    }
+    *buf = Buffer();
+}
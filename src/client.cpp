@@ -7,6 +7,7 @@
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <string>
 #include <vector>
 #include <arpa/inet.h>
 #include "common.h"
@@ -16,7 +17,7 @@
 struct addrinfo hints, *servinfo, *p;
 int rv;
 int sockfd;
-const size_t k_max_msg = 4096;
+const size_t k_max_msg = 32 << 20;
 
 static void msg(const char *msg)
 {
@@ -163,8 +164,8 @@ static int32_t send_req(int fd, const std::vector<std::string> &cmd)
     }
 
     // fill the whole length in wbuf, except for itself
-    char wbuf[4 + k_max_msg];
-    memcpy(wbuf, &len, 4);
+    std::vector<char> wbuf(4 + len);
+    memcpy(wbuf.data(), &len, 4);
     // fill the number of paras
     uint32_t n = cmd.size();
     memcpy(&wbuf[4], &n, 4);
@@ -177,7 +178,7 @@ static int32_t send_req(int fd, const std::vector<std::string> &cmd)
         memcpy(&wbuf[margin + 4], s.data(), s.size());
         margin += 4 + s.size();
     }
-    return write_all(fd, wbuf, 4 + len);
+    return write_all(fd, wbuf.data(), 4 + len);
 }
 
 // aim to read n bytes, if it fails once, try again until read full
@@ -209,10 +210,10 @@ static int32_t read_full(int fd, char *buf, size_t n)
 static int32_t read_res(int fd)
 {
     // 定义读取缓冲区
-    char rbuf[4 + k_max_msg + 1];
+    char hdr[4];
     errno = 0;
     // 先读取长度
-    int32_t err = read_full(fd, rbuf, 4);
+    int32_t err = read_full(fd, hdr, 4);
     if (err)
     {
         if (err == -1)
@@ -227,7 +228,7 @@ static int32_t read_res(int fd)
     }
 
     uint32_t len = 0;
-    memcpy(&len, rbuf, 4);
+    memcpy(&len, hdr, 4);
     // 检查消息长度
     if (len > k_max_msg)
     {
@@ -237,7 +238,8 @@ static int32_t read_res(int fd)
     }
 
     // 读取内容
-    err = read_full(fd, &rbuf[4], len);
+    std::vector<char> rbuf(len + 1);
+    err = read_full(fd, rbuf.data(), len);
     if (err)
     {
         if (err == -1)
@@ -251,7 +253,7 @@ static int32_t read_res(int fd)
         return err;
     }
     // 解析响应
-    int32_t rv = on_response((uint8_t *)&rbuf[4], len);
+    int32_t rv = on_response((uint8_t *)rbuf.data(), len);
     if (rv > 0 && (uint32_t)rv != len)
     {
         msg("bad response c");
@@ -0,0 +1,354 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <utility>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "flatmap.h"
+#include "hashtable.h"
+
+/*
+control tags:
+- 0 is empty and 1 is deleted (a tombstone).
+- a full slot has the high bit set, plus the top 7 bits of the mixed hash.
+  empty is 0 so a new table comes zeroed from calloc, and the kernel
+  hands out the pages as the table fills instead of all at once.
+the slots are in groups of 16. a key probes the groups g, g+1, g+3, g+6, ...
+and stops at the first group that still has an empty slot.
+*/
+
+const uint8_t k_empty = 0;
+const uint8_t k_deleted = 1;
+const size_t k_group = 16;
+// slots moved from the older table per operation
+const size_t k_migrate_work = 256;
+
+// spread the hash over all 64 bits, the tag and the group come from different bits
+static uint64_t fm_mix(uint64_t hcode)
+{
+    return hcode * 0x9E3779B97F4A7C15ull;
+}
+
+static uint8_t h2_of(uint64_t h)
+{
+    return (uint8_t)(0x80 | (h >> 57));
+}
+
+static size_t h1_of(uint64_t h)
+{
+    return (size_t)(h ^ (h >> 29));
+}
+
+// bitmasks over the 16 tags of a group
+#ifdef __SSE2__
+static uint32_t match_tag(const uint8_t *group, uint8_t tag)
+{
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)tag)));
+}
+
+// empty or deleted, the high bit is clear
+static uint32_t match_free(const uint8_t *group)
+{
+    return ~(uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group)) & 0xFFFF;
+}
+#else
+static uint32_t match_tag(const uint8_t *group, uint8_t tag)
+{
+    uint32_t m = 0;
+    for (size_t i = 0; i < k_group; i++)
+    {
+        m |= (uint32_t)(group[i] == tag) << i;
+    }
+    return m;
+}
+
+static uint32_t match_free(const uint8_t *group)
+{
+    uint32_t m = 0;
+    for (size_t i = 0; i < k_group; i++)
+    {
+        m |= (uint32_t)(~group[i] >> 7 & 1) << i;
+    }
+    return m;
+}
+#endif
+
+static void ft_init(FTab *tab, size_t n)
+{
+    assert(n >= k_group && ((n - 1) & n) == 0);
+    // the tags go first so the slots stay aligned
+    uint8_t *mem = (uint8_t *)calloc(n + n * sizeof(HNode *), 1);
+    tab->ctrl = mem;
+    tab->slots = (HNode **)(mem + n);
+    tab->mask = n - 1;
+    tab->size = 0;
+    // max load factor 7/8, so a probe always ends at an empty slot
+    tab->growth_left = n - n / 8;
+}
+
+// return the slot that has the key.
+// the probe visits every group once since the number of groups is a power of 2.
+static HNode **ft_lookup(FTab *tab, HNode *key, bool (*eq)(HNode *, HNode *), uint64_t h)
+{
+    if (!tab->ctrl)
+    {
+        return NULL;
+    }
+    size_t gmask = tab->mask / k_group;
+    size_t g = h1_of(h) & gmask;
+    uint8_t tag = h2_of(h);
+    for (size_t step = 1;; step++)
+    {
+        const uint8_t *group = &tab->ctrl[g * k_group];
+        for (uint32_t m = match_tag(group, tag); m; m &= m - 1)
+        {
+            HNode **slot = &tab->slots[g * k_group + __builtin_ctz(m)];
+            if ((*slot)->hcode == key->hcode && eq(*slot, key))
+            {
+                return slot;
+            }
+        }
+        if (match_tag(group, k_empty))
+        {
+            return NULL;
+        }
+        g = (g + step) & gmask;
+    }
+}
+
+// take the first free slot on the probe sequence
+static void ft_insert(FTab *tab, HNode *node, uint64_t h)
+{
+    size_t gmask = tab->mask / k_group;
+    size_t g = h1_of(h) & gmask;
+    for (size_t step = 1;; step++)
+    {
+        uint32_t m = match_free(&tab->ctrl[g * k_group]);
+        if (m)
+        {
+            size_t pos = g * k_group + __builtin_ctz(m);
+            if (tab->ctrl[pos] == k_empty)
+            {
+                assert(tab->growth_left > 0);
+                tab->growth_left--;
+            }
+            tab->ctrl[pos] = h2_of(h);
+            tab->slots[pos] = node;
+            tab->size++;
+            return;
+        }
+        g = (g + step) & gmask;
+    }
+}
+
+static HNode *ft_detach(FTab *tab, HNode **slot)
+{
+    size_t pos = slot - tab->slots;
+    // no probe went past a group with an empty slot, so this one can be empty again.
+    // otherwise leave a tombstone so the probes don't stop here.
+    if (match_tag(&tab->ctrl[pos & ~(k_group - 1)], k_empty))
+    {
+        tab->ctrl[pos] = k_empty;
+        tab->growth_left++;
+    }
+    else
+    {
+        tab->ctrl[pos] = k_deleted;
+    }
+    tab->size--;
+    return *slot;
+}
+
+static void fm_start_resizing(FMap *fmap)
+{
+    assert(fmap->older.ctrl == NULL);
+    // double it, or rehash at the same size if it's mostly tombstones
+    size_t n = fmap->newer.mask + 1;
+    if (fmap->newer.size * 2 >= n - n / 8)
+    {
+        n *= 2;
+    }
+    fmap->older = fmap->newer;
+    ft_init(&fmap->newer, n);
+    fmap->migrate_pos = 0;
+}
+
+// it’s triggered from both lookups and updates.
+// the newer table has room for everything left in the older one
+// long before the older one is fully scanned.
+static void fm_help_resizing(FMap *fmap)
+{
+    FTab *older = &fmap->older;
+    if (!older->ctrl)
+    {
+        return;
+    }
+    size_t end = fmap->migrate_pos + k_migrate_work;
+    if (end > older->mask + 1)
+    {
+        end = older->mask + 1;
+    }
+    for (; fmap->migrate_pos < end && older->size > 0; fmap->migrate_pos++)
+    {
+        size_t pos = fmap->migrate_pos;
+        if (!(older->ctrl[pos] & 0x80))
+        {
+            continue; // empty or deleted
+        }
+        HNode *node = older->slots[pos];
+        older->ctrl[pos] = k_deleted;
+        older->size--;
+        ft_insert(&fmap->newer, node, fm_mix(node->hcode));
+    }
+    if (older->size == 0)
+    {
+        // done
+        free(older->ctrl);
+        *older = FTab();
+    }
+}
+
+void fm_insert(FMap *fmap, HNode *node)
+{
+    if (!fmap->newer.ctrl)
+    {
+        ft_init(&fmap->newer, k_group);
+    }
+    ft_insert(&fmap->newer, node, fm_mix(node->hcode));
+    if (!fmap->older.ctrl && fmap->newer.growth_left == 0)
+    {
+        fm_start_resizing(fmap);
+    }
+    fm_help_resizing(fmap);
+}
+
+void fm_reserve(FMap *fmap, size_t n)
+{
+    size_t cap = k_group;
+    while (cap - cap / 8 < n)
+    {
+        cap *= 2;
+    }
+    if (fmap->older.ctrl || cap <= fmap->newer.mask + 1)
+    {
+        return; // resizing already, or big enough
+    }
+    if (fmap->newer.ctrl)
+    {
+        fmap->older = fmap->newer;
+        fmap->migrate_pos = 0;
+    }
+    ft_init(&fmap->newer, cap);
+}
+
+HNode *fm_lookup(FMap *fmap, HNode *key, bool (*eq)(HNode *, HNode *))
+{
+    fm_help_resizing(fmap);
+    uint64_t h = fm_mix(key->hcode);
+    HNode **slot = ft_lookup(&fmap->newer, key, eq, h);
+    slot = slot ? slot : ft_lookup(&fmap->older, key, eq, h);
+    return slot ? *slot : NULL;
+}
+
+HNode *fm_pop(FMap *fmap, HNode *key, bool (*eq)(HNode *, HNode *))
+{
+    fm_help_resizing(fmap);
+    uint64_t h = fm_mix(key->hcode);
+    HNode **slot = ft_lookup(&fmap->newer, key, eq, h);
+    if (slot)
+    {
+        return ft_detach(&fmap->newer, slot);
+    }
+    slot = ft_lookup(&fmap->older, key, eq, h);
+    if (slot)
+    {
+        return ft_detach(&fmap->older, slot);
+    }
+    return NULL;
+}
+
+size_t fm_size(FMap *fmap)
+{
+    return fmap->newer.size + fmap->older.size;
+}
+
+static void ft_foreach(FTab *tab, void (*f)(HNode *, void *), void *arg)
+{
+    if (tab->size == 0)
+    {
+        return;
+    }
+    for (size_t i = 0; i < tab->mask + 1; i++)
+    {
+        if (tab->ctrl[i] & 0x80)
+        {
+            f(tab->slots[i], arg);
+        }
+    }
+}
+
+void fm_foreach(FMap *fmap, void (*f)(HNode *, void *), void *arg)
+{
+    ft_foreach(&fmap->newer, f, arg);
+    ft_foreach(&fmap->older, f, arg);
+}
+
+// the nodes whose probe sequence starts at group g
+static void ft_scan_group(FTab *tab, size_t g, void (*f)(HNode *, void *), void *arg)
+{
+    size_t gmask = tab->mask / k_group;
+    size_t home = g;
+    for (size_t step = 1;; step++)
+    {
+        const uint8_t *group = &tab->ctrl[g * k_group];
+        for (size_t i = 0; i < k_group; i++)
+        {
+            HNode *node = tab->slots[g * k_group + i];
+            if ((group[i] & 0x80) && (h1_of(fm_mix(node->hcode)) & gmask) == home)
+            {
+                f(node, arg);
+            }
+        }
+        if (match_tag(group, k_empty))
+        {
+            return;
+        }
+        g = (g + step) & gmask;
+    }
+}
+
+uint64_t fm_scan(FMap *fmap, uint64_t cursor, void (*f)(HNode *, void *), void *arg)
+{
+    FTab *small = &fmap->newer;
+    FTab *big = &fmap->older;
+    if (!big->ctrl)
+    {
+        if (!small->ctrl)
+        {
+            return 0;
+        }
+        ft_scan_group(small, cursor & (small->mask / k_group), f, arg);
+        return scan_next(cursor, small->mask / k_group);
+    }
+    if (small->mask > big->mask)
+    {
+        std::swap(small, big);
+    }
+    size_t smask = small->mask / k_group;
+    size_t bmask = big->mask / k_group;
+    ft_scan_group(small, cursor & smask, f, arg);
+    do
+    {
+        ft_scan_group(big, cursor & bmask, f, arg);
+        cursor = scan_next(cursor, bmask);
+    } while (cursor & (smask ^ bmask));
+    return cursor;
+}
+
+void fm_destroy(FMap *fmap)
+{
+    free(fmap->newer.ctrl);
+    free(fmap->older.ctrl);
+    *fmap = FMap();
+}
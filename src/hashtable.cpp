@@ -1,11 +1,56 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <utility>
 #include "hashtable.h"
 /*
 using intrusive data structure
 */
 
+#ifdef USE_FLATMAP
+
+HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *))
+{
+    return fm_lookup(&hmap->fm, key, eq);
+}
+
+void hm_insert(HMap *hmap, HNode *node)
+{
+    fm_insert(&hmap->fm, node);
+}
+
+HNode *hm_pop(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *))
+{
+    return fm_pop(&hmap->fm, key, eq);
+}
+
+size_t hm_size(HMap *hmap)
+{
+    return fm_size(&hmap->fm);
+}
+
+void hm_reserve(HMap *hmap, size_t n)
+{
+    fm_reserve(&hmap->fm, n);
+}
+
+void hm_foreach(HMap *hmap, void (*f)(HNode *, void *), void *arg)
+{
+    fm_foreach(&hmap->fm, f, arg);
+}
+
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, void (*f)(HNode *, void *), void *arg)
+{
+    return fm_scan(&hmap->fm, cursor, f, arg);
+}
+
+void hm_destroy(HMap *hmap)
+{
+    fm_destroy(&hmap->fm);
+}
+
+#else
+
 const size_t k_resizing_work = 128;
 
 static void h_init(HTab *htab, size_t n)
@@ -152,9 +197,90 @@ size_t hm_size(HMap *hmap)
     return hmap->ht1.size + hmap->ht2.size;
 }
 
+// a table of n slots, the chains average 1 node instead of up to
+// k_max_load_factor when it gets there by doubling
+void hm_reserve(HMap *hmap, size_t n)
+{
+    size_t cap = 4;
+    while (cap < n)
+    {
+        cap *= 2;
+    }
+    if (hmap->ht2.tab || cap <= hmap->ht1.mask + 1)
+    {
+        return; // resizing already, or big enough
+    }
+    if (hmap->ht1.tab)
+    {
+        hmap->ht2 = hmap->ht1;
+        hmap->resizing_pos = 0;
+    }
+    h_init(&hmap->ht1, cap);
+}
+
+static void h_scan(HTab *tab, void (*f)(HNode *, void *), void *arg)
+{
+    if (tab->size == 0)
+    {
+        return;
+    }
+    for (size_t i = 0; i < tab->mask + 1; ++i)
+    {
+        HNode *node = tab->tab[i];
+        while (node)
+        {
+            f(node, arg);
+            node = node->next;
+        }
+    }
+}
+
+void hm_foreach(HMap *hmap, void (*f)(HNode *, void *), void *arg)
+{
+    h_scan(&hmap->ht1, f, arg);
+    h_scan(&hmap->ht2, f, arg);
+}
+
+static void h_scan_bucket(HTab *tab, size_t pos, void (*f)(HNode *, void *), void *arg)
+{
+    for (HNode *node = tab->tab[pos]; node; node = node->next)
+    {
+        f(node, arg);
+    }
+}
+
+uint64_t hm_scan(HMap *hmap, uint64_t cursor, void (*f)(HNode *, void *), void *arg)
+{
+    HTab *small = &hmap->ht1;
+    HTab *big = &hmap->ht2;
+    if (!big->tab)
+    {
+        if (!small->tab)
+        {
+            return 0;
+        }
+        h_scan_bucket(small, cursor & small->mask, f, arg);
+        return scan_next(cursor, small->mask);
+    }
+    if (small->mask > big->mask)
+    {
+        std::swap(small, big);
+    }
+    // a node that moved between the tables is in one of these
+    h_scan_bucket(small, cursor & small->mask, f, arg);
+    do
+    {
+        h_scan_bucket(big, cursor & big->mask, f, arg);
+        cursor = scan_next(cursor, big->mask);
+    } while (cursor & (small->mask ^ big->mask));
+    return cursor;
+}
+
 void hm_destroy(HMap *hmap)
 {
     free(hmap->ht1.tab);
     free(hmap->ht2.tab);
     *hmap = HMap();
-}
\ No newline at end of file
+}
+
+#endif // USE_FLATMAP
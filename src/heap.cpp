@@ -0,0 +1,93 @@
+#include <assert.h>
+#include "heap.h"
+
+static size_t heap_parent(size_t i)
+{
+    return (i + 1) / 2 - 1;
+}
+
+static size_t heap_left(size_t i)
+{
+    return i * 2 + 1;
+}
+
+static void heap_set(std::vector<HeapItem> &heap, size_t pos, HeapItem item)
+{
+    heap[pos] = item;
+    *item.ref = (uint32_t)pos;
+}
+
+static void heap_up(std::vector<HeapItem> &heap, size_t pos)
+{
+    HeapItem t = heap[pos];
+    while (pos > 0 && heap[heap_parent(pos)].val > t.val)
+    {
+        // swap with the parent
+        heap_set(heap, pos, heap[heap_parent(pos)]);
+        pos = heap_parent(pos);
+    }
+    heap_set(heap, pos, t);
+}
+
+static void heap_down(std::vector<HeapItem> &heap, size_t pos)
+{
+    HeapItem t = heap[pos];
+    size_t len = heap.size();
+    while (true)
+    {
+        // find the smallest one among the parent and the children
+        size_t l = heap_left(pos);
+        size_t r = l + 1;
+        size_t min_pos = pos;
+        uint64_t min_val = t.val;
+        if (l < len && heap[l].val < min_val)
+        {
+            min_pos = l;
+            min_val = heap[l].val;
+        }
+        if (r < len && heap[r].val < min_val)
+        {
+            min_pos = r;
+        }
+        if (min_pos == pos)
+        {
+            break;
+        }
+        // swap with the smaller child
+        heap_set(heap, pos, heap[min_pos]);
+        pos = min_pos;
+    }
+    heap_set(heap, pos, t);
+}
+
+void heap_fix(std::vector<HeapItem> &heap, size_t pos)
+{
+    if (pos > 0 && heap[heap_parent(pos)].val > heap[pos].val)
+    {
+        heap_up(heap, pos);
+    }
+    else
+    {
+        heap_down(heap, pos);
+    }
+}
+
+void heap_push(std::vector<HeapItem> &heap, HeapItem item)
+{
+    assert(heap.size() < k_heap_none);
+    heap.push_back(item);
+    heap_up(heap, heap.size() - 1);
+}
+
+void heap_remove(std::vector<HeapItem> &heap, size_t pos)
+{
+    *heap[pos].ref = k_heap_none;
+    // fill the hole with the last item
+    HeapItem last = heap.back();
+    heap.pop_back();
+    if (pos < heap.size())
+    {
+        heap[pos] = last;
+        heap_fix(heap, pos);
+    }
+}
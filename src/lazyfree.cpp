@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include "lazyfree.h"
+
+struct LazyJob
+{
+    void (*fn)(void *) = NULL;
+    void *arg = NULL;
+};
+
+static std::mutex g_mu;
+static std::condition_variable g_cv;
+static std::deque<LazyJob> g_jobs;
+static std::atomic<size_t> g_pending{0};
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+
+static void *lazyfree_main(void *)
+{
+#ifdef __linux__
+    // the event loops go first when they share a CPU with this thread.
+    // on linux the nice value is per thread.
+    (void)setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+#endif
+    while (true)
+    {
+        LazyJob job;
+        {
+            std::unique_lock<std::mutex> lock(g_mu);
+            g_cv.wait(lock, [] { return !g_jobs.empty(); });
+            job = g_jobs.front();
+            g_jobs.pop_front();
+        }
+        job.fn(job.arg);
+        g_pending.fetch_sub(1, std::memory_order_relaxed);
+    }
+    return NULL;
+}
+
+// the thread starts with the first job
+static void lazyfree_start()
+{
+    pthread_t tid;
+    if (0 != pthread_create(&tid, NULL, &lazyfree_main, NULL))
+    {
+        fprintf(stderr, "lazyfree: pthread_create failed\n");
+        abort();
+    }
+    pthread_detach(tid);
+}
+
+void lazyfree_submit(void (*fn)(void *), void *arg)
+{
+    pthread_once(&g_once, &lazyfree_start);
+    g_pending.fetch_add(1, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(g_mu);
+        LazyJob job;
+        job.fn = fn;
+        job.arg = arg;
+        g_jobs.push_back(job);
+    }
+    g_cv.notify_one();
+}
+
+size_t lazyfree_pending()
+{
+    return g_pending.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,203 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "log.h"
+
+/*
+- every thread that logs gets a ring of fixed size records, the thread is
+  the only producer. the text is formatted straight into the record.
+- the consumer is whoever holds g_rings_mu: the flush thread every
+  k_flush_ms, or log_flush(). it writes the records of a ring in order,
+  the rings of different threads aren't merged by time.
+*/
+
+const size_t k_ring_size = 1024; // a power of 2
+const size_t k_text_size = 240;
+const long k_flush_ms = 10;
+
+struct LogRecord
+{
+    uint64_t ts_us = 0;
+    uint32_t level = 0;
+    uint32_t len = 0;
+    char text[k_text_size];
+};
+
+struct LogRing
+{
+    alignas(64) std::atomic<size_t> head{0}; // next record to write out, owned by the consumer
+    alignas(64) std::atomic<size_t> tail{0}; // next record to fill, owned by the thread
+    // written by the thread only
+    std::atomic<uint64_t> lines{0};
+    std::atomic<uint64_t> dropped{0};
+    // the drops written out already, owned by the consumer
+    uint64_t dropped_seen = 0;
+    uint32_t id = 0;
+    LogRecord recs[k_ring_size];
+};
+
+// all rings, never freed. the lock is also held to consume them.
+static std::mutex g_rings_mu;
+static std::vector<LogRing *> g_rings;
+static thread_local LogRing *t_ring = NULL;
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+
+static const char k_level_chars[] = "TDIWE";
+
+static void counter_inc(std::atomic<uint64_t> &c)
+{
+    c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+static void write_all(const char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t rv = write(2, buf, n);
+        if (rv <= 0)
+        {
+            return; // nowhere to report it
+        }
+        buf += rv;
+        n -= (size_t)rv;
+    }
+}
+
+// the consumer, with g_rings_mu held
+static void drain_rings()
+{
+    char out[64 * 1024];
+    size_t pos = 0;
+    for (LogRing *ring : g_rings)
+    {
+        size_t head = ring->head.load(std::memory_order_relaxed);
+        size_t tail = ring->tail.load(std::memory_order_acquire);
+        for (; head != tail; head++)
+        {
+            if (sizeof(out) - pos < k_text_size + 64)
+            {
+                write_all(out, pos);
+                pos = 0;
+            }
+            const LogRecord &rec = ring->recs[head & (k_ring_size - 1)];
+            time_t sec = (time_t)(rec.ts_us / 1000000);
+            struct tm tm;
+            localtime_r(&sec, &tm);
+            pos += strftime(&out[pos], 32, "%Y-%m-%d %H:%M:%S", &tm);
+            pos += snprintf(&out[pos], 32, ".%03u %c [%u] ", (unsigned)(rec.ts_us / 1000 % 1000),
+                            k_level_chars[rec.level], ring->id);
+            memcpy(&out[pos], rec.text, rec.len);
+            pos += rec.len;
+            out[pos++] = '\n';
+        }
+        ring->head.store(head, std::memory_order_release);
+        uint64_t dropped = ring->dropped.load(std::memory_order_relaxed);
+        if (dropped != ring->dropped_seen)
+        {
+            if (sizeof(out) - pos < 64)
+            {
+                write_all(out, pos);
+                pos = 0;
+            }
+            pos += snprintf(&out[pos], 64, "[%u] %llu lines dropped\n", ring->id,
+                            (unsigned long long)(dropped - ring->dropped_seen));
+            ring->dropped_seen = dropped;
+        }
+    }
+    write_all(out, pos);
+}
+
+static void *flush_main(void *)
+{
+    while (true)
+    {
+        timespec ts = {0, k_flush_ms * 1000000};
+        nanosleep(&ts, NULL);
+        std::lock_guard<std::mutex> lock(g_rings_mu);
+        drain_rings();
+    }
+    return NULL;
+}
+
+// the flush thread starts with the first line
+static void log_start()
+{
+    pthread_t tid;
+    if (0 == pthread_create(&tid, NULL, &flush_main, NULL))
+    {
+        pthread_detach(tid);
+    }
+    atexit(&log_flush);
+}
+
+static LogRing *ring_get()
+{
+    if (!t_ring)
+    {
+        pthread_once(&g_once, &log_start);
+        t_ring = new LogRing();
+        std::lock_guard<std::mutex> lock(g_rings_mu);
+        t_ring->id = (uint32_t)g_rings.size();
+        g_rings.push_back(t_ring);
+    }
+    return t_ring;
+}
+
+void log_write(int level, const char *fmt, ...)
+{
+    LogRing *ring = ring_get();
+    size_t tail = ring->tail.load(std::memory_order_relaxed);
+    if (tail - ring->head.load(std::memory_order_acquire) >= k_ring_size)
+    {
+        counter_inc(ring->dropped); // never wait for the flush thread
+        return;
+    }
+    LogRecord &rec = ring->recs[tail & (k_ring_size - 1)];
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    rec.ts_us = uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+    rec.level = (uint32_t)(level < LL_TRACE ? LL_TRACE : level > LL_ERROR ? LL_ERROR : level);
+    va_list ap;
+    va_start(ap, fmt);
+    int rv = vsnprintf(rec.text, k_text_size, fmt, ap);
+    va_end(ap);
+    // truncated if it's too long
+    rec.len = rv < 0 ? 0 : (uint32_t)rv < k_text_size ? (uint32_t)rv : k_text_size - 1;
+    ring->tail.store(tail + 1, std::memory_order_release);
+    counter_inc(ring->lines);
+}
+
+void log_flush()
+{
+    std::lock_guard<std::mutex> lock(g_rings_mu);
+    drain_rings();
+}
+
+uint64_t log_lines()
+{
+    uint64_t n = 0;
+    std::lock_guard<std::mutex> lock(g_rings_mu);
+    for (LogRing *ring : g_rings)
+    {
+        n += ring->lines.load(std::memory_order_relaxed);
+    }
+    return n;
+}
+
+uint64_t log_dropped()
+{
+    uint64_t n = 0;
+    std::lock_guard<std::mutex> lock(g_rings_mu);
+    for (LogRing *ring : g_rings)
+    {
+        n += ring->dropped.load(std::memory_order_relaxed);
+    }
+    return n;
+}
@@ -0,0 +1,222 @@
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#include "netpoll.h"
+
+/*
+The poll backend keeps the pollfd array alive between waits, so fds are only
+added/removed on connect/disconnect. poll() itself is still O(n) in the kernel,
+that's what the epoll backend is for.
+*/
+
+const int k_max_events = 256;
+
+static uint32_t to_poll(uint32_t events)
+{
+    uint32_t out = POLLERR;
+    if (events & NP_IN)
+    {
+        out |= POLLIN;
+    }
+    if (events & NP_OUT)
+    {
+        out |= POLLOUT;
+    }
+    return out;
+}
+
+static uint32_t from_poll(uint32_t revents)
+{
+    uint32_t out = 0;
+    if (revents & POLLIN)
+    {
+        out |= NP_IN;
+    }
+    if (revents & POLLOUT)
+    {
+        out |= NP_OUT;
+    }
+    if (revents & (POLLERR | POLLHUP | POLLNVAL))
+    {
+        out |= NP_ERR;
+    }
+    return out;
+}
+
+#ifdef __linux__
+static uint32_t to_epoll(NetPoll *np, uint32_t events)
+{
+    uint32_t out = 0;
+    if (events & NP_IN)
+    {
+        out |= EPOLLIN;
+    }
+    if (events & NP_OUT)
+    {
+        out |= EPOLLOUT;
+    }
+    if (np->edge)
+    {
+        out |= EPOLLET;
+    }
+    return out;
+}
+
+static uint32_t from_epoll(uint32_t revents)
+{
+    uint32_t out = 0;
+    if (revents & EPOLLIN)
+    {
+        out |= NP_IN;
+    }
+    if (revents & EPOLLOUT)
+    {
+        out |= NP_OUT;
+    }
+    if (revents & (EPOLLERR | EPOLLHUP))
+    {
+        out |= NP_ERR;
+    }
+    return out;
+}
+
+static bool ep_ctl(NetPoll *np, int op, int fd, uint32_t events)
+{
+    struct epoll_event ev = {};
+    ev.events = to_epoll(np, events);
+    ev.data.fd = fd;
+    return 0 == epoll_ctl(np->epfd, op, fd, &ev);
+}
+#endif
+
+bool np_init(NetPoll *np, int backend, bool edge)
+{
+    np->backend = backend;
+    np->edge = false;
+    if (backend == NP_BACKEND_EPOLL)
+    {
+#ifdef __linux__
+        np->epfd = epoll_create1(EPOLL_CLOEXEC);
+        np->edge = edge;
+        return np->epfd >= 0;
+#else
+        return false;
+#endif
+    }
+    return true;
+}
+
+void np_close(NetPoll *np)
+{
+    if (np->epfd >= 0)
+    {
+        (void)close(np->epfd);
+    }
+    *np = NetPoll();
+}
+
+bool np_add(NetPoll *np, int fd, uint32_t events)
+{
+#ifdef __linux__
+    if (np->backend == NP_BACKEND_EPOLL)
+    {
+        return ep_ctl(np, EPOLL_CTL_ADD, fd, events);
+    }
+#endif
+    if (np->fd2idx.size() <= (size_t)fd)
+    {
+        np->fd2idx.resize(fd + 1, -1);
+    }
+    assert(np->fd2idx[fd] < 0);
+    struct pollfd pfd = {fd, (short)to_poll(events), 0};
+    np->fd2idx[fd] = (int)np->pfds.size();
+    np->pfds.push_back(pfd);
+    return true;
+}
+
+bool np_mod(NetPoll *np, int fd, uint32_t events)
+{
+#ifdef __linux__
+    if (np->backend == NP_BACKEND_EPOLL)
+    {
+        return ep_ctl(np, EPOLL_CTL_MOD, fd, events);
+    }
+#endif
+    int idx = np->fd2idx[fd];
+    assert(idx >= 0);
+    np->pfds[idx].events = (short)to_poll(events);
+    return true;
+}
+
+void np_del(NetPoll *np, int fd)
+{
+#ifdef __linux__
+    if (np->backend == NP_BACKEND_EPOLL)
+    {
+        (void)epoll_ctl(np->epfd, EPOLL_CTL_DEL, fd, NULL);
+        return;
+    }
+#endif
+    if ((size_t)fd >= np->fd2idx.size() || np->fd2idx[fd] < 0)
+    {
+        return;
+    }
+    int idx = np->fd2idx[fd];
+    // swap with the last one, so removal is O(1)
+    struct pollfd last = np->pfds.back();
+    np->pfds[idx] = last;
+    np->fd2idx[last.fd] = idx;
+    np->pfds.pop_back();
+    np->fd2idx[fd] = -1;
+}
+
+// wait for events, return the number of events written to out, or -1 on error
+int np_wait(NetPoll *np, NPEvent *out, int max, int timeout_ms)
+{
+    if (max > k_max_events)
+    {
+        max = k_max_events;
+    }
+#ifdef __linux__
+    if (np->backend == NP_BACKEND_EPOLL)
+    {
+        struct epoll_event evs[k_max_events];
+        int rv = epoll_wait(np->epfd, evs, max, timeout_ms);
+        if (rv < 0)
+        {
+            return errno == EINTR ? 0 : -1;
+        }
+        for (int i = 0; i < rv; ++i)
+        {
+            out[i].fd = evs[i].data.fd;
+            out[i].events = from_epoll(evs[i].events);
+        }
+        return rv;
+    }
+#endif
+    int rv = poll(np->pfds.data(), (nfds_t)np->pfds.size(), timeout_ms);
+    if (rv < 0)
+    {
+        return errno == EINTR ? 0 : -1;
+    }
+    // from after the last fd returned, wrapping around
+    size_t size = np->pfds.size();
+    size_t start = np->next < size ? np->next : 0;
+    int n = 0;
+    for (size_t k = 0; k < size && n < rv && n < max; ++k)
+    {
+        size_t i = start + k < size ? start + k : start + k - size;
+        if (np->pfds[i].revents)
+        {
+            out[n].fd = np->pfds[i].fd;
+            out[n].events = from_poll(np->pfds[i].revents);
+            n++;
+            np->next = i + 1;
+        }
+    }
+    return n;
+}
@@ -10,26 +10,54 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <string_view>
 #include <vector>
 #include <map>
 #include "hashtable.h"
 #include "zset.h"
 #include "common.h"
 #include "list.h"
+#include "netpoll.h"
+#include "uring.h"
+#include "shard.h"
+#include "buffer.h"
+#include "slab.h"
+#include "heap.h"
+#include "timerwheel.h"
+#include "lazyfree.h"
+#include "log.h"
+#include "snapshot.h"
+#include "aof.h"
 
 #define PORT "3490" // the port users will be connecting to
 
-#define BACKLOG 10 // how many pending connections queue will hold
-
 static void msg(const char *msg)
 {
-    perror(msg);
+    log_error("%s: %s", msg, strerror(errno));
+}
+
+static void die(const char *msg)
+{
+    int err = errno;
+    log_error("[%d] %s", err, msg);
+    log_flush();
+    abort();
 }
 
 enum
@@ -37,6 +65,7 @@ enum
     STATE_REQ = 0, // reading request
     STATE_RES = 1, // sending responses
     STATE_END = 2, // mark the connection for deletion
+    STATE_WAIT = 3, // waiting for another shard to handle the request
 };
 
 enum
@@ -53,36 +82,182 @@ enum
     T_ZSET = 1,
 };
 
-const size_t k_max_msg = 4096;
+// the default limit of a request or a response, see --max-msg
+const size_t k_max_msg = 32 << 20;
+// responses of pipelined requests are batched in the write buffer,
+// parsing stops when the batch reaches this size.
+const size_t k_wbuf_batch = 64 * 1024;
+// bytes asked for by one recv()
+const size_t k_read_size = 16 * 1024;
+// the most the read buffer grows ahead of a partial request
+const size_t k_rbuf_ahead = 64 * 1024;
+
+// replies of a command fanned out to all shards
+struct Gather
+{
+    uint32_t n = 0;
+    std::string items;
+};
 
 struct Conn
 {
     int fd = -1;
     uint32_t state = 0;
-    // buffer for reading
+    // buffer for reading, requests before rbuf_start are handled already.
+    // both buffers go back to the pool when empty, an idle connection holds none.
+    Buffer rbuf;
+    size_t rbuf_start = 0;
     size_t rbuf_size = 0;
-    uint8_t rbuf[4 + k_max_msg];
     // buffer for writing
+    Buffer wbuf;
     size_t wbuf_size = 0;
     size_t wbuf_sent = 0;
-    uint8_t wbuf[4 + k_max_msg];
 
-    uint64_t idle_start = 0;
-    // timer
-    DList idle_list;
+    // CLIENT_*, picks the idle timeout
+    uint32_t cls = 0;
+    // closes the connection when it's idle for too long
+    Timer idle_timer;
+    // the NP_* interest currently registered in the poller
+    uint32_t events = 0;
+    // the UR_* requests the io_uring backend has in flight
+    uint32_t ur_ops = 0;
+    // a recv found no provided buffer, it waits for one to be given back
+    bool ur_nobufs = false;
+    // requests forwarded to other shards, not replied yet
+    uint32_t remote = 0;
+    Gather *gather = NULL;
+    // with AOF_FSYNC_ALWAYS: a request in wbuf was logged, so the responses
+    // wait for the fsync, and then, they're waiting in aof_held
+    bool aof_hold = false;
+    bool aof_wait = false;
 };
 
-// global variables
-static struct
+// io_uring requests, also the tag in the low bits of user_data
+enum
+{
+    UR_ACCEPT = 1,
+    UR_RECV = 2,
+    UR_SEND = 4,
+    UR_WAKE = 3, // not a connection, the shard's wakeup fd
+};
+
+// a command forwarded to the shard that owns its key, and then the reply
+enum
+{
+    MSG_REQ = 0,
+    MSG_RES = 1,
+};
+
+struct ShardMsg
+{
+    uint32_t type = MSG_REQ;
+    uint32_t src = 0; // the shard of the connection
+    Conn *conn = NULL; // only touched by the src shard
+    std::vector<std::string> cmd;
+    // the serialized reply, from the pool of the shard that made it
+    Buffer out;
+    size_t out_size = 0;
+    // there wasn't memory for the reply, the client is dropped
+    bool failed = false;
+};
+
+// a response held until the log is on disk: the responses of a connection,
+// or the reply to a request forwarded by another shard
+struct AofHeld
 {
+    Conn *conn = NULL;
+    ShardMsg *msg = NULL;
+    uint64_t ticket = 0; // 0 until the batch it waits for is written
+};
+
+// global variables, one set per shard thread
+static thread_local struct
+{
+    Shard *shard = NULL;
+    // only the keys with shard_of(hcode) == shard->id
     HMap db;
     // a map of all client connections, keyed by fd
     std::vector<Conn *> fd2conn;
     // timers for idle connections
-    DList idle_list;
+    TimerWheel timers;
+    // all fds (listening fd included) are registered here
+    NetPoll poller;
+    int listen_fd = -1;
+    // accept() ran out of fds or memory: the listener is disarmed until this
+    // time, or until a connection is closed. 0 when it's armed.
+    uint64_t accept_paused_ms = 0;
+    // the error is logged once, until an accept() works again
+    bool accept_failing = false;
+#ifdef __linux__
+    // used instead of the poller with --backend uring
+    URing ring;
+    bool ur_multishot = true;
+    // the fds of the connections with ur_nobufs
+    std::vector<int> ur_starved;
+    // ring.recycled at the end of the last loop iteration
+    uint64_t ur_recycled = 0;
+#endif
+    // reused by every request, so handling one doesn't allocate
+    std::vector<std::string_view> cmd;
+    // the deadlines of the keys with a TTL, in ms of the monotonic clock
+    std::vector<HeapItem> heap;
+    // the active expiry ran out of time with keys left to delete
+    bool expiry_pending = false;
+    // objects freed by other threads are left for the slab to take back
+    bool collect_pending = false;
+    // the BGSAVE child, if this shard forked it, and its SaveInfo pipe
+    pid_t save_child = -1;
+    int save_info_fd = -1;
+    // the commands logged in this loop iteration, written at its end
+    std::string aof_buf;
+    std::vector<AofHeld> aof_held;
+    // the ticket of the last batch written
+    uint64_t aof_ticket = 0;
+    // the log is being replayed, so nothing is logged
+    bool aof_replaying = false;
 } g_data;
 
-const uint64_t k_idle_timeout_ms = 5 * 1000;
+// the classes of clients, each with its own idle timeout
+enum
+{
+    CLIENT_REMOTE = 0,
+    CLIENT_LOCAL = 1, // from the same host
+    CLIENT_NCLASS = 2,
+};
+
+static const char *const k_client_class_names[CLIENT_NCLASS] = {"remote", "local"};
+
+// command line options
+static struct
+{
+#ifdef __linux__
+    int backend = NP_BACKEND_EPOLL;
+#else
+    int backend = NP_BACKEND_POLL;
+#endif
+    bool edge = false;
+    bool uring = false;
+    uint32_t shards = 1;
+    // the limit of a request or a response
+    size_t max_msg = k_max_msg;
+    // one SO_REUSEPORT listener per shard instead of a shared one
+    bool reuseport = false;
+    // how many pending connections queue will hold
+    int backlog = SOMAXCONN;
+    // by client class, 0 for no timeout
+    uint64_t idle_timeout_ms[CLIENT_NCLASS] = {5 * 1000, 5 * 1000};
+    // the snapshot written by BGSAVE, and loaded at startup
+    const char *dbfile = "dump.snap";
+    // the threads that decode it, 0 for one per CPU
+    uint32_t load_threads = 0;
+    // the append-only log, NULL for none, and its AOF_FSYNC_* policy
+    const char *aof_file = NULL;
+    int aof_fsync = AOF_FSYNC_EVERYSEC;
+    // it's rewritten when it's grown by this percentage since the last
+    // rewrite, and is at least the min size. 0 for never.
+    uint32_t aof_rewrite_pct = 100;
+    uint64_t aof_rewrite_min = 64 << 20;
+} g_config;
 
 static uint64_t get_monotonic_usec()
 {
@@ -91,102 +266,422 @@ static uint64_t get_monotonic_usec()
     return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
 }
 
-static void out_nil(std::string &out)
+static uint64_t get_monotonic_msec()
 {
-    // represent the serialized data is a nil
-    out.push_back(SER_NIL);
+    return get_monotonic_usec() / 1000;
+}
+
+// the TTLs are kept in monotonic time, a snapshot has them in wall clock time
+static int64_t get_wall_msec()
+{
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return int64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000000;
+}
+
+// the wall clock time of a monotonic deadline, or 0 (no TTL) past what an
+// int64_t holds, a TTL that long never runs out anyway
+static int64_t wall_deadline(uint64_t deadline, uint64_t now_ms, int64_t wall_ms)
+{
+    uint64_t left = deadline > now_ms ? deadline - now_ms : 0;
+    if (left > (uint64_t)(INT64_MAX - wall_ms))
+    {
+        return 0;
+    }
+    return wall_ms + (int64_t)left;
+}
+
+// a response being serialized, straight into a Buffer:
+// the connection's wbuf, or the reply of a message from another shard.
+struct Out
+{
+    Buffer *buf = NULL;
+    size_t start = 0; // where the response begins
+    size_t pos = 0;   // where the next byte goes
+    // out of memory, the response is incomplete, the client is dropped
+    bool failed = false;
+};
+
+static void out_init(Out &out, Buffer *buf, size_t start)
+{
+    out.buf = buf;
+    out.start = out.pos = start;
+    out.failed = false;
+}
+
+static void out_append(Out &out, const void *data, size_t n)
+{
+    if (out.failed || !buf_reserve(out.buf, out.pos, out.pos + n))
+    {
+        out.failed = true;
+        return;
+    }
+    memcpy(&out.buf->data[out.pos], data, n);
+    out.pos += n;
+}
+
+static void out_byte(Out &out, uint8_t byte)
+{
+    out_append(out, &byte, 1);
 }
 
-static void out_str(std::string &out, const std::string &val)
+static void out_nil(Out &out)
 {
-    out.push_back(SER_STR);
-    uint32_t len = (uint32_t)val.size();
-    out.append((char *)&len, 4);
-    out.append(val);
+    // represent the serialized data is a nil
+    out_byte(out, SER_NIL);
 }
-static void out_str(std::string &out, const char *s, size_t size)
+
+static void out_str(Out &out, const char *s, size_t size)
 {
-    out.push_back(SER_STR);
+    out_byte(out, SER_STR);
     uint32_t len = (uint32_t)size;
-    out.append((char *)&len, 4);
-    out.append(s, len);
+    out_append(out, &len, 4);
+    out_append(out, s, len);
+}
+static void out_str(Out &out, std::string_view val)
+{
+    out_str(out, val.data(), val.size());
 }
 
-static void out_dbl(std::string &out, double val)
+static void out_dbl(Out &out, double val)
 {
-    out.push_back(SER_DBL);
-    out.append((char *)&val, 8);
+    out_byte(out, SER_DBL);
+    out_append(out, &val, 8);
 }
 
 // TODO: unsafe implementation
-static void out_int(std::string &out, int64_t val)
+static void out_int(Out &out, int64_t val)
 {
-    out.push_back(SER_INT);
-    out.append((char *)&val, 8);
+    out_byte(out, SER_INT);
+    out_append(out, &val, 8);
 }
 
-static void out_err(std::string &out, int32_t code, const std::string &msg)
+static void out_err(Out &out, int32_t code, std::string_view msg)
 {
-    out.push_back(SER_ERR);
-    out.append((char *)&code, 4);
+    out_byte(out, SER_ERR);
+    out_append(out, &code, 4);
     uint32_t len = (uint32_t)msg.size();
-    out.append((char *)&len, 4);
-    out.append(msg);
+    out_append(out, &len, 4);
+    out_append(out, msg.data(), msg.size());
 }
 
-static void out_arr(std::string &out, uint32_t n)
+static void out_arr(Out &out, uint32_t n)
 {
-    out.push_back(SER_ARR);
-    out.append((char *)&n, 4);
+    out_byte(out, SER_ARR);
+    out_append(out, &n, 4);
 }
 
-static bool str2dbl(const std::string &s, double &out)
+static void *begin_arr(Out &out)
 {
+    out_byte(out, SER_ARR);
+    out_append(out, "\0\0\0\0", 4); // 预留4个字节用于稍后填充数组长度
+    return (void *)(out.pos - 4);     // 返回指向预留位置的偏移量（buffer 可能会增长，所以不是指针）
+}
+static void end_arr(Out &out, void *ctx, uint32_t n)
+{
+    size_t pos = (size_t)ctx;
+    if (out.failed)
+    {
+        return;
+    }
+    assert(out.buf->data[pos - 1] == SER_ARR);
+    memcpy(&out.buf->data[pos], &n, 4);
+}
+// the arguments aren't NUL-terminated, numbers are copied to the stack first
+static bool arg2cstr(std::string_view s, char (&buf)[64])
+{
+    if (s.size() >= sizeof(buf))
+    {
+        return false;
+    }
+    memcpy(buf, s.data(), s.size());
+    buf[s.size()] = '\0';
+    return true;
+}
+
+static bool str2dbl(std::string_view s, double &out)
+{
+    char buf[64];
+    if (!arg2cstr(s, buf))
+    {
+        return false;
+    }
     char *endp = NULL;
-    out = strtod(s.c_str(), &endp);
-    return endp == s.c_str() + s.size() && !isnan(out);
+    out = strtod(buf, &endp);
+    return endp == buf + s.size() && !isnan(out);
 }
 
-static bool str2int(const std::string &s, int64_t &out)
+static bool str2int(std::string_view s, int64_t &out)
 {
+    char buf[64];
+    if (!arg2cstr(s, buf))
+    {
+        return false;
+    }
     char *endp = NULL;
-    out = strtoll(s.c_str(), &endp, 10);
-    return endp == s.c_str() + s.size();
+    out = strtoll(buf, &endp, 10);
+    return endp == buf + s.size();
 }
 
+// how a T_STR value is stored
+enum
+{
+    ENC_INLINE = 0, // right after the key
+    ENC_HEAP = 1,   // in its own allocation, it didn't fit after the key
+    ENC_INT = 2,    // an integer, formatted when it's read
+};
+
+// one allocation per key: this header, the key, then room for a short value.
+// the header is 38 bytes, instead of about 100 with 2 std::string.
 struct Entry
 {
     struct HNode node;
-    std::string key; // name of the zset
-    std::string val;
-    uint32_t type = 0;
-    ZSet *zset = NULL;
+    union
+    {
+        int64_t ival; // ENC_INT
+        char *vptr;   // ENC_HEAP
+        ZSet *zset;   // T_ZSET
+    };
+    uint32_t klen;
+    uint32_t vlen;     // ENC_INLINE and ENC_HEAP
+    uint32_t heap_idx; // the TTL in g_data.heap, or k_heap_none
+    uint8_t type : 4;
+    uint8_t enc : 4;
+    uint8_t vroom; // bytes after the key for an inline value
+    char data[0];  // the key, then the inline value
 };
 
-static bool entry_eq(HNode *lhs, HNode *rhs)
+// a short canonical integer, so it reads back the same
+static bool str2int_exact(std::string_view s, int64_t &out)
+{
+    size_t i = (!s.empty() && s[0] == '-') ? 1 : 0;
+    size_t ndigit = s.size() - i;
+    if (ndigit == 0 || ndigit > 18 || (s[i] == '0' && (ndigit > 1 || i == 1)))
+    {
+        return false;
+    }
+    int64_t v = 0;
+    for (; i < s.size(); i++)
+    {
+        if (s[i] < '0' || s[i] > '9')
+        {
+            return false;
+        }
+        v = v * 10 + (s[i] - '0');
+    }
+    out = s[0] == '-' ? -v : v;
+    return true;
+}
+
+static std::string_view entry_key(Entry *ent)
 {
-    struct Entry *le = my_container_of(lhs, Entry, node);
-    struct Entry *re = my_container_of(rhs, Entry, node);
-    // compare two pointers, check if they point to the same object
-    return le->key == re->key;
+    return std::string_view(ent->data, ent->klen);
 }
-static void entry_del(Entry *ent)
+
+// the string value, an integer is formatted into buf
+static std::string_view entry_val(Entry *ent, char (&buf)[24])
 {
-    switch (ent->type)
+    switch (ent->enc)
     {
-    case T_ZSET:
-        zset_dispose(ent->zset);
-        delete ent->zset;
-        break;
+    case ENC_INT:
+        return std::string_view(buf, snprintf(buf, sizeof(buf), "%lld", (long long)ent->ival));
+    case ENC_HEAP:
+        return std::string_view(ent->vptr, ent->vlen);
+    default:
+        return std::string_view(ent->data + ent->klen, ent->vlen);
     }
-    delete ent;
 }
 
-static void die(const char *msg)
+// a zset with more members than this is freed by the lazyfree thread,
+// for UNLINK, and for everything else (DEL, SET, expiry).
+// freeing 10k members inline takes about 1 ms.
+const size_t k_lazyfree_unlink = 64;
+const size_t k_lazyfree_auto = 10000;
+
+static void zset_free(void *arg)
 {
-    int err = errno;
-    fprintf(stderr, "[%d] %s\n", err, msg);
-    abort();
+    ZSet *zset = (ZSet *)arg;
+    zset_dispose(zset);
+    delete zset;
+}
+
+// the value part of an entry, freed but not reset.
+// a large zset is handed to the lazyfree thread, that's O(1) here.
+static void entry_free_val(Entry *ent, size_t lazy_min)
+{
+    if (ent->type == T_ZSET)
+    {
+        if (zset_size(ent->zset) > lazy_min)
+        {
+            lazyfree_submit(&zset_free, ent->zset);
+        }
+        else
+        {
+            zset_free(ent->zset);
+        }
+    }
+    else if (ent->enc == ENC_HEAP)
+    {
+        free(ent->vptr);
+    }
+}
+
+static void entry_set_val(Entry *ent, std::string_view val)
+{
+    int64_t ival = 0;
+    if (str2int_exact(val, ival))
+    {
+        entry_free_val(ent, k_lazyfree_auto);
+        ent->enc = ENC_INT;
+        ent->ival = ival;
+    }
+    else if (val.size() <= ent->vroom)
+    {
+        entry_free_val(ent, k_lazyfree_auto);
+        ent->enc = ENC_INLINE;
+        memcpy(ent->data + ent->klen, val.data(), val.size());
+    }
+    else
+    {
+        // reuse the old block if there's one
+        char *old = (ent->type == T_STR && ent->enc == ENC_HEAP) ? ent->vptr : NULL;
+        if (!old)
+        {
+            entry_free_val(ent, k_lazyfree_auto);
+        }
+        char *vptr = (char *)realloc(old, val.size());
+        if (!vptr)
+        {
+            die("out of memory");
+        }
+        ent->enc = ENC_HEAP;
+        ent->vptr = vptr;
+        memcpy(ent->vptr, val.data(), val.size());
+    }
+    ent->type = T_STR;
+    ent->vlen = (uint32_t)val.size();
+}
+
+// the longest value stored after the key
+const size_t k_max_inline = 255;
+
+// room for an inline value of vlen bytes, if it's short enough,
+// plus whatever the size class rounds the allocation up by.
+static Entry *entry_new(std::string_view key, uint64_t hcode, uint32_t type, size_t vlen)
+{
+    vlen = vlen <= k_max_inline ? vlen : 0;
+    size_t size = slab_usable(offsetof(Entry, data) + key.size() + vlen);
+    Entry *ent = (Entry *)slab_alloc(size);
+    if (!ent)
+    {
+        die("out of memory");
+    }
+    ent->node.next = NULL;
+    ent->node.hcode = hcode;
+    ent->ival = 0;
+    ent->klen = (uint32_t)key.size();
+    ent->vlen = 0;
+    ent->heap_idx = k_heap_none;
+    ent->type = (uint8_t)type;
+    ent->enc = ENC_INLINE;
+    size_t room = size - offsetof(Entry, data) - key.size();
+    ent->vroom = (uint8_t)(room < k_max_inline ? room : k_max_inline);
+    memcpy(ent->data, key.data(), key.size());
+    return ent;
+}
+
+// a key to look up, it doesn't own the key, so no allocation is needed
+struct LookupKey
+{
+    struct HNode node;
+    std::string_view key;
+};
+
+static void key_init(LookupKey *lk, std::string_view key)
+{
+    lk->key = key;
+    lk->node.hcode = str_hash((uint8_t *)key.data(), key.size());
+}
+
+// node is an Entry in the hashtable, key is a LookupKey
+static bool entry_eq(HNode *node, HNode *key)
+{
+    struct Entry *ent = my_container_of(node, Entry, node);
+    struct LookupKey *lk = my_container_of(key, LookupKey, node);
+    return entry_key(ent) == lk->key;
+}
+
+// set or update the deadline, in ms of the monotonic clock
+static void entry_set_deadline(Entry *ent, uint64_t deadline)
+{
+    if (ent->heap_idx == k_heap_none)
+    {
+        HeapItem item;
+        item.val = deadline;
+        item.ref = &ent->heap_idx;
+        heap_push(g_data.heap, item);
+    }
+    else
+    {
+        g_data.heap[ent->heap_idx].val = deadline;
+        heap_fix(g_data.heap, ent->heap_idx);
+    }
+}
+
+// set or update the TTL, a negative ttl_ms removes it
+static void entry_set_ttl(Entry *ent, int64_t ttl_ms)
+{
+    if (ttl_ms < 0)
+    {
+        if (ent->heap_idx != k_heap_none)
+        {
+            heap_remove(g_data.heap, ent->heap_idx);
+        }
+        return;
+    }
+    entry_set_deadline(ent, get_monotonic_msec() + (uint64_t)ttl_ms);
+}
+
+static bool entry_expired(Entry *ent, uint64_t now_ms)
+{
+    return ent->heap_idx != k_heap_none && g_data.heap[ent->heap_idx].val <= now_ms;
+}
+
+static void entry_del(Entry *ent, size_t lazy_min)
+{
+    entry_set_ttl(ent, -1);
+    entry_free_val(ent, lazy_min);
+    slab_free(ent, offsetof(Entry, data) + ent->klen + ent->vroom);
+}
+
+// look up a key. a key past its deadline is deleted, and not found.
+static Entry *entry_lookup(LookupKey *key)
+{
+    HNode *node = hm_lookup(&g_data.db, &key->node, &entry_eq);
+    if (!node)
+    {
+        return NULL;
+    }
+    Entry *ent = my_container_of(node, Entry, node);
+    if (entry_expired(ent, get_monotonic_msec()))
+    {
+        hm_pop(&g_data.db, &key->node, &entry_eq);
+        entry_del(ent, k_lazyfree_auto);
+        return NULL;
+    }
+    return ent;
+}
+
+// remove the entry from the db and delete it
+static void entry_drop(Entry *ent)
+{
+    LookupKey key;
+    key.key = entry_key(ent);
+    key.node.hcode = ent->node.hcode;
+    HNode *node = hm_pop(&g_data.db, &key.node, &entry_eq);
+    assert(node == &ent->node);
+    (void)node;
+    entry_del(ent, k_lazyfree_auto);
 }
 
 // get sockaddr, IPv4 or IPv6:
@@ -231,7 +726,7 @@ static bool try_flush_buffer(Conn *conn)
     do
     {
         size_t remain_bytes = conn->wbuf_size - conn->wbuf_sent;
-        rv = send(conn->fd, &conn->wbuf[conn->wbuf_sent], remain_bytes, 0);
+        rv = send(conn->fd, &conn->wbuf.data[conn->wbuf_sent], remain_bytes, 0);
     } while (rv < 0 && errno == EINTR);
 
     // if there's nothing to send
@@ -255,6 +750,7 @@ static bool try_flush_buffer(Conn *conn)
     {
         conn->wbuf_sent = 0;
         conn->wbuf_size = 0;
+        buf_release(&conn->wbuf);
         conn->state = STATE_REQ;
         return false;
     }
@@ -268,14 +764,54 @@ static void state_res(Conn *conn)
     }
 }
 
-static bool cmd_is(const std::string &word, const char *cmd)
+// move the unhandled data to the front, once per read instead of once per request,
+// and make room for n more bytes. returns false if out of memory.
+static bool rbuf_prepare(Conn *conn, size_t n)
+{
+    size_t remain_bytes = conn->rbuf_size - conn->rbuf_start;
+    if (conn->rbuf_start > 0 && remain_bytes > 0)
+    {
+        memmove(conn->rbuf.data, &conn->rbuf.data[conn->rbuf_start], remain_bytes);
+    }
+    conn->rbuf_size = remain_bytes;
+    conn->rbuf_start = 0;
+    // a partial request: room for more of it, but no more than what has
+    // arrived of it, or k_rbuf_ahead. a header alone doesn't pin max_msg
+    // bytes, and a big request still takes a few reallocations only.
+    if (remain_bytes >= 4)
+    {
+        uint32_t len = 0;
+        memcpy(&len, conn->rbuf.data, 4);
+        if (len <= g_config.max_msg && 4 + len > remain_bytes + n)
+        {
+            size_t ahead = remain_bytes > k_rbuf_ahead ? remain_bytes : k_rbuf_ahead;
+            size_t left = 4 + len - remain_bytes;
+            n = left < ahead ? left : ahead;
+        }
+    }
+    return buf_reserve(&conn->rbuf, remain_bytes, remain_bytes + n);
+}
+
+// give the read buffer back when everything in it is handled
+static void rbuf_shrink(Conn *conn)
+{
+    if (conn->rbuf_start == conn->rbuf_size)
+    {
+        conn->rbuf_start = conn->rbuf_size = 0;
+        buf_release(&conn->rbuf);
+    }
+}
+
+static bool cmd_is(std::string_view word, const char *cmd)
 {
-    return 0 == strcasecmp(word.c_str(), cmd);
+    return word.size() == strlen(cmd) && 0 == strncasecmp(word.data(), cmd, word.size());
 }
 
-const size_t k_max_args = 1024;
+// room for a variadic ZADD of 1M pairs, k_max_msg bounds the bytes
+const size_t k_max_args = 2 << 20;
 
-static int32_t parse_req(const uint8_t *data, size_t len, std::vector<std::string> &out)
+// the arguments are views into data, they are valid until the request is removed from rbuf
+static int32_t parse_req(const uint8_t *data, size_t len, std::vector<std::string_view> &out)
 {
     // store the number of parameters in n
     uint32_t n = 0;
@@ -298,12 +834,11 @@ static int32_t parse_req(const uint8_t *data, size_t len, std::vector<std::strin
         // get current parameter's length
         uint32_t sz = 0;
         memcpy(&sz, &data[pos], 4);
-        if (pos + sz > len)
+        if (pos + 4 + sz > len)
         {
             return -1;
         }
-        // convert the parameter from chars to a string, then store it in cmd
-        out.push_back(std::string((char *)&data[pos + 4], sz));
+        out.push_back(std::string_view((char *)&data[pos + 4], sz));
         pos += 4 + sz;
     }
     if (pos != len)
@@ -313,172 +848,648 @@ static int32_t parse_req(const uint8_t *data, size_t len, std::vector<std::strin
     return 0;
 }
 
-// HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *))
-static void do_get(const std::vector<std::string> &cmd, std::string &out)
+// a request in the wire format, appended to buf: begin, the arguments, end
+static size_t req_begin(std::string &buf, uint32_t nargs)
 {
-    Entry entry;
-    entry.key = std::move(cmd[1]);
-    entry.node.hcode = str_hash((uint8_t *)entry.key.data(), entry.key.size());
-    // search for the node in the hashmap
-    HNode *node = hm_lookup(&g_data.db, &entry.node, &entry_eq);
-    if (!node)
-    {
-        return out_nil(out);
-    }
+    size_t start = buf.size();
+    buf.append("\0\0\0\0", 4);
+    buf.append((const char *)&nargs, 4);
+    return start;
+}
 
-    // if this node exists, we return its value
-    const std::string &val = my_container_of(node, Entry, node)->val;
+static void req_arg(std::string &buf, std::string_view arg)
+{
+    uint32_t len = (uint32_t)arg.size();
+    buf.append((const char *)&len, 4);
+    buf.append(arg.data(), arg.size());
+}
 
-    out_str(out, val);
+static void req_end(std::string &buf, size_t start)
+{
+    uint32_t len = (uint32_t)(buf.size() - start - 4);
+    memcpy(&buf[start], &len, 4);
 }
 
-static void do_set(std::vector<std::string> &cmd, std::string &out)
+static bool aof_on()
 {
-    Entry entry;
-    entry.key = std::move(cmd[1]);
-    entry.val = std::move(cmd[2]);
-    entry.node.hcode = str_hash((uint8_t *)entry.key.data(), entry.key.size());
+    return g_config.aof_file && !g_data.aof_replaying;
+}
 
-    // search for the node in the hashmap
-    HNode *node = hm_lookup(&g_data.db, &entry.node, &entry_eq);
-    // if not exist
-    if (!node)
+// log a command that changed a key, it's written at the end of the loop iteration
+static void aof_log(const std::string_view *args, size_t n)
+{
+    if (!aof_on())
     {
-        // entry here is just a local variable. If we insert entry, then it will cause dangling pointer.
-        //  Bc h_insert just save a pointer to the HNode, not the data itself
-        // so we use new to create a variable in the heap
-        Entry *new_entry = new Entry(entry);
-        hm_insert(&g_data.db, &new_entry->node);
+        return;
     }
-    // if the key exists, replace its value
-    else
+    size_t start = req_begin(g_data.aof_buf, (uint32_t)n);
+    for (size_t i = 0; i < n; ++i)
     {
-        Entry *existing_entry = my_container_of(node, Entry, node);
-        existing_entry->val = std::move(cmd[2]);
+        req_arg(g_data.aof_buf, args[i]);
     }
-    return out_nil(out);
+    req_end(g_data.aof_buf, start);
 }
 
-static void do_del(const std::vector<std::string> &cmd, std::string &out)
+static void aof_log(std::initializer_list<std::string_view> args)
 {
-    Entry entry;
-    entry.key = std::move(cmd[1]);
-    entry.node.hcode = str_hash((uint8_t *)entry.key.data(), entry.key.size());
-    HNode *node = hm_pop(&g_data.db, &entry.node, &entry_eq);
-    if (node)
-    {
-        delete my_container_of(node, Entry, node);
-    }
-    return out_int(out, node ? 1 : 0);
+    aof_log(args.begin(), args.size());
 }
 
-// zadd zset score name
-static void do_zadd(std::vector<std::string> &cmd, std::string &out)
+// a TTL is logged as its deadline, it goes on while the server is down.
+// one too far out for a wall clock deadline never runs out, it's a PERSIST.
+static void aof_log_deadline(std::string_view key, uint64_t deadline)
 {
-    double score = 0;
-    if (!str2dbl(cmd[2], score))
+    if (!aof_on())
     {
-        return out_err(out, ERR_ARG, "expect fp number");
+        return;
     }
-    // 打印 cmd[2] 和转换后的 score
-    // lookup or create the zset
-    Entry entry;
-    entry.key.swap(cmd[1]);
-    entry.node.hcode = str_hash((uint8_t *)entry.key.data(), entry.key.size());
-    HNode *hnode = hm_lookup(&g_data.db, &entry.node, &entry_eq);
-    Entry *ent = NULL;
-    if (!hnode)
+    int64_t wall_ms = wall_deadline(deadline, get_monotonic_msec(), get_wall_msec());
+    if (wall_ms == 0)
     {
-        printf("we don't have that zset\n");
-        // if we don't have that zset
-        ent = new Entry();
-        ent->key.swap(entry.key);
-        ent->node.hcode = entry.node.hcode;
-        ent->type = T_ZSET;
-        ent->zset = new ZSet();
-        printf("created a new entry, then insert its HNode to global data\n");
-        hm_insert(&g_data.db, &ent->node);
+        return aof_log({"persist", key});
+    }
+    std::string ms = std::to_string(wall_ms);
+    aof_log({"pexpireat", key, ms});
+}
+
+// the most pairs in a ZADD of the log, replay parses it like a request
+const size_t k_aof_zadd_pairs = (k_max_args - 2) / 2;
+
+// the commands that make a key what it is: a SET or ZADDs, and its deadline
+// in ms of the wall clock, if it has one
+static void aof_dump_entry(std::string &buf, Entry *ent, int64_t deadline_ms)
+{
+    std::string_view key = entry_key(ent);
+    if (ent->type == T_STR)
+    {
+        char tmp[24];
+        size_t start = req_begin(buf, 3);
+        req_arg(buf, "set");
+        req_arg(buf, key);
+        req_arg(buf, entry_val(ent, tmp));
+        req_end(buf, start);
     }
     else
     {
-        ent = my_container_of(hnode, Entry, node);
-        if (ent->type != T_ZSET)
+        ZSet *zset = ent->zset;
+        size_t left = zset_size(zset);
+        ZIter it = zset_at(zset, 0);
+        while (left > 0)
         {
-            return out_err(out, ERR_TYPE, "expect zset");
+            size_t n = left < k_aof_zadd_pairs ? left : k_aof_zadd_pairs;
+            size_t start = req_begin(buf, (uint32_t)(2 + 2 * n));
+            req_arg(buf, "zadd");
+            req_arg(buf, key);
+            for (size_t i = 0; i < n; ++i, zset_offset(zset, &it, +1))
+            {
+                char score[32];
+                int len = snprintf(score, sizeof(score), "%.17g", it.score);
+                req_arg(buf, std::string_view(score, (size_t)len));
+                req_arg(buf, std::string_view(it.name, it.len));
+            }
+            req_end(buf, start);
+            left -= n;
         }
     }
-    // add or update the tuple  to the zset
-    const std::string &name = cmd[3];
-    bool added = zset_add(ent->zset, name.data(), name.size(), score);
-    return out_int(out, (int64_t)added);
+    if (deadline_ms)
+    {
+        std::string ms = std::to_string(deadline_ms);
+        size_t start = req_begin(buf, 3);
+        req_arg(buf, "pexpireat");
+        req_arg(buf, key);
+        req_arg(buf, ms);
+        req_end(buf, start);
+    }
 }
 
-/**
- * @brief Iterates through all buckets and nodes in the given hash table and applies
- *        a callback function to each node.
- *
- * @param tab Pointer to the hash table (HTab *) to be scanned.
- * @param f Callback function to be called for each node. The callback takes
- *          two arguments: the node (HNode *) and a user-provided argument (void *).
- * @param arg A user-provided argument passed to the callback function for custom use.
- */
-static void h_scan(HTab *tab, void (*f)(HNode *, void *), void *arg)
+// the keys are written out in batches of this many bytes
+const size_t k_aof_dump_batch = 4 << 20;
+
+struct AofDumpCtx
+{
+    std::string buf;
+    std::vector<HeapItem> *heap = NULL;
+    uint64_t now_ms = 0;
+    int64_t wall_ms = 0;
+    uint64_t keys = 0;
+    // the rewrite child writes to its file, -1 for the log itself
+    int fd = -1;
+    bool failed = false;
+};
+
+static void aof_dump_write(AofDumpCtx *ctx)
 {
-    if (tab->size == 0)
+    if (ctx->fd < 0)
     {
-        return;
+        if (!ctx->buf.empty() && !aof_write(ctx->buf.data(), ctx->buf.size()))
+        {
+            die("aof_write");
+        }
+    }
+    else if (!ctx->failed)
+    {
+        ctx->failed = !aof_write_all(ctx->fd, ctx->buf.data(), ctx->buf.size());
     }
-    for (size_t i = 0; i < tab->mask + 1; ++i)
+    ctx->buf.clear();
+}
+
+static void cb_aof_dump(HNode *node, void *arg)
+{
+    AofDumpCtx *ctx = (AofDumpCtx *)arg;
+    Entry *ent = my_container_of(node, Entry, node);
+    int64_t deadline_ms = 0;
+    if (ent->heap_idx != k_heap_none)
     {
-        HNode *node = tab->tab[i];
-        while (node)
+        uint64_t val = (*ctx->heap)[ent->heap_idx].val;
+        if (val <= ctx->now_ms)
         {
-            f(node, arg);
-            node = node->next;
+            return;
         }
+        deadline_ms = wall_deadline(val, ctx->now_ms, ctx->wall_ms);
+    }
+    aof_dump_entry(ctx->buf, ent, deadline_ms);
+    ctx->keys++;
+    if (ctx->buf.size() >= k_aof_dump_batch)
+    {
+        aof_dump_write(ctx);
     }
 }
 
+// HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *))
+static void do_get(std::vector<std::string_view> &cmd, Out &out)
+{
+    LookupKey key;
+    key_init(&key, cmd[1]);
+    // search for the node in the hashmap
+    Entry *ent = entry_lookup(&key);
+    if (!ent)
+    {
+        return out_nil(out);
+    }
+
+    // if this node exists, we return its value
+    if (ent->type != T_STR)
+    {
+        return out_err(out, ERR_TYPE, "expect string");
+    }
+    char buf[24];
+    out_str(out, entry_val(ent, buf));
+}
+
+// set key val [px ms | ex s]
+static void do_set(std::vector<std::string_view> &cmd, Out &out)
+{
+    // without an expiry, a key loses its TTL
+    int64_t ttl_ms = -1;
+    if (cmd.size() == 5)
+    {
+        int64_t n = 0;
+        if (!str2int(cmd[4], n) || n <= 0 || n > INT64_MAX / 1000)
+        {
+            return out_err(out, ERR_ARG, "expect positive integer");
+        }
+        if (cmd_is(cmd[3], "px"))
+        {
+            ttl_ms = n;
+        }
+        else if (cmd_is(cmd[3], "ex"))
+        {
+            ttl_ms = n * 1000;
+        }
+        else
+        {
+            return out_err(out, ERR_ARG, "expect px or ex");
+        }
+    }
+
+    LookupKey key;
+    key_init(&key, cmd[1]);
+
+    // search for the node in the hashmap
+    Entry *ent = entry_lookup(&key);
+    // if not exist
+    if (!ent)
+    {
+        // the key and the value are copied only here, when they are stored
+        int64_t ival = 0;
+        size_t vlen = str2int_exact(cmd[2], ival) ? 0 : cmd[2].size();
+        ent = entry_new(cmd[1], key.node.hcode, T_STR, vlen);
+        entry_set_val(ent, cmd[2]);
+        hm_insert(&g_data.db, &ent->node);
+    }
+    // if the key exists, replace its value, whatever its type was
+    else
+    {
+        entry_set_val(ent, cmd[2]);
+    }
+    entry_set_ttl(ent, ttl_ms);
+    aof_log({"set", cmd[1], cmd[2]});
+    if (ttl_ms >= 0)
+    {
+        aof_log_deadline(cmd[1], g_data.heap[ent->heap_idx].val);
+    }
+    return out_nil(out);
+}
+
+// DEL and UNLINK only differ by the size of a value freed in the background
+static void del_key(std::vector<std::string_view> &cmd, Out &out, size_t lazy_min)
+{
+    LookupKey key;
+    key_init(&key, cmd[1]);
+    HNode *node = hm_pop(&g_data.db, &key.node, &entry_eq);
+    if (!node)
+    {
+        return out_int(out, 0);
+    }
+    Entry *ent = my_container_of(node, Entry, node);
+    bool expired = entry_expired(ent, get_monotonic_msec());
+    entry_del(ent, lazy_min);
+    aof_log({"del", cmd[1]});
+    return out_int(out, expired ? 0 : 1);
+}
+
+static void do_del(std::vector<std::string_view> &cmd, Out &out)
+{
+    del_key(cmd, out, k_lazyfree_auto);
+}
+
+// unlink key: like del, but even a small zset is freed in the background
+static void do_unlink(std::vector<std::string_view> &cmd, Out &out)
+{
+    del_key(cmd, out, k_lazyfree_unlink);
+}
+
+// pexpire key ms
+static void do_pexpire(std::vector<std::string_view> &cmd, Out &out)
+{
+    int64_t ttl_ms = 0;
+    if (!str2int(cmd[2], ttl_ms))
+    {
+        return out_err(out, ERR_ARG, "expect int64");
+    }
+    // like SET's, or the deadline wraps around
+    if (ttl_ms > INT64_MAX / 1000)
+    {
+        return out_err(out, ERR_ARG, "ttl out of range");
+    }
+    LookupKey key;
+    key_init(&key, cmd[1]);
+    Entry *ent = entry_lookup(&key);
+    if (!ent)
+    {
+        return out_int(out, 0);
+    }
+    if (ttl_ms <= 0)
+    {
+        // already expired
+        entry_drop(ent);
+        aof_log({"del", cmd[1]});
+    }
+    else
+    {
+        entry_set_ttl(ent, ttl_ms);
+        aof_log_deadline(cmd[1], g_data.heap[ent->heap_idx].val);
+    }
+    return out_int(out, 1);
+}
+
+// pexpireat key ms: the deadline in ms of the wall clock, since the epoch
+static void do_pexpireat(std::vector<std::string_view> &cmd, Out &out)
+{
+    int64_t deadline_ms = 0;
+    if (!str2int(cmd[2], deadline_ms))
+    {
+        return out_err(out, ERR_ARG, "expect int64");
+    }
+    // checked before subtracting, which can't overflow then
+    int64_t now_ms = get_wall_msec();
+    if (deadline_ms > now_ms && deadline_ms - now_ms > INT64_MAX / 1000)
+    {
+        return out_err(out, ERR_ARG, "ttl out of range");
+    }
+    LookupKey key;
+    key_init(&key, cmd[1]);
+    Entry *ent = entry_lookup(&key);
+    if (!ent)
+    {
+        return out_int(out, 0);
+    }
+    if (deadline_ms <= now_ms)
+    {
+        entry_drop(ent);
+        aof_log({"del", cmd[1]});
+    }
+    else
+    {
+        entry_set_ttl(ent, deadline_ms - now_ms);
+        aof_log({"pexpireat", cmd[1], cmd[2]});
+    }
+    return out_int(out, 1);
+}
+
+// pttl key: the ms left, -1 without a TTL, -2 if there's no such key
+static void do_pttl(std::vector<std::string_view> &cmd, Out &out)
+{
+    LookupKey key;
+    key_init(&key, cmd[1]);
+    Entry *ent = entry_lookup(&key);
+    if (!ent)
+    {
+        return out_int(out, -2);
+    }
+    if (ent->heap_idx == k_heap_none)
+    {
+        return out_int(out, -1);
+    }
+    uint64_t deadline = g_data.heap[ent->heap_idx].val;
+    uint64_t now_ms = get_monotonic_msec();
+    return out_int(out, deadline > now_ms ? (int64_t)(deadline - now_ms) : 0);
+}
+
+// persist key: remove the TTL
+static void do_persist(std::vector<std::string_view> &cmd, Out &out)
+{
+    LookupKey key;
+    key_init(&key, cmd[1]);
+    Entry *ent = entry_lookup(&key);
+    if (!ent || ent->heap_idx == k_heap_none)
+    {
+        return out_int(out, 0);
+    }
+    entry_set_ttl(ent, -1);
+    aof_log({"persist", cmd[1]});
+    return out_int(out, 1);
+}
+
+// zadd zset score name [score name ...]
+// nothing is added if a score doesn't parse
+static void do_zadd(std::vector<std::string_view> &cmd, Out &out)
+{
+    // no allocation for the common single pair
+    size_t n = (cmd.size() - 2) / 2;
+    ZTuple one;
+    std::vector<ZTuple> many(n > 1 ? n : 0);
+    ZTuple *tuples = n > 1 ? many.data() : &one;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (!str2dbl(cmd[2 + 2 * i], tuples[i].score))
+        {
+            return out_err(out, ERR_ARG, "expect fp number");
+        }
+        tuples[i].name = cmd[3 + 2 * i].data();
+        tuples[i].len = cmd[3 + 2 * i].size();
+    }
+    // lookup or create the zset
+    LookupKey key;
+    key_init(&key, cmd[1]);
+    Entry *ent = entry_lookup(&key);
+    if (!ent)
+    {
+        // if we don't have that zset
+        ent = entry_new(cmd[1], key.node.hcode, T_ZSET, 0);
+        ent->zset = new ZSet();
+        log_debug("zadd: created the zset %.*s", (int)cmd[1].size(), cmd[1].data());
+        hm_insert(&g_data.db, &ent->node);
+    }
+    else if (ent->type != T_ZSET)
+    {
+        return out_err(out, ERR_TYPE, "expect zset");
+    }
+    // add or update the tuples in the zset
+    size_t added = zset_add_many(ent->zset, tuples, n);
+    aof_log(cmd.data(), cmd.size());
+    return out_int(out, (int64_t)added);
+}
+
+// the state of a KEYS over the db
+struct KeysScan
+{
+    Out *out = NULL;
+    uint32_t n = 0;      // keys written so far
+    uint64_t now_ms = 0; // a key past it is skipped
+};
+
 /**
  * @brief Callback function used during hash table scanning to extract and process
- *        keys from hash table nodes. It appends the key from each node to the provided string.
+ *        keys from hash table nodes. It writes the key of each live entry to the
+ *        scan's output and counts it.
  *
  * @param node Pointer to the current hash table node (HNode *) being processed.
- * @param arg A pointer to a `std::string` (passed as void *) where the keys will be appended.
+ * @param arg A pointer to the `KeysScan` (passed as void *): the `Out` the keys are
+ *            written to, the count of keys written, and the time expired keys are skipped at.
  */
 static void cb_scan(HNode *node, void *arg)
 {
-    std::string &out = *(std::string *)arg;
-    out_str(out, my_container_of(node, Entry, node)->key);
+    KeysScan *scan = (KeysScan *)arg;
+    Entry *ent = my_container_of(node, Entry, node);
+    // expired, but not deleted yet
+    if (entry_expired(ent, scan->now_ms))
+    {
+        return;
+    }
+    out_str(*scan->out, entry_key(ent));
+    scan->n++;
 }
 
 /**
- * @brief Gathers all keys from the global database's hash tables and appends them
- *        to the provided output string as an array.
+ * @brief Gathers all keys from the global database's hash tables and writes them
+ *        to the response as an array.
  *
  * @param cmd Unused vector of strings, typically representing input commands.
- * @param out Reference to a `std::string` where the array of keys will be written.
+ * @param out The response (`Out`) the array of keys is serialized into.
  */
-static void do_keys(std::vector<std::string> cmd, std::string &out)
+static void do_keys(std::vector<std::string_view> &cmd, Out &out)
+{
+    KeysScan scan;
+    scan.out = &out;
+    scan.now_ms = get_monotonic_msec();
+    void *arr = begin_arr(out);
+    hm_foreach(&g_data.db, &cb_scan, &scan);
+    end_arr(out, arr, scan.n);
+}
+
+// match a glob pattern: * any string, ? any byte, [abc] [a-z] [^a] a set,
+// \ quotes the next byte
+static bool glob_match(std::string_view pat, std::string_view s)
+{
+    size_t p = 0, i = 0;
+    // where to retry from after the last *
+    size_t star = std::string_view::npos, star_i = 0;
+    while (i < s.size())
+    {
+        if (p < pat.size() && pat[p] == '*')
+        {
+            star = p++;
+            star_i = i;
+            continue;
+        }
+        if (p < pat.size() && pat[p] == '[')
+        {
+            size_t q = p + 1;
+            bool neg = q < pat.size() && pat[q] == '^';
+            q += neg;
+            bool hit = false;
+            for (bool first = true; q < pat.size() && (first || pat[q] != ']'); first = false)
+            {
+                if (pat[q] == '\\' && q + 1 < pat.size())
+                {
+                    q++;
+                }
+                uint8_t lo = (uint8_t)pat[q], hi = lo;
+                if (q + 2 < pat.size() && pat[q + 1] == '-' && pat[q + 2] != ']')
+                {
+                    hi = (uint8_t)pat[q + 2];
+                    q += 2;
+                }
+                hit = hit || (lo <= (uint8_t)s[i] && (uint8_t)s[i] <= hi);
+                q++;
+            }
+            if (q < pat.size() && hit != neg)
+            {
+                p = q + 1;
+                i++;
+                continue;
+            }
+        }
+        else if (p < pat.size())
+        {
+            bool any = pat[p] == '?';
+            size_t q = pat[p] == '\\' && p + 1 < pat.size() ? p + 1 : p;
+            if (any || pat[q] == s[i])
+            {
+                p = q + 1;
+                i++;
+                continue;
+            }
+        }
+        // mismatch, let the last * take one more byte
+        if (star == std::string_view::npos)
+        {
+            return false;
+        }
+        p = star + 1;
+        i = ++star_i;
+    }
+    while (p < pat.size() && pat[p] == '*')
+    {
+        p++;
+    }
+    return p == pat.size();
+}
+
+// the cursor of SCAN is the cursor of hm_scan() in the shard, then the shard
+// in the low 8 bits. the shards are scanned one after another.
+const uint32_t k_scan_shard_bits = 8;
+const int64_t k_scan_count = 10;
+
+struct ScanArgs
+{
+    KeysScan keys;
+    std::string_view pattern;
+    bool match = false;
+    // the keys looked at, matching or not
+    int64_t seen = 0;
+};
+
+static void cb_scan_match(HNode *node, void *arg)
+{
+    ScanArgs *scan = (ScanArgs *)arg;
+    scan->seen++;
+    Entry *ent = my_container_of(node, Entry, node);
+    if (scan->match && !glob_match(scan->pattern, entry_key(ent)))
+    {
+        return;
+    }
+    cb_scan(node, &scan->keys);
+}
+
+// the shard of a SCAN cursor, false if it's not one
+static bool scan_cursor(std::string_view s, uint64_t &cursor, uint32_t &shard)
+{
+    int64_t val = 0;
+    if (!str2int(s, val))
+    {
+        return false;
+    }
+    cursor = (uint64_t)val;
+    shard = (uint32_t)(cursor & ((1u << k_scan_shard_bits) - 1));
+    return shard < g_config.shards;
+}
+
+// scan cursor [match pattern] [count n]
+// a slice of the keyspace, and the cursor to go on from, 0 at the end.
+// the keys there from the first call to the last are all returned, some
+// maybe more than once. it looks at about count keys and count * 10
+// buckets, however few keys match, so a call is short with a big keyspace.
+static void do_scan(std::vector<std::string_view> &cmd, Out &out)
 {
-    out_arr(out, (uint32_t)hm_size(&g_data.db));
-    h_scan(&g_data.db.ht1, &cb_scan, &out);
-    h_scan(&g_data.db.ht2, &cb_scan, &out);
+    ScanArgs scan;
+    int64_t count = k_scan_count;
+    for (size_t i = 2; i < cmd.size(); i += 2)
+    {
+        if (cmd_is(cmd[i], "match") && i + 1 < cmd.size())
+        {
+            scan.pattern = cmd[i + 1];
+            scan.match = true;
+        }
+        else if (cmd_is(cmd[i], "count") && i + 1 < cmd.size())
+        {
+            if (!str2int(cmd[i + 1], count) || count <= 0)
+            {
+                return out_err(out, ERR_ARG, "expect positive integer");
+            }
+        }
+        else
+        {
+            return out_err(out, ERR_ARG, "expect match or count");
+        }
+    }
+    uint64_t cursor = 0;
+    uint32_t shard = 0;
+    if (!scan_cursor(cmd[1], cursor, shard))
+    {
+        return out_err(out, ERR_ARG, "invalid cursor");
+    }
+    assert(shard == g_data.shard->id);
+    cursor >>= k_scan_shard_bits;
+
+    out_arr(out, 2);
+    // the next cursor goes first, saved room for it
+    size_t cursor_pos = out.pos;
+    out_int(out, 0);
+    scan.keys.out = &out;
+    scan.keys.now_ms = get_monotonic_msec();
+    void *arr = begin_arr(out);
+    int64_t buckets = count * 10;
+    do
+    {
+        cursor = hm_scan(&g_data.db, cursor, &cb_scan_match, &scan);
+    } while (cursor != 0 && scan.seen < count && --buckets > 0);
+    end_arr(out, arr, scan.keys.n);
+
+    uint64_t next = cursor << k_scan_shard_bits | shard;
+    if (cursor == 0)
+    {
+        // this shard is done, start on the next one
+        next = shard + 1 < g_config.shards ? shard + 1 : 0;
+    }
+    if (!out.failed)
+    {
+        memcpy(&out.buf->data[cursor_pos + 1], &next, 8);
+    }
 }
 
 // return true if ent is of type ZSet and has name s
-static bool expect_zset(std::string &out, std::string &s, Entry **ent)
+static bool expect_zset(Out &out, std::string_view s, Entry **ent)
 {
-    Entry entry;
-    entry.key.swap(s);
-    entry.node.hcode = str_hash((uint8_t *)entry.key.data(), entry.key.size());
-    HNode *hnode = hm_lookup(&g_data.db, &entry.node, &entry_eq);
-    if (!hnode)
+    LookupKey key;
+    key_init(&key, s);
+    *ent = entry_lookup(&key);
+    if (!*ent)
     {
         out_nil(out);
         return false;
     }
-    *ent = my_container_of(hnode, Entry, node);
     if ((*ent)->type != T_ZSET)
     {
         out_err(out, ERR_TYPE, "expect zset");
@@ -489,7 +1500,7 @@ static bool expect_zset(std::string &out, std::string &s, Entry **ent)
 
 // zrem zset name
 // remove a tuple from the zset
-static void do_zrem(std::vector<std::string> &cmd, std::string &out)
+static void do_zrem(std::vector<std::string_view> &cmd, Out &out)
 {
     Entry *ent = NULL;
     // get the set that has the name we specified
@@ -497,18 +1508,23 @@ static void do_zrem(std::vector<std::string> &cmd, std::string &out)
     {
         return;
     }
-    const std::string &name = cmd[2];
-    // pop the tuple from the set
-    ZNode *znode = zset_pop(ent->zset, name.data(), name.size());
-    if (znode)
+    std::string_view name = cmd[2];
+    // remove the tuple from the set
+    bool removed = zset_rem(ent->zset, name.data(), name.size());
+    if (removed)
+    {
+        aof_log(cmd.data(), cmd.size());
+    }
+    if (removed && zset_size(ent->zset) == 0)
     {
-        znode_del(znode);
+        // an empty zset would be lost by a rewrite of the log, it's gone now
+        entry_drop(ent);
     }
-    return out_int(out, znode ? 1 : 0);
+    return out_int(out, removed ? 1 : 0);
 }
 
 // zscore zset name
-static void do_zscore(std::vector<std::string> &cmd, std::string &out)
+static void do_zscore(std::vector<std::string_view> &cmd, Out &out)
 {
     Entry *ent = NULL;
     // get the set that has the name we specified
@@ -516,25 +1532,14 @@ static void do_zscore(std::vector<std::string> &cmd, std::string &out)
     {
         return;
     }
-    const std::string &name = cmd[2];
-    ZNode *znode = zset_lookup(ent->zset, name.data(), name.size());
-    return znode ? out_dbl(out, znode->score) : out_nil(out);
+    std::string_view name = cmd[2];
+    double score = 0;
+    bool found = zset_score(ent->zset, name.data(), name.size(), &score);
+    return found ? out_dbl(out, score) : out_nil(out);
 }
 
-static void *begin_arr(std::string &out)
-{
-    out.push_back(SER_ARR);
-    out.append("\0\0\0\0", 4);       // 预留4个字节用于稍后填充数组长度
-    return (void *)(out.size() - 4); // 返回指向预留位置的指针（或偏移量）
-}
-static void end_arr(std::string &out, void *ctx, uint32_t n)
-{
-    size_t pos = (size_t)ctx;
-    assert(out[pos - 1] == SER_ARR);
-    memcpy(&out[pos], &n, 4);
-}
 // zquery zset score name offset limit
-static void do_zquery(std::vector<std::string> &cmd, std::string &out)
+static void do_zquery(std::vector<std::string_view> &cmd, Out &out)
 {
     // 1. parse args
     double score = 0;
@@ -542,7 +1547,7 @@ static void do_zquery(std::vector<std::string> &cmd, std::string &out)
     {
         return out_err(out, ERR_ARG, "expect fp number");
     }
-    const std::string &name = cmd[3];
+    std::string_view name = cmd[3];
     int64_t limit = 0;
     int64_t offset = 0;
     if (!str2int(cmd[4], offset))
@@ -556,15 +1561,16 @@ static void do_zquery(std::vector<std::string> &cmd, std::string &out)
 
     // 2. get the zset
     Entry *ent = NULL;
+    size_t start = out.pos;
     // get the set that has the name we specified
     // why we need to pass a type **Entry? If we pass *Entry, we're passing the address of that struct.
     // It that case, inside function expect_zset, "ent = my_container_of(hnode, Entry, node);" this step will return a pointer to the Entry we want.
     // but it will only change the value of formal parameter ent.
     if (!expect_zset(out, cmd[1], &ent))
     {
-        if (out[0] == SER_NIL)
+        if (!out.failed && out.buf->data[start] == SER_NIL)
         {
-            out.clear();
+            out.pos = start;
             out_arr(out, 0);
         }
         return;
@@ -575,286 +1581,2434 @@ static void do_zquery(std::vector<std::string> &cmd, std::string &out)
     {
         return out_arr(out, 0);
     }
-    // ZNode *zset_query(ZSet *zset, double score, const char *name, size_t len)
-    ZNode *znode = zset_query(ent->zset, score, name.data(), name.size());
-    znode = znode_offset(znode, offset);
+    ZIter it = zset_query(ent->zset, score, name.data(), name.size());
+    zset_offset(ent->zset, &it, offset);
 
     // output
     void *arr = begin_arr(out);
     uint32_t n = 0;
-    while (znode && (int64_t)n < limit)
+    while (it.valid && (int64_t)n < limit)
     {
-        out_str(out, znode->name, znode->len);
-        out_dbl(out, znode->score);
-        znode = znode_offset(znode, +1);
+        out_str(out, it.name, it.len);
+        out_dbl(out, it.score);
+        zset_offset(ent->zset, &it, +1);
         n += 2;
     }
     end_arr(out, arr, n);
 }
-static void do_request(std::vector<std::string> &cmd, std::string &out)
+
+// zrank zset name, zrevrank zset name
+static void do_zrank(std::vector<std::string_view> &cmd, Out &out, bool rev)
 {
-    if (cmd.size() == 1 && cmd_is(cmd[0], "keys"))
+    Entry *ent = NULL;
+    if (!expect_zset(out, cmd[1], &ent))
     {
-        do_keys(cmd, out);
+        return;
     }
-    else if (cmd.size() == 2 && cmd_is(cmd[0], "get"))
+    std::string_view name = cmd[2];
+    int64_t rank = zset_rank(ent->zset, name.data(), name.size());
+    if (rank < 0)
     {
-        do_get(cmd, out);
+        return out_nil(out);
     }
-    else if (cmd.size() == 3 && cmd_is(cmd[0], "set"))
+    return out_int(out, rev ? (int64_t)zset_size(ent->zset) - 1 - rank : rank);
+}
+
+// a score bound: a number, "inf", "-inf", or "(" then one of them to exclude it
+static bool str2bound(std::string_view s, double &score, bool &excl)
+{
+    excl = !s.empty() && s[0] == '(';
+    if (excl)
     {
-        do_set(cmd, out);
+        s.remove_prefix(1);
     }
-    else if (cmd.size() == 2 && cmd_is(cmd[0], "del"))
+    return str2dbl(s, score);
+}
+
+// the ranks [lo, hi) of the tuples with min <= score <= max
+static bool score_range(Out &out, ZSet *zset, std::string_view min, std::string_view max, int64_t &lo, int64_t &hi)
+{
+    double smin = 0, smax = 0;
+    bool min_excl = false, max_excl = false;
+    if (!str2bound(min, smin, min_excl) || !str2bound(max, smax, max_excl))
     {
-        do_del(cmd, out);
+        out_err(out, ERR_ARG, "expect fp number");
+        return false;
     }
-    else if (cmd.size() == 4 && cmd_is(cmd[0], "zadd"))
+    lo = zset_count_below(zset, smin, min_excl);
+    hi = zset_count_below(zset, smax, !max_excl);
+    hi = hi < lo ? lo : hi;
+    return true;
+}
+
+// zcount zset min max
+static void do_zcount(std::vector<std::string_view> &cmd, Out &out)
+{
+    LookupKey key;
+    key_init(&key, cmd[1]);
+    Entry *ent = entry_lookup(&key);
+    if (ent && ent->type != T_ZSET)
     {
-        do_zadd(cmd, out);
+        return out_err(out, ERR_TYPE, "expect zset");
     }
-    else if (cmd.size() == 3 && cmd_is(cmd[0], "zrem"))
+    // the bounds are checked even without the zset
+    ZSet empty;
+    int64_t lo = 0, hi = 0;
+    if (!score_range(out, ent ? ent->zset : &empty, cmd[2], cmd[3], lo, hi))
     {
-        do_zrem(cmd, out);
+        return;
     }
-    else if (cmd.size() == 3 && cmd_is(cmd[0], "zscore"))
+    return out_int(out, hi - lo);
+}
+
+// zrangebyscore zset min max [withscores] [limit offset count]
+// zrevrangebyscore zset max min [withscores] [limit offset count]
+static void do_zrangebyscore(std::vector<std::string_view> &cmd, Out &out, bool rev)
+{
+    bool withscores = false;
+    int64_t offset = 0;
+    int64_t count = -1; // no limit
+    for (size_t i = 4; i < cmd.size(); i++)
     {
-        do_zscore(cmd, out);
+        if (cmd_is(cmd[i], "withscores"))
+        {
+            withscores = true;
+        }
+        else if (cmd_is(cmd[i], "limit") && i + 2 < cmd.size())
+        {
+            if (!str2int(cmd[i + 1], offset) || !str2int(cmd[i + 2], count) || offset < 0)
+            {
+                return out_err(out, ERR_ARG, "expect int");
+            }
+            i += 2;
+        }
+        else
+        {
+            return out_err(out, ERR_ARG, "expect withscores or limit");
+        }
     }
-    else if (cmd.size() == 6 && cmd_is(cmd[0], "zquery"))
+    LookupKey key;
+    key_init(&key, cmd[1]);
+    Entry *ent = entry_lookup(&key);
+    if (ent && ent->type != T_ZSET)
     {
-        do_zquery(cmd, out);
+        return out_err(out, ERR_TYPE, "expect zset");
     }
-    else
+    ZSet empty;
+    ZSet *zset = ent ? ent->zset : &empty;
+    int64_t lo = 0, hi = 0;
+    if (!score_range(out, zset, rev ? cmd[3] : cmd[2], rev ? cmd[2] : cmd[3], lo, hi))
     {
-        // cmd is not recognized
-        out_err(out, ERR_UNKNOWN, "Unknown cmd");
+        return;
+    }
+    // the ranks to output, from the start in the order of the output.
+    // the offset is clamped first, the user's can be anything up to INT64_MAX.
+    int64_t width = hi > lo ? hi - lo : 0;
+    offset = offset < width ? offset : width;
+    int64_t n = width - offset;
+    n = count >= 0 && count < n ? count : n;
+    ZIter it = zset_at(zset, rev ? hi - 1 - offset : lo + offset);
+    out_arr(out, (uint32_t)(withscores ? 2 * n : n));
+    for (int64_t i = 0; i < n; i++)
+    {
+        out_str(out, it.name, it.len);
+        if (withscores)
+        {
+            out_dbl(out, it.score);
+        }
+        zset_offset(zset, &it, rev ? -1 : +1);
     }
 }
 
-// pipeline. There may be more than one request in the read buffer
-// This function takes one request from the read buffer, generates a response, then transits to the STATE_RES state.
-static bool try_one_request(Conn *conn)
+// zremrangebyscore zset min max
+// the range is found by 2 rank lookups, then removed by zset_rem_range().
+// a zset left empty is deleted, like it never had a member.
+static void do_zremrangebyscore(std::vector<std::string_view> &cmd, Out &out)
 {
-    // if not enough data
-    if (conn->rbuf_size < 4)
+    LookupKey key;
+    key_init(&key, cmd[1]);
+    Entry *ent = entry_lookup(&key);
+    if (ent && ent->type != T_ZSET)
     {
-        return false;
+        return out_err(out, ERR_TYPE, "expect zset");
     }
-    // get the first request's length
-    u_int32_t len;
-    memcpy(&len, &conn->rbuf[0], 4);
-    // if too long
-    if (len > k_max_msg)
+    // the bounds are checked even without the zset
+    ZSet empty;
+    ZSet *zset = ent ? ent->zset : &empty;
+    int64_t lo = 0, hi = 0;
+    if (!score_range(out, zset, cmd[2], cmd[3], lo, hi))
     {
-        msg("message too long.");
-        conn->state = STATE_END;
-        return false;
+        return;
     }
-    std::vector<std::string> cmd;
-    if (0 != parse_req(&conn->rbuf[4], len, cmd))
+    if (!ent || lo == hi)
     {
-        msg("bad req");
+        return out_int(out, 0);
+    }
+    if (lo == 0 && hi == (int64_t)zset_size(zset))
+    {
+        // all of it, a big one is freed by the lazyfree thread
+        entry_drop(ent);
+        aof_log({"del", cmd[1]});
+        return out_int(out, hi);
+    }
+    size_t removed = zset_rem_range(zset, lo, hi);
+    if (zset_size(zset) == 0)
+    {
+        entry_drop(ent);
+        aof_log({"del", cmd[1]});
+    }
+    else if (removed)
+    {
+        aof_log(cmd.data(), cmd.size());
+    }
+    return out_int(out, (int64_t)removed);
+}
+
+static void out_stat(Out &out, const char *name, int64_t val)
+{
+    out_str(out, name);
+    out_int(out, val);
+}
+
+// the allocator's numbers, for all shards, and the process's memory
+static void do_memstats(std::vector<std::string_view> &, Out &out)
+{
+    SlabStats st;
+    slab_stats(&st);
+    rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    long size_pages = 0, rss_pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f)
+    {
+        if (fscanf(f, "%ld %ld", &size_pages, &rss_pages) != 2)
+        {
+            rss_pages = 0;
+        }
+        fclose(f);
+    }
+
+    out_arr(out, 18);
+    out_stat(out, "live_objects", (int64_t)st.live_objs);
+    out_stat(out, "live_bytes", (int64_t)st.live_bytes);
+    out_stat(out, "page_bytes", (int64_t)st.page_bytes);
+    out_str(out, "fragmentation");
+    out_dbl(out, st.page_bytes ? 1.0 - (double)st.live_bytes / st.page_bytes : 0);
+    out_stat(out, "large_objects", (int64_t)st.large_objs);
+    out_stat(out, "large_bytes", (int64_t)st.large_bytes);
+    out_stat(out, "rss_bytes", (int64_t)rss_pages * sysconf(_SC_PAGESIZE));
+    out_stat(out, "minor_faults", (int64_t)ru.ru_minflt);
+    out_stat(out, "lazyfree_pending", (int64_t)lazyfree_pending());
+}
+
+// every shard's keys, for the forked children, which see all of them
+struct ShardDb
+{
+    HMap *db = NULL;
+    std::vector<HeapItem> *heap = NULL;
+};
+
+static std::vector<ShardDb> g_dbs;
+
+// what the child sends back before it exits
+struct SaveInfo
+{
+    uint64_t keys = 0;
+    uint64_t bytes = 0;
+    uint64_t write_us = 0;
+    // the pages the parent changed since the fork, copied for the child
+    uint64_t cow_bytes = 0;
+};
+
+// the last child of a kind
+struct SaveLast
+{
+    bool ok = true;
+    uint64_t count = 0;
+    int64_t time_ms = 0; // wall clock, at the fork
+    uint64_t fork_us = 0;
+    SaveInfo info;
+    // of a log rewrite: what the shards wrote meanwhile, appended to it
+    uint64_t diff_bytes = 0;
+};
+
+// a BGSAVE is requested on one shard. every shard stops at the end of its
+// loop iteration, and the last one to get there forks: the child has all the
+// shards at the same point in time. they go on while the child writes.
+// BGREWRITEAOF is the same, with a child that writes the log.
+static struct
+{
+    std::mutex mu;
+    std::condition_variable cv;
+    std::atomic<bool> requested{false};
+    uint32_t arrived = 0;
+    uint64_t round = 0;
+    bool running = false;
+    // the child rewrites the log instead of saving a snapshot
+    bool aof = false;
+    SaveLast snap;
+    SaveLast rewrite;
+    // the log is rewritten when it gets to this size
+    std::atomic<uint64_t> aof_auto_size{UINT64_MAX};
+} g_save;
+
+// how often the shard that forked looks for the end of its child
+const uint32_t k_save_poll_ms = 100;
+
+struct SaveCtx
+{
+    SnapWriter *w = NULL;
+    std::vector<HeapItem> *heap = NULL;
+    uint64_t now_ms = 0;
+    int64_t wall_ms = 0;
+    uint64_t keys = 0;
+};
+
+static void cb_save(HNode *node, void *arg)
+{
+    SaveCtx *ctx = (SaveCtx *)arg;
+    SnapWriter *w = ctx->w;
+    Entry *ent = my_container_of(node, Entry, node);
+    int64_t deadline = 0;
+    if (ent->heap_idx != k_heap_none)
+    {
+        uint64_t val = (*ctx->heap)[ent->heap_idx].val;
+        if (val <= ctx->now_ms)
+        {
+            return; // expired, but not deleted yet
+        }
+        deadline = wall_deadline(val, ctx->now_ms, ctx->wall_ms);
+    }
+    uint8_t type = ent->type == T_ZSET ? SNAP_ZSET : ent->enc == ENC_INT ? SNAP_INT : SNAP_STR;
+    snap_record(w);
+    snap_u8(w, type);
+    snap_u64(w, (uint64_t)deadline);
+    snap_u32(w, ent->klen);
+    snap_put(w, ent->data, ent->klen);
+    if (type == SNAP_INT)
+    {
+        snap_u64(w, (uint64_t)ent->ival);
+    }
+    else if (type == SNAP_STR)
+    {
+        char buf[24];
+        std::string_view val = entry_val(ent, buf);
+        snap_u32(w, (uint32_t)val.size());
+        snap_put(w, val.data(), val.size());
+    }
+    else
+    {
+        ZSet *zset = ent->zset;
+        snap_u64(w, zset_size(zset));
+        for (ZIter it = zset_at(zset, 0); it.valid; zset_offset(zset, &it, +1))
+        {
+            snap_put(w, &it.score, 8);
+            snap_u32(w, (uint32_t)it.len);
+            snap_put(w, it.name, it.len);
+        }
+    }
+    ctx->keys++;
+}
+
+// the Private_Dirty of the child: what it didn't share with the parent anymore
+static uint64_t private_dirty()
+{
+    char buf[4096];
+    int fd = open("/proc/self/smaps_rollup", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    buf[n > 0 ? n : 0] = 0;
+    const char *p = strstr(buf, "Private_Dirty:");
+    return p ? strtoull(p + strlen("Private_Dirty:"), NULL, 10) * 1024 : 0;
+}
+
+// the forked child: write all shards to a new file and rename it over the old one.
+// the other threads aren't there, so no locks, no logging.
+static void save_child(int info_fd) __attribute__((noreturn));
+static void save_child(int info_fd)
+{
+    uint64_t start_us = get_monotonic_usec();
+    std::string tmp = std::string(g_config.dbfile) + ".tmp." + std::to_string(getpid());
+    SaveInfo info;
+    SnapWriter w;
+    bool ok = snap_create(&w, tmp.c_str());
+    if (ok)
+    {
+        SaveCtx ctx;
+        ctx.w = &w;
+        ctx.now_ms = start_us / 1000;
+        ctx.wall_ms = get_wall_msec();
+        snap_put(&w, "SNAP", 4);
+        snap_u32(&w, k_snap_version);
+        snap_u64(&w, (uint64_t)ctx.wall_ms);
+        for (ShardDb &sd : g_dbs)
+        {
+            ctx.heap = sd.heap;
+            hm_foreach(sd.db, &cb_save, &ctx);
+        }
+        snap_end(&w, ctx.keys);
+        ok = snap_commit(&w, tmp.c_str(), g_config.dbfile);
+        info.keys = ctx.keys;
+        info.bytes = w.bytes;
+    }
+    else
+    {
+        snap_abort(&w, tmp.c_str());
+    }
+    info.write_us = get_monotonic_usec() - start_us;
+    info.cow_bytes = private_dirty();
+    ssize_t rv = write(info_fd, &info, sizeof(info));
+    (void)rv;
+    _exit(ok ? 0 : 1);
+}
+
+static std::string aof_tmp_path(pid_t pid)
+{
+    return std::string(g_config.aof_file) + ".tmp." + std::to_string(pid);
+}
+
+// the forked child of BGREWRITEAOF: the keys of all shards as commands, a SET
+// or ZADDs per key, to a new file. the parent appends to it what the shards
+// wrote meanwhile and renames it over the log.
+static void aof_rewrite_child(int info_fd) __attribute__((noreturn));
+static void aof_rewrite_child(int info_fd)
+{
+    uint64_t start_us = get_monotonic_usec();
+    std::string tmp = aof_tmp_path(getpid());
+    SaveInfo info;
+    AofDumpCtx ctx;
+    ctx.now_ms = start_us / 1000;
+    ctx.wall_ms = get_wall_msec();
+    ctx.fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = ctx.fd >= 0;
+    if (ok)
+    {
+        for (ShardDb &sd : g_dbs)
+        {
+            ctx.heap = sd.heap;
+            hm_foreach(sd.db, &cb_aof_dump, &ctx);
+        }
+        aof_dump_write(&ctx);
+        info.bytes = (uint64_t)lseek(ctx.fd, 0, SEEK_END);
+        ok = !ctx.failed && fsync(ctx.fd) == 0;
+        ok = close(ctx.fd) == 0 && ok;
+    }
+    if (!ok)
+    {
+        unlink(tmp.c_str());
+    }
+    info.keys = ctx.keys;
+    info.write_us = get_monotonic_usec() - start_us;
+    info.cow_bytes = private_dirty();
+    ssize_t rv = write(info_fd, &info, sizeof(info));
+    (void)rv;
+    _exit(ok ? 0 : 1);
+}
+
+static SaveLast &save_last()
+{
+    return g_save.aof ? g_save.rewrite : g_save.snap;
+}
+
+// the size the log is rewritten at, when it's grown by the percentage
+static uint64_t aof_auto_size(uint64_t size)
+{
+    if (g_config.aof_rewrite_pct == 0)
+    {
+        return UINT64_MAX;
+    }
+    uint64_t next = size + size / 100 * g_config.aof_rewrite_pct;
+    return next > g_config.aof_rewrite_min ? next : g_config.aof_rewrite_min;
+}
+
+// called with g_save.mu held, while the other shards wait
+static void save_fork()
+{
+    SaveLast &last = save_last();
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        msg("pipe");
+        last.ok = false;
+        return;
+    }
+    // every batch written from here on is after the point the child sees
+    if (g_save.aof)
+    {
+        aof_rewrite_begin();
+    }
+    uint64_t start_us = get_monotonic_usec();
+    last.time_ms = get_wall_msec();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(fds[0]);
+        if (g_save.aof)
+        {
+            aof_rewrite_child(fds[1]);
+        }
+        save_child(fds[1]);
+    }
+    last.fork_us = get_monotonic_usec() - start_us;
+    close(fds[1]);
+    if (pid < 0)
+    {
+        msg("fork");
+        close(fds[0]);
+        last.ok = false;
+        if (g_save.aof)
+        {
+            aof_rewrite_abort();
+        }
+        return;
+    }
+    // read when the child is gone, it's in the pipe by then
+    g_save.running = true;
+    g_data.save_child = pid;
+    g_data.save_info_fd = fds[0];
+    log_info("%s: started child %d, the fork took %llu us", g_save.aof ? "bgrewriteaof" : "bgsave",
+             (int)pid, (unsigned long long)last.fork_us);
+}
+
+// at the end of every loop iteration of every shard
+static void save_checkpoint()
+{
+    if (!g_save.requested.load(std::memory_order_acquire))
+    {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(g_save.mu);
+    if (!g_save.requested)
+    {
+        return;
+    }
+    uint64_t round = g_save.round;
+    if (++g_save.arrived < g_config.shards)
+    {
+        g_save.cv.wait(lock, [&] { return g_save.round != round; });
+        return;
+    }
+    save_fork();
+    g_save.arrived = 0;
+    g_save.requested = false;
+    g_save.round++;
+    g_save.cv.notify_all();
+}
+
+// the shard that forked waits for its child without blocking
+static void save_reap()
+{
+    if (g_data.save_child < 0)
+    {
+        return;
+    }
+    int status = 0;
+    pid_t pid = waitpid(g_data.save_child, &status, WNOHANG);
+    if (pid == 0 || (pid < 0 && errno == EINTR))
+    {
+        return;
+    }
+    SaveInfo info;
+    bool ok = pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+              read(g_data.save_info_fd, &info, sizeof(info)) == (ssize_t)sizeof(info);
+    // no other request until running is cleared
+    bool aof = g_save.aof;
+    uint64_t diff = 0;
+    if (aof)
+    {
+        std::string tmp = aof_tmp_path(g_data.save_child);
+        if (ok)
+        {
+            ok = aof_rewrite_end(tmp.c_str(), g_config.aof_file, &diff);
+        }
+        else
+        {
+            aof_rewrite_abort();
+            unlink(tmp.c_str());
+        }
+        // failed or not, it isn't tried again until the log grows some more
+        g_save.aof_auto_size = aof_auto_size(aof_size());
+    }
+    close(g_data.save_info_fd);
+    g_data.save_child = -1;
+    g_data.save_info_fd = -1;
+    const char *name = aof ? "bgrewriteaof" : "bgsave";
+    std::lock_guard<std::mutex> lock(g_save.mu);
+    SaveLast &last = save_last();
+    g_save.running = false;
+    last.ok = ok;
+    if (!ok)
+    {
+        log_error("%s: failed, status %d", name, status);
+        return;
+    }
+    last.count++;
+    last.info = info;
+    last.diff_bytes = diff;
+    log_info("%s: %llu keys, %llu bytes in %llu ms", name,
+             (unsigned long long)info.keys, (unsigned long long)(info.bytes + diff),
+             (unsigned long long)(info.write_us / 1000));
+}
+
+// start a child at the next checkpoint, false if there's one already
+static bool save_request(bool aof)
+{
+    {
+        std::lock_guard<std::mutex> lock(g_save.mu);
+        if (g_save.running || g_save.requested)
+        {
+            return false;
+        }
+        g_save.aof = aof;
+        g_save.requested = true;
+        if (aof)
+        {
+            g_save.aof_auto_size = UINT64_MAX;
+        }
+    }
+    // this shard gets to the checkpoint at the end of this iteration
+    for (uint32_t i = 0; i < g_config.shards; ++i)
+    {
+        if (i != g_data.shard->id)
+        {
+            shard_wake(i);
+        }
+    }
+    return true;
+}
+
+// bgsave: write a snapshot in a forked child, the reply doesn't wait for it
+static void do_bgsave(std::vector<std::string_view> &, Out &out)
+{
+    if (!save_request(false))
+    {
+        return out_err(out, ERR_UNKNOWN, "a save is in progress");
+    }
+    return out_str(out, "Background saving started");
+}
+
+// bgrewriteaof: replace the log with one made of the keys, in a forked child
+static void do_bgrewriteaof(std::vector<std::string_view> &, Out &out)
+{
+    if (!g_config.aof_file)
+    {
+        return out_err(out, ERR_UNKNOWN, "no append-only log");
+    }
+    if (!save_request(true))
+    {
+        return out_err(out, ERR_UNKNOWN, "a save is in progress");
+    }
+    return out_str(out, "Background append only file rewriting started");
+}
+
+// the numbers of the last save
+static void do_savestats(std::vector<std::string_view> &, Out &out)
+{
+    std::lock_guard<std::mutex> lock(g_save.mu);
+    out_arr(out, 18);
+    SaveLast &last = g_save.snap;
+    out_stat(out, "in_progress", (g_save.running || g_save.requested) && !g_save.aof ? 1 : 0);
+    out_stat(out, "last_ok", last.ok ? 1 : 0);
+    out_stat(out, "saves", (int64_t)last.count);
+    out_stat(out, "last_time_ms", last.time_ms);
+    out_stat(out, "fork_us", (int64_t)last.fork_us);
+    out_stat(out, "keys", (int64_t)last.info.keys);
+    out_stat(out, "bytes", (int64_t)last.info.bytes);
+    out_stat(out, "write_us", (int64_t)last.info.write_us);
+    out_stat(out, "cow_bytes", (int64_t)last.info.cow_bytes);
+}
+
+// the append-only log, since the start, and its last rewrite.
+// policy is -1 without a log.
+static void do_aofstats(std::vector<std::string_view> &, Out &out)
+{
+    AofStats st;
+    aof_stats(&st);
+    std::lock_guard<std::mutex> lock(g_save.mu);
+    SaveLast &last = g_save.rewrite;
+    out_arr(out, 30);
+    out_stat(out, "policy", g_config.aof_file ? g_config.aof_fsync : -1);
+    out_stat(out, "bytes", (int64_t)st.bytes);
+    out_stat(out, "writes", (int64_t)st.writes);
+    out_stat(out, "fsyncs", (int64_t)st.fsyncs);
+    out_stat(out, "fsync_avg_us", st.fsyncs ? (int64_t)(st.fsync_us / st.fsyncs) : 0);
+    out_stat(out, "fsync_max_us", (int64_t)st.fsync_max_us);
+    out_stat(out, "size", (int64_t)aof_size());
+    out_stat(out, "rewrite_in_progress", (g_save.running || g_save.requested) && g_save.aof ? 1 : 0);
+    out_stat(out, "rewrites", (int64_t)last.count);
+    out_stat(out, "rewrite_last_ok", last.ok ? 1 : 0);
+    out_stat(out, "rewrite_keys", (int64_t)last.info.keys);
+    out_stat(out, "rewrite_bytes", (int64_t)last.info.bytes);
+    out_stat(out, "rewrite_diff_bytes", (int64_t)last.diff_bytes);
+    out_stat(out, "rewrite_write_us", (int64_t)last.info.write_us);
+    out_stat(out, "rewrite_fork_us", (int64_t)last.fork_us);
+}
+
+// a key read from the snapshot, until the thread of its shard takes it
+struct LoadedKey
+{
+    Entry *ent = NULL;
+    uint64_t deadline = 0; // monotonic, 0 for none
+};
+
+// a thread that decodes chunks of the snapshot. the entries and the zsets
+// are built in its heap, which a shard adopts when the thread is done.
+struct Loader
+{
+    pthread_t tid;
+    std::vector<std::vector<LoadedKey>> keys; // per shard
+    SlabHeap *heap = NULL;
+    uint64_t nrecords = 0;
+    uint64_t nexpired = 0;
+    const char *error = NULL;
+};
+
+static struct
+{
+    SnapFile file;
+    std::atomic<size_t> next_chunk{0};
+    int64_t wall_ms = 0;
+    uint64_t now_ms = 0;
+    std::vector<Loader> loaders;
+    uint64_t start_us = 0;
+    uint64_t decode_us = 0;
+    // the log to replay instead, if there's one
+    AofLog aof;
+    bool aof_found = false;
+    std::atomic<uint64_t> replayed{0};
+    // every shard has its keys before any of them serves a request
+    std::mutex mu;
+    std::condition_variable cv;
+    uint32_t started = 0;
+} g_load;
+
+static void load_fail(const char *path, const char *why)
+{
+    fprintf(stderr, "%s: %s\n", path, why);
+    exit(1);
+}
+
+// the records of a chunk. the zset names are read right from the file.
+static const char *load_chunk(Loader *ld, SnapCursor *c, std::vector<ZTuple> &tuples)
+{
+    while (c->pos < c->end)
+    {
+        uint8_t type = snap_get_u8(c);
+        int64_t deadline = (int64_t)snap_get_u64(c);
+        uint32_t klen = snap_get_u32(c);
+        const uint8_t *kp = snap_get(c, klen);
+        std::string_view key((const char *)kp, kp ? klen : 0);
+        // an expired key is skipped, nothing is allocated for it
+        bool expired = deadline != 0 && deadline <= g_load.wall_ms;
+        Entry *ent = NULL;
+        if (type == SNAP_STR)
+        {
+            uint32_t vlen = snap_get_u32(c);
+            const uint8_t *vp = snap_get(c, vlen);
+            if (vp && !expired)
+            {
+                uint64_t hcode = str_hash((const uint8_t *)key.data(), key.size());
+                ent = entry_new(key, hcode, T_STR, vlen);
+                entry_set_val(ent, std::string_view((const char *)vp, vlen));
+            }
+        }
+        else if (type == SNAP_INT)
+        {
+            int64_t val = (int64_t)snap_get_u64(c);
+            if (!c->failed && !expired)
+            {
+                uint64_t hcode = str_hash((const uint8_t *)key.data(), key.size());
+                ent = entry_new(key, hcode, T_STR, 0);
+                ent->enc = ENC_INT;
+                ent->ival = val;
+            }
+        }
+        else if (type == SNAP_ZSET)
+        {
+            uint64_t n = snap_get_u64(c);
+            tuples.clear();
+            for (uint64_t i = 0; i < n && !c->failed; ++i)
+            {
+                ZTuple t;
+                const uint8_t *sp = snap_get(c, 8);
+                t.len = snap_get_u32(c);
+                t.name = (const char *)snap_get(c, t.len);
+                if (t.name)
+                {
+                    memcpy(&t.score, sp, 8);
+                    tuples.push_back(t);
+                }
+            }
+            if (!c->failed && !expired)
+            {
+                // in (score, name) order, the tree is built bottom up
+                uint64_t hcode = str_hash((const uint8_t *)key.data(), key.size());
+                ent = entry_new(key, hcode, T_ZSET, 0);
+                ent->zset = new ZSet();
+                zset_add_many(ent->zset, tuples.data(), tuples.size());
+            }
+        }
+        else
+        {
+            return "unknown record type";
+        }
+        if (c->failed)
+        {
+            return "the snapshot is damaged or cut short";
+        }
+        ld->nrecords++;
+        if (expired)
+        {
+            ld->nexpired++;
+            continue;
+        }
+        LoadedKey lk;
+        lk.ent = ent;
+        lk.deadline = deadline ? g_load.now_ms + (uint64_t)(deadline - g_load.wall_ms) : 0;
+        ld->keys[shard_of(ent->node.hcode)].push_back(lk);
+    }
+    return NULL;
+}
+
+static void *loader_main(void *arg)
+{
+    Loader *ld = (Loader *)arg;
+    ld->keys.resize(g_config.shards);
+    std::vector<ZTuple> tuples;
+    std::vector<SnapCursor> &chunks = g_load.file.chunks;
+    while (!ld->error)
+    {
+        size_t i = g_load.next_chunk.fetch_add(1, std::memory_order_relaxed);
+        if (i >= chunks.size())
+        {
+            break;
+        }
+        ld->error = load_chunk(ld, &chunks[i], tuples);
+    }
+    ld->heap = slab_detach();
+    return NULL;
+}
+
+// decode the snapshot before the shards start, it's fine if there's none.
+// a damaged one stops the server, rather than start with part of the data.
+// the shards take the keys in adopt_loaded().
+static void load_snapshot(const char *path)
+{
+    const char *err = snap_map(&g_load.file, path);
+    if (err)
+    {
+        if (errno != ENOENT)
+        {
+            load_fail(path, err);
+        }
+        return;
+    }
+    g_load.wall_ms = get_wall_msec();
+    g_load.now_ms = get_monotonic_msec();
+    uint32_t nthreads = g_config.load_threads;
+    if (nthreads == 0)
+    {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpu > 0 ? (uint32_t)ncpu : 1;
+    }
+    if (nthreads > g_load.file.chunks.size())
+    {
+        nthreads = (uint32_t)g_load.file.chunks.size();
+    }
+    g_load.loaders.resize(nthreads);
+    for (Loader &ld : g_load.loaders)
+    {
+        if (0 != pthread_create(&ld.tid, NULL, &loader_main, &ld))
+        {
+            die("pthread_create");
+        }
+    }
+    uint64_t nrecords = 0;
+    for (Loader &ld : g_load.loaders)
+    {
+        pthread_join(ld.tid, NULL);
+        if (ld.error)
+        {
+            load_fail(path, ld.error);
+        }
+        nrecords += ld.nrecords;
+    }
+    if (nrecords != g_load.file.nrecords)
+    {
+        load_fail(path, "the snapshot is damaged or cut short");
+    }
+    snap_unmap(&g_load.file);
+    g_load.decode_us = get_monotonic_usec() - g_load.start_us;
+}
+
+// a shard's thread takes its keys, and the heaps they're in
+static void adopt_loaded()
+{
+    uint32_t id = g_data.shard->id;
+    size_t nkeys = 0;
+    for (size_t i = 0; i < g_load.loaders.size(); ++i)
+    {
+        nkeys += g_load.loaders[i].keys[id].size();
+        if (i % g_config.shards == id)
+        {
+            slab_adopt(g_load.loaders[i].heap);
+        }
+    }
+    hm_reserve(&g_data.db, nkeys);
+    for (Loader &ld : g_load.loaders)
+    {
+        for (LoadedKey &lk : ld.keys[id])
+        {
+            hm_insert(&g_data.db, &lk.ent->node);
+            if (lk.deadline)
+            {
+                entry_set_deadline(lk.ent, lk.deadline);
+            }
+        }
+        std::vector<LoadedKey>().swap(ld.keys[id]);
+    }
+}
+
+static void do_request(std::vector<std::string_view> &cmd, Out &out)
+{
+    if (cmd.size() == 1 && cmd_is(cmd[0], "keys"))
+    {
+        do_keys(cmd, out);
+    }
+    else if (cmd.size() >= 2 && cmd.size() <= 6 && cmd.size() % 2 == 0 && cmd_is(cmd[0], "scan"))
+    {
+        do_scan(cmd, out);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "get"))
+    {
+        do_get(cmd, out);
+    }
+    else if ((cmd.size() == 3 || cmd.size() == 5) && cmd_is(cmd[0], "set"))
+    {
+        do_set(cmd, out);
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "pexpire"))
+    {
+        do_pexpire(cmd, out);
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "pexpireat"))
+    {
+        do_pexpireat(cmd, out);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "pttl"))
+    {
+        do_pttl(cmd, out);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "persist"))
+    {
+        do_persist(cmd, out);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "del"))
+    {
+        do_del(cmd, out);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "unlink"))
+    {
+        do_unlink(cmd, out);
+    }
+    else if (cmd.size() >= 4 && cmd.size() % 2 == 0 && cmd_is(cmd[0], "zadd"))
+    {
+        do_zadd(cmd, out);
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "zrem"))
+    {
+        do_zrem(cmd, out);
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "zscore"))
+    {
+        do_zscore(cmd, out);
+    }
+    else if (cmd.size() == 6 && cmd_is(cmd[0], "zquery"))
+    {
+        do_zquery(cmd, out);
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "zrank"))
+    {
+        do_zrank(cmd, out, false);
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "zrevrank"))
+    {
+        do_zrank(cmd, out, true);
+    }
+    else if (cmd.size() == 4 && cmd_is(cmd[0], "zcount"))
+    {
+        do_zcount(cmd, out);
+    }
+    else if (cmd.size() >= 4 && cmd.size() <= 8 && cmd_is(cmd[0], "zrangebyscore"))
+    {
+        do_zrangebyscore(cmd, out, false);
+    }
+    else if (cmd.size() >= 4 && cmd.size() <= 8 && cmd_is(cmd[0], "zrevrangebyscore"))
+    {
+        do_zrangebyscore(cmd, out, true);
+    }
+    else if (cmd.size() == 4 && cmd_is(cmd[0], "zremrangebyscore"))
+    {
+        do_zremrangebyscore(cmd, out);
+    }
+    else if (cmd.size() == 1 && cmd_is(cmd[0], "memstats"))
+    {
+        do_memstats(cmd, out);
+    }
+    else if (cmd.size() == 1 && cmd_is(cmd[0], "bgsave"))
+    {
+        do_bgsave(cmd, out);
+    }
+    else if (cmd.size() == 1 && cmd_is(cmd[0], "savestats"))
+    {
+        do_savestats(cmd, out);
+    }
+    else if (cmd.size() == 1 && cmd_is(cmd[0], "bgrewriteaof"))
+    {
+        do_bgrewriteaof(cmd, out);
+    }
+    else if (cmd.size() == 1 && cmd_is(cmd[0], "aofstats"))
+    {
+        do_aofstats(cmd, out);
+    }
+    else
+    {
+        // cmd is not recognized
+        out_err(out, ERR_UNKNOWN, "Unknown cmd");
+    }
+}
+
+// the shard that owns the command's key, or -1 if it needs all of them
+static int32_t cmd_shard(const std::vector<std::string_view> &cmd)
+{
+    if (g_config.shards == 1)
+    {
+        return 0;
+    }
+    if (cmd.size() == 1 && cmd_is(cmd[0], "keys"))
+    {
+        return -1;
+    }
+    if (cmd.size() < 2)
+    {
+        return (int32_t)g_data.shard->id;
+    }
+    if (cmd_is(cmd[0], "scan"))
+    {
+        // the shard is in the cursor, a bad one is reported here
+        uint64_t cursor = 0;
+        uint32_t shard = 0;
+        return (int32_t)(scan_cursor(cmd[1], cursor, shard) ? shard : g_data.shard->id);
+    }
+    // every command with a key has it as the first argument
+    std::string_view key = cmd[1];
+    return (int32_t)shard_of(str_hash((uint8_t *)key.data(), key.size()));
+}
+
+static void gather_add(Gather *gather, const uint8_t *data, size_t size)
+{
+    // the reply of a shard is an array, merge the items
+    assert(size >= 5 && data[0] == SER_ARR);
+    uint32_t n = 0;
+    memcpy(&n, &data[1], 4);
+    gather->n += n;
+    gather->items.append((const char *)&data[5], size - 5);
+}
+
+static void shard_send_req(Conn *conn, const std::vector<std::string_view> &cmd, uint32_t dst)
+{
+    ShardMsg *m = new ShardMsg();
+    m->src = g_data.shard->id;
+    m->conn = conn;
+    // the views point into rbuf, the message needs its own copy
+    m->cmd.assign(cmd.begin(), cmd.end());
+    conn->remote++;
+    shard_send(g_data.shard, dst, m);
+}
+
+// the connection stops reading until the replies are back,
+// so the responses stay in the order of the requests
+static void shard_forward(Conn *conn, std::vector<std::string_view> &cmd, int32_t dst)
+{
+    conn->state = STATE_WAIT;
+    if (dst >= 0)
+    {
+        shard_send_req(conn, cmd, (uint32_t)dst);
+        return;
+    }
+    // fan out to all shards, this one included
+    conn->gather = new Gather();
+    for (uint32_t i = 0; i < g_config.shards; ++i)
+    {
+        if (i != g_data.shard->id)
+        {
+            shard_send_req(conn, cmd, i);
+        }
+    }
+    Buffer buf;
+    Out out;
+    out_init(out, &buf, 0);
+    do_request(cmd, out);
+    if (out.failed)
+    {
+        // closed once the other shards have replied
+        msg("out of memory");
+        conn->state = STATE_END;
+    }
+    else
+    {
+        gather_add(conn->gather, buf.data, out.pos);
+    }
+    buf_release(&buf);
+}
+
+// start a response at the end of the write buffer, it's sent with the rest of the batch
+static void conn_out_begin(Conn *conn, Out &out)
+{
+    out_init(out, &conn->wbuf, conn->wbuf_size);
+    // each response starts with its length (EXCEPT FOR ITSELF), filled in by conn_out_end()
+    out_append(out, "\0\0\0\0", 4);
+}
+
+// with no memory for the response, the connection is dropped rather than the
+// server, the responses before it in wbuf are lost too
+static void conn_out_end(Conn *conn, Out &out)
+{
+    if (out.failed)
+    {
+        msg("out of memory");
+        conn->state = STATE_END;
+        return;
+    }
+    size_t len = out.pos - out.start - 4;
+    if (len > g_config.max_msg)
+    {
+        out.pos = out.start + 4;
+        out_err(out, ERR_2BIG, "response is too big");
+        len = out.pos - out.start - 4;
+    }
+    uint32_t wlen = (uint32_t)len;
+    memcpy(&conn->wbuf.data[out.start], &wlen, 4);
+    conn->wbuf_size = out.pos;
+}
+
+// pipeline. There may be more than one request in the read buffer
+// This function takes one request from the read buffer and appends its response to the write buffer.
+// returns false if there's no complete request, or it can't be handled right now.
+static bool try_one_request(Conn *conn)
+{
+    // high-water mark: send the batch before taking more
+    if (conn->wbuf_size >= k_wbuf_batch)
+    {
+        return false;
+    }
+    // if not enough data
+    const uint8_t *req = &conn->rbuf.data[conn->rbuf_start];
+    size_t avail = conn->rbuf_size - conn->rbuf_start;
+    if (avail < 4)
+    {
+        return false;
+    }
+    // get the first request's length
+    u_int32_t len;
+    memcpy(&len, req, 4);
+    // if too long
+    if (len > g_config.max_msg)
+    {
+        msg("message too long.");
+        conn->state = STATE_END;
+        return false;
+    }
+    if (4 + len > avail)
+    {
+        return false;
+    }
+    std::vector<std::string_view> &cmd = g_data.cmd;
+    cmd.clear();
+    if (0 != parse_req(&req[4], len, cmd))
+    {
+        msg("bad req");
+        conn->state = STATE_END;
+        return false;
+    }
+
+    // remove this request from the read buffer
+    conn->rbuf_start += 4 + len;
+
+    // the key belongs to another shard, the response comes back as a message.
+    // the batch so far waits in wbuf, the reply is appended after it.
+    int32_t dst = cmd_shard(cmd);
+    if (dst != (int32_t)g_data.shard->id)
+    {
+        shard_forward(conn, cmd, dst);
+        return false;
+    }
+
+    // got one request, generate the reponse
+    Out out;
+    size_t logged = g_data.aof_buf.size();
+    conn_out_begin(conn, out);
+    do_request(cmd, out);
+    conn_out_end(conn, out);
+    if (g_data.aof_buf.size() != logged && g_config.aof_fsync == AOF_FSYNC_ALWAYS)
+    {
+        conn->aof_hold = true;
+    }
+    return conn->state == STATE_REQ;
+}
+
+// handle all complete requests in rbuf, and send their responses in one go.
+// if the batch is fully sent, go on with the requests left by the high-water mark.
+static void handle_requests(Conn *conn)
+{
+    while (conn->state == STATE_REQ)
+    {
+        while (try_one_request(conn))
+        {
+        }
+        if (conn->state != STATE_REQ || conn->wbuf_size == 0)
+        {
+            break;
+        }
+        if (conn->aof_hold)
+        {
+            // the responses go after the fsync, nothing is read meanwhile
+            conn->aof_hold = false;
+            conn->aof_wait = true;
+            conn->state = STATE_WAIT;
+            AofHeld held;
+            held.conn = conn;
+            g_data.aof_held.push_back(held);
+            break;
+        }
+        conn->state = STATE_RES;
+        if (g_config.uring)
+        {
+            // the send is submitted by the ring, stop here until it completes
+            break;
+        }
+        state_res(conn);
+    }
+}
+static bool try_fill_buffer(Conn *conn)
+{
+    if (!rbuf_prepare(conn, k_read_size))
+    {
+        msg("out of memory");
+        conn->state = STATE_END;
+        return false;
+    }
+    // number of bytes received
+    ssize_t rv = 0;
+    size_t cap = conn->rbuf.cap - conn->rbuf_size;
+    do
+    {
+        rv = recv(conn->fd, &conn->rbuf.data[conn->rbuf_size], cap, 0);
+    } while (rv < 0 && errno == EINTR); // The receive was interrupted by delivery of a signal before any data was available
+
+    // in non-blocking mode, if there's nothing to read, the value -1 is returned and errno is set to EAGAIN
+    if (rv < 0 && errno == EAGAIN)
+    {
+        rbuf_shrink(conn);
+        return false;
+    }
+
+    // if other error
+    if (rv < 0)
+    {
+        msg("read() error");
+        conn->state = STATE_END;
+        return false;
+    }
+
+    // EOF met. When a stream socket peer has performed an orderly shutdown
+    if (rv == 0)
+    {
+        if (conn->rbuf_size > conn->rbuf_start)
+        {
+            msg("unexpected EOF");
+        }
+        else
+        {
+            // normal EOF
+        }
+        conn->state = STATE_END;
+        return false;
+    }
+    conn->rbuf_size += rv;
+
+    handle_requests(conn);
+    rbuf_shrink(conn);
+    // edge-triggered: no more notifications until the socket is drained.
+    // and if the buffer was filled up, there's likely more to read anyway.
+    return conn->state == STATE_REQ && (g_data.poller.edge || (size_t)rv == cap);
+}
+
+static void state_req(Conn *conn)
+{
+    while (try_fill_buffer(conn))
+    {
+    }
+}
+
+// reset the idle timer
+static void conn_touch(Conn *conn)
+{
+    uint64_t timeout_ms = g_config.idle_timeout_ms[conn->cls];
+    if (timeout_ms == 0)
+    {
+        return;
+    }
+    uint64_t expire_ms = get_monotonic_msec() + timeout_ms;
+    if (tw_pending(&conn->idle_timer) && conn->idle_timer.expire_ms == expire_ms)
+    {
+        return; // touched in the same ms
+    }
+    tw_cancel(&g_data.timers, &conn->idle_timer);
+    tw_add(&g_data.timers, &conn->idle_timer, expire_ms);
+}
+
+static void connection_io(Conn *conn)
+{
+    conn_touch(conn);
+    if (conn->state == STATE_REQ)
+    {
+        state_req(conn);
+    }
+    else if (conn->state == STATE_RES)
+    {
+        state_res(conn);
+        // the responses are out, handle the pipelined requests left in rbuf
+        handle_requests(conn);
+    }
+    else if (conn->state == STATE_WAIT)
+    {
+        // nothing is polled while waiting, so this is an error or a hangup
+        conn->state = STATE_END;
+    }
+    else
+    {
+        assert(0);
+    }
+}
+
+// switch the poller's interest only when the connection changes its state
+static void conn_update_events(Conn *conn)
+{
+    uint32_t events = 0;
+    if (conn->state == STATE_REQ)
+    {
+        events = NP_IN;
+    }
+    else if (conn->state == STATE_RES)
+    {
+        events = NP_OUT;
+    }
+    if (events != conn->events)
+    {
+        np_mod(&g_data.poller, conn->fd, events);
+        conn->events = events;
+    }
+}
+
+static void conn_put(std::vector<Conn *> &fd2conn, struct Conn *conn)
+{
+    // if fd2conn's size isn't enough, resize it
+    if (fd2conn.size() <= (size_t)conn->fd)
+    {
+        fd2conn.resize(conn->fd + 1);
+    }
+    fd2conn[conn->fd] = conn;
+}
+
+// a client on the loopback interface or a unix socket is local
+static uint32_t conn_class(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getpeername(fd, (struct sockaddr *)&addr, &len) != 0)
+    {
+        return CLIENT_REMOTE;
+    }
+    if (addr.ss_family == AF_UNIX)
+    {
+        return CLIENT_LOCAL;
+    }
+    if (addr.ss_family == AF_INET)
+    {
+        uint32_t ip = ntohl(((struct sockaddr_in *)&addr)->sin_addr.s_addr);
+        return (ip >> 24) == 127 ? CLIENT_LOCAL : CLIENT_REMOTE;
+    }
+    if (addr.ss_family == AF_INET6)
+    {
+        const struct in6_addr *ip = &((struct sockaddr_in6 *)&addr)->sin6_addr;
+        bool local = IN6_IS_ADDR_LOOPBACK(ip) ||
+                     (IN6_IS_ADDR_V4MAPPED(ip) && ip->s6_addr[12] == 127);
+        return local ? CLIENT_LOCAL : CLIENT_REMOTE;
+    }
+    return CLIENT_REMOTE;
+}
+
+// create the state of an accepted connection, and put it in fd2conn
+static Conn *conn_new(std::vector<Conn *> &fd2conn, int connfd)
+{
+    struct Conn *conn = (struct Conn *)slab_alloc(sizeof(struct Conn));
+    if (!conn)
+    {
+        close(connfd);
+        return NULL;
+    }
+    // the responses to a pipeline go out in several writes, without this
+    // the later ones wait for the client's delayed ack
+    int yes = 1;
+    (void)setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    conn->fd = connfd;
+    conn->state = STATE_REQ;
+    conn->rbuf = Buffer();
+    conn->rbuf_start = 0;
+    conn->rbuf_size = 0;
+    conn->wbuf = Buffer();
+    conn->wbuf_size = 0;
+    conn->wbuf_sent = 0;
+    conn->cls = conn_class(connfd);
+    conn->idle_timer = Timer();
+    conn_touch(conn);
+    conn->events = 0;
+    conn->ur_ops = 0;
+    conn->ur_nobufs = false;
+    conn->remote = 0;
+    conn->gather = NULL;
+    conn->aof_hold = false;
+    conn->aof_wait = false;
+    conn_put(fd2conn, conn);
+    return conn;
+}
+
+// how long accepting stops for when accept() is out of fds or memory
+const uint64_t k_accept_pause_ms = 100;
+
+// the connection waits in the backlog, rather than fail every accept() of
+// a level-triggered loop, or get lost with an edge-triggered one
+static void accept_pause()
+{
+    if (!g_data.accept_failing)
+    {
+        log_warn("accept() error: %s, not accepting for now", strerror(errno));
+        g_data.accept_failing = true;
+    }
+    g_data.accept_paused_ms = get_monotonic_msec() + k_accept_pause_ms;
+    if (!g_config.uring)
+    {
+        (void)np_mod(&g_data.poller, g_data.listen_fd, 0);
+    }
+    // the io_uring accept isn't armed again, a failed multishot one ends
+}
+
+static void accept_resume()
+{
+    if (!g_data.accept_paused_ms)
+    {
+        return;
+    }
+    g_data.accept_paused_ms = 0;
+#ifdef __linux__
+    if (g_config.uring)
+    {
+        (void)ur_accept(&g_data.ring, g_data.listen_fd, g_data.ur_multishot, UR_ACCEPT);
+        return;
+    }
+#endif
+    // a connection in the backlog shows up, edge-triggered or not
+    (void)np_mod(&g_data.poller, g_data.listen_fd, NP_IN);
+}
+
+static void conn_done(Conn *conn)
+{
+    g_data.fd2conn[conn->fd] = NULL;
+    np_del(&g_data.poller, conn->fd);
+    (void)close(conn->fd);
+    tw_cancel(&g_data.timers, &conn->idle_timer);
+    delete conn->gather;
+    buf_release(&conn->rbuf);
+    buf_release(&conn->wbuf);
+    slab_free(conn, sizeof(struct Conn));
+    // there's an fd for the next one
+    accept_resume();
+}
+
+// listening fd try to accept new client connections, then put those connections in fd2conn array
+// returns -1 if there's nothing more to accept
+int32_t accept_new_conn(std::vector<Conn *> &fd2conn, int fd)
+{
+    socklen_t sin_size;
+    struct sockaddr_storage their_addr;
+    sin_size = sizeof their_addr;
+    int connfd = accept(fd, (struct sockaddr *)&their_addr, &sin_size);
+    if (connfd == -1)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+            return -1;
+        }
+        if (errno == ECONNABORTED)
+        {
+            return 0; // the client is gone already, try the next one
+        }
+        if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+        {
+            // out of resources, leave the rest in the backlog for now
+            accept_pause();
+            return -1;
+        }
+        die("accept() error");
+    }
+    g_data.accept_failing = false;
+    // set the new fd to non-blocking mode
+    fd_set_nb(connfd);
+    Conn *conn = conn_new(fd2conn, connfd);
+    if (!conn)
+    {
+        return -1;
+    }
+    conn->events = NP_IN;
+    if (!np_add(&g_data.poller, connfd, conn->events))
+    {
+        msg("np_add() error");
+        conn_done(conn);
+        return -1;
+    }
+    return 0;
+}
+
+// the io_uring backend or other shards may still have requests referencing the
+// connection, in that case shut the socket down and finish it when they complete.
+static void conn_close(Conn *conn)
+{
+    conn->state = STATE_END;
+    if (conn->ur_ops == 0 && conn->remote == 0 && !conn->aof_wait)
+    {
+        conn_done(conn);
+        return;
+    }
+    // no more timers or events
+    tw_cancel(&g_data.timers, &conn->idle_timer);
+    np_del(&g_data.poller, conn->fd);
+    (void)shutdown(conn->fd, SHUT_RDWR);
+}
+
+static uint32_t next_timer_ms()
+{
+    uint64_t now_ms = get_monotonic_msec();
+    // idle timers
+    uint64_t next_ms = tw_next(&g_data.timers);
+    // TTL timers
+    if (!g_data.heap.empty() && g_data.heap[0].val < next_ms)
+    {
+        next_ms = g_data.heap[0].val;
+    }
+
+    if (g_data.accept_paused_ms && g_data.accept_paused_ms < next_ms)
+    {
+        next_ms = g_data.accept_paused_ms;
+    }
+
+    if (next_ms == UINT64_MAX)
+    {
+        return 10000; // no timer, the value doesn't matter
+    }
+    if (next_ms <= now_ms)
+    {
+        // missed?
+        return 0;
+    }
+    // a far cascade, or a far TTL
+    return next_ms - now_ms < 10000 ? (uint32_t)(next_ms - now_ms) : 10000;
+}
+
+static void process_timers()
+{
+    DList due;
+    dlist_init(&due);
+    tw_advance(&g_data.timers, get_monotonic_msec(), &due);
+    while (!dlist_empty(&due))
+    {
+        Timer *timer = my_container_of(due.next, Timer, link);
+        tw_cancel(&g_data.timers, timer);
+        Conn *conn = my_container_of(timer, Conn, idle_timer);
+        log_info("removing idle connection: %d", conn->fd);
+        conn_close(conn);
+    }
+    if (g_data.accept_paused_ms && g_data.accept_paused_ms <= get_monotonic_msec())
+    {
+        accept_resume();
+    }
+}
+
+// the objects freed by other threads that the slab takes back per loop iteration
+const size_t k_collect_work = 4096;
+
+// the longest the active expiry may run per loop iteration
+const uint64_t k_expiry_budget_us = 1000;
+
+// delete the keys past their deadline. it stops when it's out of time,
+// so a mass expiration is spread over many iterations of the event loop.
+static void process_expiry()
+{
+    uint64_t start_us = get_monotonic_usec();
+    uint64_t now_ms = start_us / 1000;
+    size_t nwork = 0;
+    g_data.expiry_pending = false;
+    while (!g_data.heap.empty() && g_data.heap[0].val <= now_ms)
+    {
+        // look at the clock every 32 keys
+        if (++nwork % 32 == 0 && get_monotonic_usec() - start_us >= k_expiry_budget_us)
+        {
+            g_data.expiry_pending = true;
+            break;
+        }
+        entry_drop(my_container_of(g_data.heap[0].ref, Entry, heap_idx));
+    }
+}
+
+#ifdef __linux__
+static void uring_arm(Conn *conn);
+#endif
+
+// wait for the IO the connection's state asks for, or close it
+static void conn_rearm(Conn *conn)
+{
+    if (conn->state != STATE_END)
+    {
+#ifdef __linux__
+        if (g_config.uring)
+        {
+            uring_arm(conn);
+        }
+        else
+#endif
+        {
+            conn_update_events(conn);
+        }
+    }
+    if (conn->state == STATE_END)
+    {
+        conn_close(conn);
+    }
+}
+
+// a reply to a forwarded request, back on the shard of the connection
+static void shard_on_res(ShardMsg *m)
+{
+    Conn *conn = m->conn;
+    assert(conn->remote > 0);
+    conn->remote--;
+    if (m->failed)
+    {
+        msg("out of memory");
         conn->state = STATE_END;
-        return false;
     }
+    if (conn->gather && conn->state != STATE_END)
+    {
+        gather_add(conn->gather, m->out.data, m->out_size);
+    }
+    if (conn->state == STATE_END)
+    {
+        // the client is gone, finish closing when nothing references it
+        conn_close(conn);
+        return;
+    }
+    if (conn->remote > 0)
+    {
+        return;
+    }
+    Out out;
+    conn_out_begin(conn, out);
+    if (conn->gather)
+    {
+        out_arr(out, conn->gather->n);
+        out_append(out, conn->gather->items.data(), conn->gather->items.size());
+        delete conn->gather;
+        conn->gather = NULL;
+    }
+    else
+    {
+        out_append(out, m->out.data, m->out_size);
+    }
+    conn_out_end(conn, out);
+    if (conn->state != STATE_END)
+    {
+        conn->state = STATE_REQ;
+        // send it, and handle the pipelined requests left in rbuf
+        handle_requests(conn);
+    }
+    conn_rearm(conn);
+}
 
-    // got one request, generate the reponse
-    std::string out;
-    do_request(cmd, out);
-    if (4 + out.size() > k_max_msg)
+// handle the messages from other shards
+static void process_msgs()
+{
+    Shard *self = g_data.shard;
+    while (ShardMsg *m = (ShardMsg *)shard_recv(self))
     {
-        out.clear();
-        out_err(out, ERR_2BIG, "response is too big");
+        if (m->type == MSG_RES)
+        {
+            shard_on_res(m);
+            // the buffer joins the pool of this shard
+            buf_release(&m->out);
+            delete m;
+            continue;
+        }
+        // the key is ours, reply with the same message
+        std::vector<std::string_view> &cmd = g_data.cmd;
+        cmd.assign(m->cmd.begin(), m->cmd.end());
+        Out out;
+        size_t logged = g_data.aof_buf.size();
+        out_init(out, &m->out, 0);
+        do_request(cmd, out);
+        m->out_size = out.failed ? 0 : out.pos;
+        m->failed = out.failed;
+        m->type = MSG_RES;
+        if (g_data.aof_buf.size() != logged && g_config.aof_fsync == AOF_FSYNC_ALWAYS)
+        {
+            AofHeld held;
+            held.msg = m;
+            g_data.aof_held.push_back(held);
+            continue;
+        }
+        shard_send(self, m->src, m);
     }
-    uint32_t wlen = (uint32_t)out.size();
-    // the first thing in the write buff is the length of response(EXCEPT FOR ITSELF)
-    // put the result's length and result in the write buffer
-    memcpy(&conn->wbuf[0], &wlen, 4);
-    memcpy(&conn->wbuf[4], out.data(), out.size());
-    conn->wbuf_size = wlen + 4;
+}
 
-    // remove this request from the read buffer
-    size_t remain_bytes = conn->rbuf_size - len - 4;
-    if (remain_bytes > 0)
+// send what waited for the fsync of its batch
+static void aof_release()
+{
+    uint64_t synced = aof_synced();
+    std::vector<AofHeld> done;
+    size_t keep = 0;
+    for (AofHeld &held : g_data.aof_held)
+    {
+        if (held.ticket == 0 || held.ticket > synced)
+        {
+            g_data.aof_held[keep++] = held;
+        }
+        else
+        {
+            done.push_back(held);
+        }
+    }
+    g_data.aof_held.resize(keep);
+    // in order, a connection can be held again by its next requests
+    for (AofHeld &held : done)
     {
-        memmove(conn->rbuf, &conn->rbuf[len + 4], remain_bytes);
+        if (held.msg)
+        {
+            shard_send(g_data.shard, held.msg->src, held.msg);
+            continue;
+        }
+        Conn *conn = held.conn;
+        conn->aof_wait = false;
+        if (conn->state == STATE_END)
+        {
+            conn_close(conn);
+            continue;
+        }
+        conn->state = STATE_RES;
+        if (!g_config.uring)
+        {
+            state_res(conn);
+            handle_requests(conn);
+        }
+        conn_rearm(conn);
     }
-    conn->rbuf_size = remain_bytes;
+}
 
-    // change state
-    conn->state = STATE_RES;
-    state_res(conn);
+// group commit: the commands logged in this loop iteration, in one write
+static void aof_flush()
+{
+    if (!g_config.aof_file)
+    {
+        return;
+    }
+    if (!g_data.aof_buf.empty())
+    {
+        uint64_t ticket = aof_write(g_data.aof_buf.data(), g_data.aof_buf.size());
+        if (ticket == 0)
+        {
+            die("aof_write");
+        }
+        g_data.aof_ticket = ticket;
+        g_data.aof_buf.clear();
+        if (aof_size() >= g_save.aof_auto_size.load(std::memory_order_relaxed) && save_request(true))
+        {
+            log_info("bgrewriteaof: the log has grown to %llu bytes", (unsigned long long)aof_size());
+        }
+        if (g_data.aof_buf.capacity() > k_wbuf_batch)
+        {
+            // a big ZADD doesn't keep its copy
+            std::string().swap(g_data.aof_buf);
+        }
+    }
+    // the responses so far are in this batch, or in one written before
+    for (AofHeld &held : g_data.aof_held)
+    {
+        if (held.ticket == 0)
+        {
+            held.ticket = g_data.aof_ticket;
+        }
+    }
+    if (!g_data.aof_held.empty())
+    {
+        aof_release();
+    }
+}
 
-    // continue the outer loop if the request was fully processed
-    return (conn->state == STATE_REQ);
+// called by the fsync thread
+static void aof_notify()
+{
+    for (uint32_t i = 0; i < g_config.shards; ++i)
+    {
+        shard_wake(i);
+    }
 }
-static bool try_fill_buffer(Conn *conn)
+
+// the wait timeout of the event loop
+static int loop_timeout_ms()
 {
-    assert(conn->rbuf_size < sizeof(conn->rbuf));
-    // number of bytes received
-    ssize_t rv = 0;
-    do
+    // an inbox was full, try again soon
+    if (shard_flush(g_data.shard))
     {
-        // sizeof is a compile-time operator, it will return the size of the total array, i.e. the max array size
-        size_t cap = sizeof(conn->rbuf) - conn->rbuf_size;
-        rv = recv(conn->fd, &conn->rbuf[conn->rbuf_size], cap, 0);
-    } while (rv < 0 && errno == EINTR); // The receive was interrupted by delivery of a signal before any data was available
+        return 1;
+    }
+    // more keys to expire or objects to collect, just check for IO in between
+    if (g_data.expiry_pending || g_data.collect_pending || !g_data.aof_buf.empty())
+    {
+        return 0;
+    }
+    uint32_t timeout_ms = next_timer_ms();
+    if (g_data.save_child >= 0 && timeout_ms > k_save_poll_ms)
+    {
+        timeout_ms = k_save_poll_ms;
+    }
+    return (int)timeout_ms;
+}
 
-    // in non-blocking mode, if there's nothing to read, the value -1 is returned and errno is set to EAGAIN
-    if (rv < 0 && errno == EAGAIN)
+#ifdef __linux__
+const uint32_t k_ur_entries = 4096;
+const uint32_t k_ur_nbufs = 1024;
+const uint32_t k_ur_buf_size = 4096;
+
+// submit the request the connection's state asks for
+static void uring_arm(Conn *conn)
+{
+    URing *ur = &g_data.ring;
+    uint64_t ud = (uint64_t)conn;
+    if (conn->state == STATE_RES && !(conn->ur_ops & UR_SEND))
+    {
+        size_t remain_bytes = conn->wbuf_size - conn->wbuf_sent;
+        if (!ur_send(ur, conn->fd, &conn->wbuf.data[conn->wbuf_sent], remain_bytes, ud | UR_SEND))
+        {
+            conn->state = STATE_END;
+            return;
+        }
+        conn->ur_ops |= UR_SEND;
+    }
+    if (conn->state == STATE_REQ && !(conn->ur_ops & UR_RECV) && !conn->ur_nobufs)
+    {
+        // the data lands in a provided buffer, rbuf is only needed when it completes
+        if (!ur_recv(ur, conn->fd, k_ur_buf_size, ud | UR_RECV))
+        {
+            conn->state = STATE_END;
+            return;
+        }
+        conn->ur_ops |= UR_RECV;
+    }
+}
+
+static void uring_on_recv(Conn *conn, const URCqe *cqe)
+{
+    uint16_t bid = 0;
+    bool has_buf = ur_cqe_buffer(cqe, &bid);
+    if (conn->state == STATE_END)
+    {
+        // closing, just waiting for the request to come back
+    }
+    else if (cqe->res == -ENOBUFS)
+    {
+        // ran out of provided buffers, it's submitted again when some are back
+        conn->ur_nobufs = true;
+        g_data.ur_starved.push_back(conn->fd);
+    }
+    else if (cqe->res == 0)
+    {
+        if (conn->rbuf_size > conn->rbuf_start)
+        {
+            msg("unexpected EOF");
+        }
+        conn->state = STATE_END;
+    }
+    else if (cqe->res < 0)
+    {
+        errno = -cqe->res;
+        msg("recv() error");
+        conn->state = STATE_END;
+    }
+    else if (has_buf)
+    {
+        if (rbuf_prepare(conn, cqe->res))
+        {
+            memcpy(&conn->rbuf.data[conn->rbuf_size], ur_buf(&g_data.ring, bid), cqe->res);
+            conn->rbuf_size += cqe->res;
+            conn_touch(conn);
+            handle_requests(conn);
+            rbuf_shrink(conn);
+        }
+        else
+        {
+            msg("out of memory");
+            conn->state = STATE_END;
+        }
+    }
+    if (has_buf)
+    {
+        ur_recycle_buf(&g_data.ring, bid);
+    }
+}
+
+static void uring_on_send(Conn *conn, const URCqe *cqe)
+{
+    if (conn->state == STATE_END)
+    {
+        return;
+    }
+    if (cqe->res < 0)
+    {
+        errno = -cqe->res;
+        msg("send() error");
+        conn->state = STATE_END;
+        return;
+    }
+    conn_touch(conn);
+    conn->wbuf_sent += (size_t)cqe->res;
+    if (conn->wbuf_sent == conn->wbuf_size)
+    {
+        conn->wbuf_sent = 0;
+        conn->wbuf_size = 0;
+        buf_release(&conn->wbuf);
+        conn->state = STATE_REQ;
+        // handle the pipelined requests left in rbuf
+        handle_requests(conn);
+    }
+}
+
+// the recvs that found no buffer go again once some were given back. the
+// buffers of the completions are given back in the same loop iteration, so
+// if none was, the kernel has some, or the completions that used them are on
+// their way.
+static void uring_rearm_starved()
+{
+    URing *ur = &g_data.ring;
+    bool returned = ur->recycled != g_data.ur_recycled;
+    g_data.ur_recycled = ur->recycled;
+    if (!returned || g_data.ur_starved.empty())
+    {
+        return;
+    }
+    std::vector<int> fds;
+    fds.swap(g_data.ur_starved);
+    for (int fd : fds)
     {
-        return false;
+        // closed meanwhile, maybe the fd of another connection now
+        Conn *conn = (size_t)fd < g_data.fd2conn.size() ? g_data.fd2conn[fd] : NULL;
+        if (conn && conn->ur_nobufs)
+        {
+            conn->ur_nobufs = false;
+            conn_rearm(conn);
+        }
     }
+}
 
-    // if other error
-    if (rv < 0)
+// the event loop of the io_uring backend.
+// all recv/send/accept of one iteration are submitted by a single syscall.
+static void uring_loop(int sockfd) __attribute__((noreturn));
+static void uring_loop(int sockfd)
+{
+    URing *ur = &g_data.ring;
+    if (!ur_accept(ur, sockfd, g_data.ur_multishot, UR_ACCEPT) ||
+        !ur_poll(ur, g_data.shard->wake_rfd, UR_WAKE))
     {
-        msg("read() error");
-        conn->state = STATE_END;
-        return false;
+        die("ur_accept");
     }
-
-    // EOF met. When a stream socket peer has performed an orderly shutdown
-    if (rv == 0)
+    while (1)
     {
-        if (conn->rbuf_size > 0)
+        int timeout_ms = loop_timeout_ms();
+        if (ur_submit_and_wait(ur, timeout_ms) < 0)
         {
-            msg("unexpected EOF");
+            die("io_uring_enter");
         }
-        else
+        URCqe cqe;
+        while (ur_pop_cqe(ur, &cqe))
         {
-            // normal EOF
+            uint32_t op = cqe.user_data & 7;
+            Conn *conn = (Conn *)(cqe.user_data & ~(uint64_t)7);
+            if (op == UR_ACCEPT)
+            {
+                if (cqe.res >= 0)
+                {
+                    g_data.accept_failing = false;
+                    conn = conn_new(g_data.fd2conn, cqe.res);
+                    if (conn)
+                    {
+                        uring_arm(conn);
+                    }
+                }
+                if (cqe.res == -EINVAL && g_data.ur_multishot)
+                {
+                    // no multishot accept before 5.19, rearm it after every accept
+                    g_data.ur_multishot = false;
+                }
+                if ((cqe.res == -EMFILE || cqe.res == -ENFILE || cqe.res == -ENOBUFS || cqe.res == -ENOMEM) &&
+                    !ur_cqe_more(&cqe))
+                {
+                    errno = -cqe.res;
+                    accept_pause();
+                    continue;
+                }
+                if (!ur_cqe_more(&cqe))
+                {
+                    (void)ur_accept(ur, sockfd, g_data.ur_multishot, UR_ACCEPT);
+                }
+                continue;
+            }
+            if (op == UR_WAKE)
+            {
+                shard_clear_wake(g_data.shard);
+                (void)ur_poll(ur, g_data.shard->wake_rfd, UR_WAKE);
+                continue;
+            }
+            conn->ur_ops &= ~op;
+            if (op == UR_RECV)
+            {
+                uring_on_recv(conn, &cqe);
+            }
+            else
+            {
+                uring_on_send(conn, &cqe);
+            }
+            conn_rearm(conn);
         }
-        conn->state = STATE_END;
-        return false;
-    }
-    conn->rbuf_size += rv;
-
-    while (try_one_request(conn))
-    {
+        uring_rearm_starved();
+        process_msgs();
+        aof_flush();
+        process_timers();
+        process_expiry();
+        // the objects freed by the lazyfree thread
+        g_data.collect_pending = slab_collect(k_collect_work);
+        // BGSAVE
+        save_reap();
+        save_checkpoint();
     }
-    return false;
 }
 
-static void state_req(Conn *conn)
+// io_uring needs 5.11+ for the wait timeout
+static bool uring_init()
 {
-    while (try_fill_buffer(conn))
+    URing *ur = &g_data.ring;
+    if (!ur_init(ur, k_ur_entries) || !ur_setup_bufs(ur, 0, k_ur_nbufs, k_ur_buf_size))
     {
+        ur_close(ur);
+        return false;
     }
+    return true;
 }
+#endif
 
-static void connection_io(Conn *conn)
+// the listening fds, either one shared by all shards or one per shard (--reuseport).
+// a connection stays on the shard that accepted it.
+static std::vector<int> g_listen_fds;
+
+static void event_loop(int sockfd) __attribute__((noreturn));
+static void event_loop(int sockfd)
 {
-    conn->idle_start = get_monotonic_usec();
-    dlist_detach(&conn->idle_list);
-    dlist_insert_before(&g_data.idle_list, &conn->idle_list);
-    if (conn->state == STATE_REQ)
+    if (!np_init(&g_data.poller, g_config.backend, g_config.edge))
     {
-        state_req(conn);
+        die("np_init");
     }
-    else if (conn->state == STATE_RES)
+    if (!np_add(&g_data.poller, sockfd, NP_IN) ||
+        !np_add(&g_data.poller, g_data.shard->wake_rfd, NP_IN))
     {
-        state_res(conn);
+        die("np_add");
     }
-    else
+
+    const int k_max_events = 256;
+    NPEvent events[k_max_events];
+    while (1)
     {
-        assert(0);
+        // wait for active fds
+        int timeout_ms = loop_timeout_ms();
+        int rv = np_wait(&g_data.poller, events, k_max_events, timeout_ms);
+        if (rv < 0)
+        {
+            die("np_wait");
+        }
+        bool accept_ready = false;
+        // process active fds (except for the listening fd)
+        for (int i = 0; i < rv; ++i)
+        {
+            if (events[i].fd == sockfd)
+            {
+                accept_ready = true;
+                continue;
+            }
+            if (events[i].fd == g_data.shard->wake_rfd)
+            {
+                shard_clear_wake(g_data.shard);
+                continue;
+            }
+            Conn *conn = g_data.fd2conn[events[i].fd];
+            if (!conn)
+            {
+                continue;
+            }
+            connection_io(conn);
+            if (conn->state == STATE_END)
+            {
+                conn_close(conn);
+            }
+            else
+            {
+                conn_update_events(conn);
+            }
+        }
+        // requests and replies from other shards
+        process_msgs();
+        // the commands logged by both
+        aof_flush();
+        // handle timers
+        process_timers();
+        process_expiry();
+        // the objects freed by the lazyfree thread
+        g_data.collect_pending = slab_collect(k_collect_work);
+        // BGSAVE
+        save_reap();
+        save_checkpoint();
+
+        // try to accept new connections if the listening fd is active.
+        // accept until EAGAIN, a connection storm shouldn't take one iteration per client
+        // (and edge-triggered won't notify us again anyway).
+        if (accept_ready)
+        {
+            while (accept_new_conn(g_data.fd2conn, sockfd) == 0)
+            {
+            }
+        }
     }
 }
 
-static void conn_put(std::vector<Conn *> &fd2conn, struct Conn *conn)
+// a shard runs the commands of the log for its keys, nothing is logged again
+static void aof_replay()
 {
-    // if fd2conn's size isn't enough, resize it
-    if (fd2conn.size() <= (size_t)conn->fd)
+    AofLog &log = g_load.aof;
+    std::vector<std::string_view> &cmd = g_data.cmd;
+    Buffer buf;
+    uint64_t n = 0;
+    g_data.aof_replaying = true;
+    for (size_t pos = 0; pos < log.size;)
     {
-        fd2conn.resize(conn->fd + 1);
+        uint32_t len = 0;
+        memcpy(&len, &log.data[pos], 4);
+        cmd.clear();
+        if (len < 4 || 0 != parse_req(&log.data[pos + 4], len, cmd) || cmd.empty())
+        {
+            load_fail(g_config.aof_file, "a bad command in the log");
+        }
+        pos += 4 + len;
+        if (cmd_shard(cmd) != (int32_t)g_data.shard->id)
+        {
+            continue;
+        }
+        Out out;
+        out_init(out, &buf, 0);
+        do_request(cmd, out);
+        n++;
     }
-    fd2conn[conn->fd] = conn;
+    g_data.aof_replaying = false;
+    buf_release(&buf);
+    g_load.replayed.fetch_add(n, std::memory_order_relaxed);
 }
 
-// listening fd try to accept new client connections, then put those connections in fd2conn array
-uint32_t accept_new_conn(std::vector<Conn *> &fd2conn, int fd)
+// a new log starts with the keys of the snapshot, or they'd be lost
+// on the next restart, which replays the log only
+static void aof_dump_db()
 {
-    socklen_t sin_size;
-    struct sockaddr_storage their_addr;
-    sin_size = sizeof their_addr;
-    int connfd = accept(fd, (struct sockaddr *)&their_addr, &sin_size);
-    if (connfd == -1)
+    AofDumpCtx ctx;
+    ctx.now_ms = get_monotonic_msec();
+    ctx.wall_ms = get_wall_msec();
+    ctx.heap = &g_data.heap;
+    hm_foreach(&g_data.db, &cb_aof_dump, &ctx);
+    aof_dump_write(&ctx);
+}
+
+// the shards wait for each other, so all the data is there for the first request
+static void start_wait()
+{
+    std::unique_lock<std::mutex> lock(g_load.mu);
+    if (++g_load.started < g_config.shards)
     {
-        die("accept() error");
+        g_load.cv.wait(lock, [] { return g_load.started == g_config.shards; });
+        return;
     }
-    // set the new fd to non-blocking mode
-    fd_set_nb(connfd);
-    struct Conn *conn = (struct Conn *)malloc(sizeof(struct Conn));
-    if (!conn)
+    g_load.cv.notify_all();
+    if (g_config.aof_file)
     {
-        close(connfd);
-        return -1;
+        g_save.aof_auto_size = aof_auto_size(aof_size());
+    }
+    uint64_t ms = (get_monotonic_usec() - g_load.start_us) / 1000;
+    if (g_load.aof_found)
+    {
+        aof_unmap(&g_load.aof);
+        log_info("replayed %llu commands from %s in %llu ms",
+                 (unsigned long long)g_load.replayed.load(), g_config.aof_file,
+                 (unsigned long long)ms);
+    }
+    else if (!g_load.loaders.empty())
+    {
+        uint64_t nrecords = 0, nexpired = 0;
+        for (Loader &ld : g_load.loaders)
+        {
+            nrecords += ld.nrecords;
+            nexpired += ld.nexpired;
+        }
+        log_info("loaded %llu keys from %s in %llu ms (%llu ms decoding with %zu threads), "
+                 "%llu of them expired",
+                 (unsigned long long)nrecords, g_config.dbfile, (unsigned long long)ms,
+                 (unsigned long long)(g_load.decode_us / 1000), g_load.loaders.size(),
+                 (unsigned long long)nexpired);
     }
-    conn->fd = connfd;
-    conn->state = STATE_REQ;
-    conn->rbuf_size = 0;
-    conn->wbuf_size = 0;
-    conn->wbuf_sent = 0;
-    conn->idle_start = get_monotonic_usec();
-    dlist_insert_before(&g_data.idle_list, &conn->idle_list);
-    conn_put(g_data.fd2conn, conn);
-    return 0;
-}
-static void conn_done(Conn *conn)
-{
-    g_data.fd2conn[conn->fd] = NULL;
-    (void)close(conn->fd);
-    dlist_detach(&conn->idle_list);
-    free(conn);
 }
 
-static uint32_t next_timer_ms()
+// the thread of one shard, with its own event loop, connections and keys
+static void *shard_main(void *arg)
 {
-    if (dlist_empty(&g_data.idle_list))
+    g_data.shard = (Shard *)arg;
+    g_dbs[g_data.shard->id].db = &g_data.db;
+    g_dbs[g_data.shard->id].heap = &g_data.heap;
+    if (g_load.aof_found)
     {
-        return 10000; // no timer, the value doesn't matter
+        aof_replay();
     }
-
-    uint64_t now_us = get_monotonic_usec();
-    Conn *next = my_container_of(g_data.idle_list.next, Conn, idle_list);
-    uint64_t next_us = next->idle_start + k_idle_timeout_ms * 1000;
-    if (next_us <= now_us)
+    else
     {
-        // missed?
-        return 0;
+        adopt_loaded();
+        if (g_config.aof_file)
+        {
+            aof_dump_db();
+        }
+    }
+    start_wait();
+    tw_init(&g_data.timers, get_monotonic_msec());
+    int sockfd = g_listen_fds[g_config.reuseport ? g_data.shard->id : 0];
+    g_data.listen_fd = sockfd;
+#ifdef __linux__
+    if (g_config.uring)
+    {
+        // the main thread has set up its ring already
+        if (g_data.ring.fd < 0 && !uring_init())
+        {
+            die("uring_init");
+        }
+        uring_loop(sockfd);
     }
+#endif
+    event_loop(sockfd);
+}
 
-    return (uint32_t)((next_us - now_us) / 1000);
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [--backend poll|epoll|uring] [--edge] [--shards N]\n"
+                    "       [--reuseport] [--backlog N] [--max-msg BYTES]\n"
+                    "       [--idle-timeout remote|local MS]...\n"
+                    "       [--zset-pack members|name N]...\n"
+                    "       [--dbfile PATH] [--load-threads N]\n"
+                    "       [--appendonly PATH] [--appendfsync always|everysec|no]\n"
+                    "       [--auto-aof-rewrite-percentage N] [--auto-aof-rewrite-min-size BYTES]\n", prog);
+    exit(1);
 }
-static void process_timers()
+
+static void parse_args(int argc, char **argv)
 {
-    uint64_t now_us = get_monotonic_usec();
-    while (!dlist_empty(&g_data.idle_list))
+    for (int i = 1; i < argc; ++i)
     {
-        Conn *next = my_container_of(g_data.idle_list.next, Conn, idle_list);
-        uint64_t next_us = next->idle_start + k_idle_timeout_ms * 1000;
-        if (next_us >= now_us + 1000)
+        if (0 == strcmp(argv[i], "--backend") && i + 1 < argc)
         {
-            // not ready, the extra 1000us is for the ms resolution of poll()
-            break;
+            const char *name = argv[++i];
+            if (0 == strcmp(name, "poll"))
+            {
+                g_config.backend = NP_BACKEND_POLL;
+            }
+            else if (0 == strcmp(name, "uring"))
+            {
+#ifdef __linux__
+                g_config.uring = true;
+#else
+                fprintf(stderr, "io_uring is not available, using poll\n");
+#endif
+            }
+            else if (0 == strcmp(name, "epoll"))
+            {
+#ifdef __linux__
+                g_config.backend = NP_BACKEND_EPOLL;
+#else
+                fprintf(stderr, "epoll is not available, using poll\n");
+#endif
+            }
+            else
+            {
+                usage(argv[0]);
+            }
+        }
+        else if (0 == strcmp(argv[i], "--edge"))
+        {
+            g_config.edge = true;
+        }
+        else if (0 == strcmp(argv[i], "--shards") && i + 1 < argc)
+        {
+            int n = atoi(argv[++i]);
+            if (n < 1 || n > 256)
+            {
+                usage(argv[0]);
+            }
+            g_config.shards = (uint32_t)n;
+        }
+        else if (0 == strcmp(argv[i], "--reuseport"))
+        {
+#ifdef SO_REUSEPORT
+            g_config.reuseport = true;
+#else
+            fprintf(stderr, "SO_REUSEPORT is not available, using one listener\n");
+#endif
+        }
+        else if (0 == strcmp(argv[i], "--max-msg") && i + 1 < argc)
+        {
+            long long n = atoll(argv[++i]);
+            if (n < 1024 || n > INT32_MAX)
+            {
+                usage(argv[0]);
+            }
+            g_config.max_msg = (size_t)n;
+        }
+        else if (0 == strcmp(argv[i], "--idle-timeout") && i + 2 < argc)
+        {
+            // 0 turns it off for the class
+            const char *name = argv[++i];
+            long long ms = atoll(argv[++i]);
+            uint32_t cls = 0;
+            while (cls < CLIENT_NCLASS && 0 != strcmp(name, k_client_class_names[cls]))
+            {
+                cls++;
+            }
+            if (cls == CLIENT_NCLASS || ms < 0)
+            {
+                usage(argv[0]);
+            }
+            g_config.idle_timeout_ms[cls] = (uint64_t)ms;
+        }
+        else if (0 == strcmp(argv[i], "--zset-pack") && i + 2 < argc)
+        {
+            // the limits of the packed zsets, 0 members to never pack
+            const char *name = argv[++i];
+            long long n = atoll(argv[++i]);
+            if (n < 0 || n > 1000000)
+            {
+                usage(argv[0]);
+            }
+            if (0 == strcmp(name, "members"))
+            {
+                g_zset_limits.pack_members = (uint32_t)n;
+            }
+            else if (0 == strcmp(name, "name"))
+            {
+                g_zset_limits.pack_name = (uint32_t)n;
+            }
+            else
+            {
+                usage(argv[0]);
+            }
+        }
+        else if (0 == strcmp(argv[i], "--dbfile") && i + 1 < argc)
+        {
+            g_config.dbfile = argv[++i];
+        }
+        else if (0 == strcmp(argv[i], "--load-threads") && i + 1 < argc)
+        {
+            int n = atoi(argv[++i]);
+            if (n < 1 || n > 1024)
+            {
+                usage(argv[0]);
+            }
+            g_config.load_threads = (uint32_t)n;
+        }
+        else if (0 == strcmp(argv[i], "--appendonly") && i + 1 < argc)
+        {
+            g_config.aof_file = argv[++i];
+        }
+        else if (0 == strcmp(argv[i], "--appendfsync") && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            if (0 == strcmp(name, "always"))
+            {
+                g_config.aof_fsync = AOF_FSYNC_ALWAYS;
+            }
+            else if (0 == strcmp(name, "everysec"))
+            {
+                g_config.aof_fsync = AOF_FSYNC_EVERYSEC;
+            }
+            else if (0 == strcmp(name, "no"))
+            {
+                g_config.aof_fsync = AOF_FSYNC_NO;
+            }
+            else
+            {
+                usage(argv[0]);
+            }
+        }
+        else if (0 == strcmp(argv[i], "--auto-aof-rewrite-percentage") && i + 1 < argc)
+        {
+            int n = atoi(argv[++i]);
+            if (n < 0)
+            {
+                usage(argv[0]);
+            }
+            g_config.aof_rewrite_pct = (uint32_t)n;
+        }
+        else if (0 == strcmp(argv[i], "--auto-aof-rewrite-min-size") && i + 1 < argc)
+        {
+            g_config.aof_rewrite_min = strtoull(argv[++i], NULL, 10);
+        }
+        else if (0 == strcmp(argv[i], "--backlog") && i + 1 < argc)
+        {
+            g_config.backlog = atoi(argv[++i]);
+            if (g_config.backlog < 1)
+            {
+                usage(argv[0]);
+            }
+        }
+        else
+        {
+            usage(argv[0]);
         }
-
-        printf("removing idle connection: %d\n", next->fd);
-        conn_done(next);
     }
 }
-int main(void)
+
+// bind and listen on PORT, exits on failure
+static int open_listener()
 {
-    dlist_init(&g_data.idle_list);
-    int sockfd, new_fd; // listen on sock_fd, new connection on new_fd
+    int sockfd = -1;
     struct addrinfo hints, *servinfo, *p;
-    struct sockaddr_storage their_addr; // connector's address information
-    socklen_t sin_size;
-    struct sigaction sa;
     int yes = 1;
-    char s[INET6_ADDRSTRLEN];
     int rv;
 
     memset(&hints, 0, sizeof hints);
@@ -866,7 +4020,7 @@ int main(void)
     if ((rv = getaddrinfo(NULL, PORT, &hints, &servinfo)) != 0)
     {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
-        return 1;
+        exit(1);
     }
 
     // loop through all the results and bind to the first we can
@@ -885,6 +4039,15 @@ int main(void)
             perror("setsockopt");
             exit(1);
         }
+#ifdef SO_REUSEPORT
+        // every shard binds its own socket to the port, the kernel spreads new connections among them
+        if (g_config.reuseport &&
+            setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1)
+        {
+            perror("setsockopt");
+            exit(1);
+        }
+#endif
 
         if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1)
         {
@@ -904,71 +4067,103 @@ int main(void)
         exit(1);
     }
 
-    if (listen(sockfd, BACKLOG) == -1)
+    if (listen(sockfd, g_config.backlog) == -1)
     {
         perror("listen");
         exit(1);
     }
 
-    printf("server: waiting for connections...\n");
-
     // set the listen fd to nonblocking mode
     fd_set_nb(sockfd);
+    return sockfd;
+}
 
-    // TODO: implement epoll.
-    std::vector<struct pollfd> poll_args;
-    while (1)
+// a random hash seed per process. every shard uses the same one,
+// since a key is routed to its shard by the hash.
+static void init_hash_seed()
+{
+    uint64_t seed = 0;
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || read(fd, &seed, sizeof(seed)) != sizeof(seed))
+    {
+        seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+    }
+    if (fd >= 0)
     {
-        // prepare the arguments of the poll()
-        poll_args.clear();
-        // the listening fd is put in the first position
-        struct pollfd pfd = {sockfd, POLLIN, 0};
+        close(fd);
+    }
+    g_hash_seed = seed;
+}
 
-        poll_args.push_back(pfd);
-        // deal with connection fds; Af first, fd2conn is empty
-        for (Conn *conn : g_data.fd2conn)
-        {
-            if (!conn)
-            {
-                continue;
-            }
-            // once meet a connection, add it to the poll array
-            struct pollfd pfd = {};
-            pfd.fd = conn->fd;
-            pfd.events = (conn->state == STATE_REQ) ? POLLIN : POLLOUT;
-            // 添加POLLERR状态，代表同时监听错误状态
-            pfd.events = pfd.events | POLLERR;
-            poll_args.push_back(pfd);
-        }
-        // poll for active fds
-        int timeout_ms = (int)next_timer_ms();
-        int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), timeout_ms);
-        if (rv < 0)
+int main(int argc, char **argv)
+{
+    parse_args(argc, argv);
+    // a client can go away with responses pending, don't die on send()
+    signal(SIGPIPE, SIG_IGN);
+    init_hash_seed();
+
+    // all listeners are bound before any shard starts accepting
+    uint32_t nlisten = g_config.reuseport ? g_config.shards : 1;
+    for (uint32_t i = 0; i < nlisten; ++i)
+    {
+        g_listen_fds.push_back(open_listener());
+    }
+
+    log_info("server: waiting for connections...");
+
+#ifdef __linux__
+    // find out on the main thread, so all shards use the same backend
+    if (g_config.uring && !uring_init())
+    {
+        fprintf(stderr, "io_uring is not supported, falling back to %s\n",
+                g_config.backend == NP_BACKEND_EPOLL ? "epoll" : "poll");
+        g_config.uring = false;
+    }
+#endif
+    if (!shards_init(g_config.shards))
+    {
+        die("shards_init");
+    }
+    // the keys are hashed to their shards, after the seed and the shards are set
+    g_dbs.resize(g_config.shards);
+    // with a log, it has the latest data, the snapshot is only read to start one
+    g_load.start_us = get_monotonic_usec();
+    if (g_config.aof_file)
+    {
+        const char *err = aof_map(&g_load.aof, g_config.aof_file);
+        if (err && errno != ENOENT)
         {
-            die("poll");
+            load_fail(g_config.aof_file, err);
         }
-        // process active fds (except for the listening fd)
-        for (size_t i = 1; i < poll_args.size(); ++i)
+        g_load.aof_found = !err;
+        if (g_load.aof.tail)
         {
-            if (poll_args[i].revents)
+            // a write cut short by a crash, its reply was never sent
+            log_warn("%s: dropping the last %zu bytes, an incomplete command",
+                     g_config.aof_file, g_load.aof.tail);
+            if (0 != truncate(g_config.aof_file, (off_t)g_load.aof.size))
             {
-                Conn *conn = g_data.fd2conn[poll_args[i].fd];
-                connection_io(conn);
-                if (conn->state == STATE_END)
-                {
-                    conn_done(conn);
-                }
+                load_fail(g_config.aof_file, strerror(errno));
             }
         }
-        // handle timers
-        process_timers();
-
-        // try to accept new connections if the listening fd is active
-        if (poll_args[0].revents)
+    }
+    if (!g_load.aof_found)
+    {
+        load_snapshot(g_config.dbfile);
+    }
+    if (g_config.aof_file && !aof_open(g_config.aof_file, g_config.aof_fsync, &aof_notify))
+    {
+        load_fail(g_config.aof_file, strerror(errno));
+    }
+    // shard 0 runs on the main thread
+    for (uint32_t i = 1; i < g_config.shards; ++i)
+    {
+        pthread_t tid;
+        if (0 != pthread_create(&tid, NULL, &shard_main, shard_get(i)))
         {
-            (void)accept_new_conn(g_data.fd2conn, sockfd);
+            die("pthread_create");
         }
     }
-    close(sockfd);
+    shard_main(shard_get(0));
     return 0;
 }
@@ -0,0 +1,147 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include "shard.h"
+
+const size_t k_inbox_size = 4096;
+
+static std::vector<Shard *> g_shards;
+
+static bool wake_init(Shard *shard)
+{
+#ifdef __linux__
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    shard->wake_rfd = shard->wake_wfd = fd;
+    return fd >= 0;
+#else
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        return false;
+    }
+    for (int fd : fds)
+    {
+        (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    shard->wake_rfd = fds[0];
+    shard->wake_wfd = fds[1];
+    return true;
+#endif
+}
+
+// create all shards before any of their threads starts
+bool shards_init(uint32_t n)
+{
+    assert(g_shards.empty() && n > 0);
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        Shard *shard = new Shard();
+        shard->id = i;
+        if (!wake_init(shard))
+        {
+            return false;
+        }
+        for (uint32_t j = 0; j < n; ++j)
+        {
+            SPSCQueue *q = new SPSCQueue();
+            spsc_init(q, k_inbox_size);
+            shard->inbox.push_back(q);
+        }
+        shard->backlog.resize(n);
+        shard->dirty.resize(n, false);
+        g_shards.push_back(shard);
+    }
+    return true;
+}
+
+uint32_t shard_count()
+{
+    return (uint32_t)g_shards.size();
+}
+
+Shard *shard_get(uint32_t id)
+{
+    return g_shards[id];
+}
+
+uint32_t shard_of(uint64_t hcode)
+{
+    // use other bits than the hashtables, which index by the low bits
+    uint64_t h = hcode * 0x9E3779B97F4A7C15ull;
+    return (uint32_t)((h >> 32) % g_shards.size());
+}
+
+void shard_send(Shard *self, uint32_t dst, void *msg)
+{
+    assert(dst != self->id);
+    std::vector<void *> &backlog = self->backlog[dst];
+    // keep the order if there's a backlog already
+    if (!backlog.empty() || !spsc_push(g_shards[dst]->inbox[self->id], msg))
+    {
+        backlog.push_back(msg);
+    }
+    self->dirty[dst] = true;
+}
+
+bool shard_flush(Shard *self)
+{
+    bool pending = false;
+    for (uint32_t dst = 0; dst < g_shards.size(); ++dst)
+    {
+        std::vector<void *> &backlog = self->backlog[dst];
+        size_t i = 0;
+        while (i < backlog.size() && spsc_push(g_shards[dst]->inbox[self->id], backlog[i]))
+        {
+            i++;
+        }
+        backlog.erase(backlog.begin(), backlog.begin() + i);
+        pending = pending || !backlog.empty();
+        if (!self->dirty[dst])
+        {
+            continue;
+        }
+        // one write per receiver per loop iteration, no matter how many messages
+        self->dirty[dst] = !backlog.empty();
+        uint64_t one = 1;
+        ssize_t rv = write(g_shards[dst]->wake_wfd, &one, sizeof(one));
+        (void)rv; // EAGAIN: a wakeup is pending already
+    }
+    return pending;
+}
+
+void *shard_recv(Shard *self)
+{
+    size_t n = self->inbox.size();
+    for (size_t k = 0; k < n; ++k)
+    {
+        size_t i = (self->next_inbox + k) % n;
+        void *msg = spsc_pop(self->inbox[i]);
+        if (msg)
+        {
+            self->next_inbox = (i + 1) % n;
+            return msg;
+        }
+    }
+    return NULL;
+}
+
+void shard_wake(uint32_t id)
+{
+    uint64_t one = 1;
+    ssize_t rv = write(g_shards[id]->wake_wfd, &one, sizeof(one));
+    (void)rv; // EAGAIN: a wakeup is pending already
+}
+
+void shard_clear_wake(Shard *self)
+{
+    uint64_t buf[16];
+    while (read(self->wake_rfd, buf, sizeof(buf)) > 0)
+    {
+    }
+}
@@ -0,0 +1,411 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <vector>
+#include "slab.h"
+
+/*
+- a page is k_page_size bytes, aligned to its size, so the page of an
+  object is found by masking its address.
+- the page header takes the first cache line, then the objects.
+- a heap keeps, per size class, a list of its pages that have free objects.
+  a page that becomes empty is unmapped, unless it's the last one of its class.
+- a free from another thread pushes the object onto the owner heap's
+  remote list. the owner takes the whole list, and gives the objects back to
+  their pages a batch at a time, on its allocations and in slab_collect().
+  a thread that frees millions of objects at once doesn't stall the owner.
+- a detached heap has no thread, the one that adopts it collects its remote
+  frees along with its own.
+*/
+
+#ifdef USE_SLAB
+
+const size_t k_page_size = 64 * 1024;
+const size_t k_page_header = 64;
+const size_t k_class_step = 16;
+const size_t k_nclass = k_slab_max / k_class_step;
+// remote frees given back per allocation
+const size_t k_collect_batch = 64;
+
+struct SlabHeap;
+
+struct SlabPage
+{
+    SlabHeap *heap = NULL;
+    // in the heap's list of pages with free objects
+    SlabPage *prev = NULL;
+    SlabPage *next = NULL;
+    void *free = NULL;     // freed objects, linked through their first word
+    uint8_t *bump = NULL;  // objects never used start here
+    uint8_t *end = NULL;
+    uint32_t cls = 0;
+    uint32_t used = 0;
+};
+
+static_assert(sizeof(SlabPage) <= k_page_header, "page header");
+
+struct SlabHeap
+{
+    SlabPage *avail[k_nclass] = {};
+    std::atomic<void *> remote{NULL};
+    // taken from remote, not given back yet. only touched by the owner.
+    void *collected = NULL;
+    // written by the owner only, read by slab_stats()
+    std::atomic<size_t> live_objs{0};
+    std::atomic<size_t> live_bytes{0};
+    std::atomic<size_t> page_bytes{0};
+    // detached: no more allocations, every empty page is unmapped
+    bool retired = false;
+    // the detached heaps this one's owner has adopted
+    SlabHeap *adopted = NULL;
+};
+
+static std::atomic<size_t> g_large_objs{0};
+static std::atomic<size_t> g_large_bytes{0};
+
+// all heaps, for the stats. heaps are never freed.
+static std::mutex g_heaps_mu;
+static std::vector<SlabHeap *> g_heaps;
+
+static thread_local SlabHeap *t_heap = NULL;
+
+static SlabHeap *heap_get()
+{
+    if (!t_heap)
+    {
+        t_heap = new SlabHeap();
+        std::lock_guard<std::mutex> lock(g_heaps_mu);
+        g_heaps.push_back(t_heap);
+    }
+    return t_heap;
+}
+
+static void counter_add(std::atomic<size_t> &c, size_t n)
+{
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+static void counter_sub(std::atomic<size_t> &c, size_t n)
+{
+    c.store(c.load(std::memory_order_relaxed) - n, std::memory_order_relaxed);
+}
+
+static size_t class_of(size_t size)
+{
+    return size == 0 ? 0 : (size - 1) / k_class_step;
+}
+
+static size_t class_size(size_t cls)
+{
+    return (cls + 1) * k_class_step;
+}
+
+static SlabPage *page_of(void *ptr)
+{
+    return (SlabPage *)((uintptr_t)ptr & ~(uintptr_t)(k_page_size - 1));
+}
+
+static void page_link(SlabHeap *heap, SlabPage *page)
+{
+    page->prev = NULL;
+    page->next = heap->avail[page->cls];
+    if (page->next)
+    {
+        page->next->prev = page;
+    }
+    heap->avail[page->cls] = page;
+}
+
+static void page_unlink(SlabHeap *heap, SlabPage *page)
+{
+    if (page->prev)
+    {
+        page->prev->next = page->next;
+    }
+    else
+    {
+        heap->avail[page->cls] = page->next;
+    }
+    if (page->next)
+    {
+        page->next->prev = page->prev;
+    }
+    page->prev = page->next = NULL;
+}
+
+static SlabPage *page_new(SlabHeap *heap, size_t cls)
+{
+    // map twice the size, then trim it to an aligned page
+    size_t len = 2 * k_page_size;
+    uint8_t *p = (uint8_t *)mmap(NULL, len, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        return NULL;
+    }
+    uint8_t *start = (uint8_t *)(((uintptr_t)p + k_page_size - 1) & ~(uintptr_t)(k_page_size - 1));
+    if (start > p)
+    {
+        munmap(p, start - p);
+    }
+    if (p + len > start + k_page_size)
+    {
+        munmap(start + k_page_size, p + len - start - k_page_size);
+    }
+
+    SlabPage *page = new (start) SlabPage();
+    page->heap = heap;
+    page->cls = (uint32_t)cls;
+    page->bump = start + k_page_header;
+    page->end = start + k_page_header +
+                (k_page_size - k_page_header) / class_size(cls) * class_size(cls);
+    counter_add(heap->page_bytes, k_page_size);
+    return page;
+}
+
+static void page_free_obj(SlabHeap *heap, SlabPage *page, void *ptr)
+{
+    bool was_full = !page->free && page->bump == page->end;
+    *(void **)ptr = page->free;
+    page->free = ptr;
+    page->used--;
+    counter_sub(heap->live_objs, 1);
+    counter_sub(heap->live_bytes, class_size(page->cls));
+
+    if (was_full)
+    {
+        page_link(heap, page);
+    }
+    // give an empty page back, but keep one per class for the next allocation
+    if (page->used == 0 && (page->prev || page->next || heap->retired))
+    {
+        page_unlink(heap, page);
+        counter_sub(heap->page_bytes, k_page_size);
+        munmap(page, k_page_size);
+    }
+}
+
+// give back up to max objects freed by other threads.
+// returns true if there are more.
+static bool heap_collect(SlabHeap *heap, size_t max)
+{
+    if (!heap->collected)
+    {
+        heap->collected = heap->remote.exchange(NULL, std::memory_order_acquire);
+    }
+    for (size_t i = 0; i < max && heap->collected; i++)
+    {
+        void *ptr = heap->collected;
+        heap->collected = *(void **)ptr;
+        page_free_obj(heap, page_of(ptr), ptr);
+    }
+    return heap->collected || heap->remote.load(std::memory_order_relaxed);
+}
+
+bool slab_collect(size_t max)
+{
+    if (!t_heap)
+    {
+        return false;
+    }
+    bool more = heap_collect(t_heap, max);
+    for (SlabHeap *heap = t_heap->adopted; heap; heap = heap->adopted)
+    {
+        more = heap_collect(heap, max) || more;
+    }
+    return more;
+}
+
+SlabHeap *slab_detach()
+{
+    SlabHeap *heap = t_heap;
+    t_heap = NULL;
+    if (!heap)
+    {
+        return NULL;
+    }
+    heap->retired = true;
+    // the empty pages kept for the next allocation
+    for (size_t cls = 0; cls < k_nclass; cls++)
+    {
+        SlabPage *page = heap->avail[cls];
+        while (page)
+        {
+            SlabPage *next = page->next;
+            if (page->used == 0)
+            {
+                page_unlink(heap, page);
+                counter_sub(heap->page_bytes, k_page_size);
+                munmap(page, k_page_size);
+            }
+            page = next;
+        }
+    }
+    return heap;
+}
+
+void slab_adopt(SlabHeap *heap)
+{
+    if (!heap)
+    {
+        return;
+    }
+    // its own adopted heaps come along
+    SlabHeap *last = heap;
+    while (last->adopted)
+    {
+        last = last->adopted;
+    }
+    SlabHeap *self = heap_get();
+    last->adopted = self->adopted;
+    self->adopted = heap;
+}
+
+size_t slab_usable(size_t size)
+{
+    return size <= k_slab_max ? class_size(class_of(size)) : size;
+}
+
+void *slab_alloc(size_t size)
+{
+    if (size > k_slab_max)
+    {
+        g_large_objs.fetch_add(1, std::memory_order_relaxed);
+        g_large_bytes.fetch_add(size, std::memory_order_relaxed);
+        return malloc(size);
+    }
+    SlabHeap *heap = heap_get();
+    if (heap->collected || heap->remote.load(std::memory_order_relaxed))
+    {
+        heap_collect(heap, k_collect_batch);
+    }
+    size_t cls = class_of(size);
+    SlabPage *page = heap->avail[cls];
+    if (!page)
+    {
+        page = page_new(heap, cls);
+        if (!page)
+        {
+            return NULL;
+        }
+        page_link(heap, page);
+    }
+
+    void *ptr = NULL;
+    if (page->free)
+    {
+        ptr = page->free;
+        page->free = *(void **)ptr;
+    }
+    else
+    {
+        ptr = page->bump;
+        page->bump += class_size(cls);
+    }
+    page->used++;
+    if (!page->free && page->bump == page->end)
+    {
+        page_unlink(heap, page); // full
+    }
+    counter_add(heap->live_objs, 1);
+    counter_add(heap->live_bytes, class_size(cls));
+    return ptr;
+}
+
+void slab_free(void *ptr, size_t size)
+{
+    if (!ptr)
+    {
+        return;
+    }
+    if (size > k_slab_max)
+    {
+        g_large_objs.fetch_sub(1, std::memory_order_relaxed);
+        g_large_bytes.fetch_sub(size, std::memory_order_relaxed);
+        free(ptr);
+        return;
+    }
+    SlabPage *page = page_of(ptr);
+    assert(page->cls == class_of(size));
+    SlabHeap *heap = page->heap;
+    if (heap == t_heap)
+    {
+        page_free_obj(heap, page, ptr);
+        return;
+    }
+    // not ours, hand it to the owner
+    void *head = heap->remote.load(std::memory_order_relaxed);
+    do
+    {
+        *(void **)ptr = head;
+    } while (!heap->remote.compare_exchange_weak(
+        head, ptr, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void slab_stats(SlabStats *out)
+{
+    *out = SlabStats();
+    std::lock_guard<std::mutex> lock(g_heaps_mu);
+    for (SlabHeap *heap : g_heaps)
+    {
+        out->live_objs += heap->live_objs.load(std::memory_order_relaxed);
+        out->live_bytes += heap->live_bytes.load(std::memory_order_relaxed);
+        out->page_bytes += heap->page_bytes.load(std::memory_order_relaxed);
+    }
+    out->large_objs = g_large_objs.load(std::memory_order_relaxed);
+    out->large_bytes = g_large_bytes.load(std::memory_order_relaxed);
+}
+
+#else
+
+// everything from malloc, to compare against
+static std::atomic<size_t> g_large_objs{0};
+static std::atomic<size_t> g_large_bytes{0};
+
+size_t slab_usable(size_t size)
+{
+    return size;
+}
+
+void *slab_alloc(size_t size)
+{
+    g_large_objs.fetch_add(1, std::memory_order_relaxed);
+    g_large_bytes.fetch_add(size, std::memory_order_relaxed);
+    return malloc(size);
+}
+
+void slab_free(void *ptr, size_t size)
+{
+    if (ptr)
+    {
+        g_large_objs.fetch_sub(1, std::memory_order_relaxed);
+        g_large_bytes.fetch_sub(size, std::memory_order_relaxed);
+        free(ptr);
+    }
+}
+
+bool slab_collect(size_t)
+{
+    return false;
+}
+
+SlabHeap *slab_detach()
+{
+    return NULL;
+}
+
+void slab_adopt(SlabHeap *)
+{
+}
+
+void slab_stats(SlabStats *out)
+{
+    *out = SlabStats();
+    out->large_objs = g_large_objs.load(std::memory_order_relaxed);
+    out->large_bytes = g_large_bytes.load(std::memory_order_relaxed);
+}
+
+#endif // USE_SLAB
@@ -0,0 +1,290 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include "snapshot.h"
+
+// the size of the writes
+const size_t k_snap_buf = 1 << 20;
+
+static void write_all(SnapWriter *w, const uint8_t *data, size_t len)
+{
+    while (len > 0 && !w->failed)
+    {
+        ssize_t rv = write(w->fd, data, len);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv <= 0)
+        {
+            w->failed = true;
+            return;
+        }
+        data += rv;
+        len -= (size_t)rv;
+        w->bytes += (uint64_t)rv;
+    }
+}
+
+static void flush(SnapWriter *w)
+{
+    write_all(w, w->buf, w->used);
+    w->used = 0;
+}
+
+bool snap_create(SnapWriter *w, const char *path)
+{
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    w->buf = (uint8_t *)malloc(k_snap_buf);
+    w->used = 0;
+    w->bytes = 0;
+    w->failed = w->fd < 0 || !w->buf;
+    return !w->failed;
+}
+
+void snap_put(SnapWriter *w, const void *data, size_t len)
+{
+    if (w->used + len > k_snap_buf)
+    {
+        flush(w);
+    }
+    if (len >= k_snap_buf)
+    {
+        // a big value goes straight to the file
+        write_all(w, (const uint8_t *)data, len);
+        return;
+    }
+    memcpy(&w->buf[w->used], data, len);
+    w->used += len;
+}
+
+void snap_u8(SnapWriter *w, uint8_t v)
+{
+    snap_put(w, &v, 1);
+}
+
+void snap_u32(SnapWriter *w, uint32_t v)
+{
+    snap_put(w, &v, 4);
+}
+
+void snap_u64(SnapWriter *w, uint64_t v)
+{
+    snap_put(w, &v, 8);
+}
+
+void snap_record(SnapWriter *w)
+{
+    uint64_t pos = w->bytes + w->used;
+    if (w->chunks.empty() || pos - w->chunks.back() >= k_snap_chunk)
+    {
+        w->chunks.push_back(pos);
+    }
+}
+
+void snap_end(SnapWriter *w, uint64_t nrecords)
+{
+    snap_u8(w, SNAP_EOF);
+    snap_u64(w, nrecords);
+    for (uint64_t off : w->chunks)
+    {
+        snap_u64(w, off);
+    }
+    snap_u64(w, w->chunks.size());
+}
+
+bool sync_dir(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    std::string dir = !slash ? "." : slash == path ? "/" : std::string(path, slash - path);
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+bool snap_commit(SnapWriter *w, const char *tmp, const char *path)
+{
+    flush(w);
+    // the data is on disk before the new name points to it
+    w->failed = w->failed || fsync(w->fd) != 0;
+    w->failed = close(w->fd) != 0 || w->failed;
+    w->fd = -1;
+    free(w->buf);
+    w->buf = NULL;
+    if (w->failed || rename(tmp, path) != 0)
+    {
+        unlink(tmp);
+        return false;
+    }
+    return sync_dir(path);
+}
+
+void snap_abort(SnapWriter *w, const char *tmp)
+{
+    if (w->fd >= 0)
+    {
+        close(w->fd);
+    }
+    w->fd = -1;
+    free(w->buf);
+    w->buf = NULL;
+    unlink(tmp);
+}
+
+const uint8_t *snap_get(SnapCursor *c, size_t len)
+{
+    if (c->failed || (size_t)(c->end - c->pos) < len)
+    {
+        c->failed = true;
+        return NULL;
+    }
+    const uint8_t *p = c->pos;
+    c->pos += len;
+    return p;
+}
+
+uint8_t snap_get_u8(SnapCursor *c)
+{
+    const uint8_t *p = snap_get(c, 1);
+    return p ? *p : 0;
+}
+
+uint32_t snap_get_u32(SnapCursor *c)
+{
+    uint32_t v = 0;
+    const uint8_t *p = snap_get(c, 4);
+    if (p)
+    {
+        memcpy(&v, p, 4);
+    }
+    return v;
+}
+
+uint64_t snap_get_u64(SnapCursor *c)
+{
+    uint64_t v = 0;
+    const uint8_t *p = snap_get(c, 8);
+    if (p)
+    {
+        memcpy(&v, p, 8);
+    }
+    return v;
+}
+
+static uint64_t load_u64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+// the header is the magic, the version and the time
+const size_t k_snap_header = 16;
+
+const char *snap_map(SnapFile *f, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return strerror(errno);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return strerror(errno);
+    }
+    f->size = (size_t)st.st_size;
+    void *data = f->size ? mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd); // the mapping stays
+    if (data == MAP_FAILED)
+    {
+        const char *err = f->size ? strerror(errno) : "not a snapshot";
+        f->size = 0;
+        return err;
+    }
+    f->data = (const uint8_t *)data;
+    // the chunks are read in parallel, each from its start to its end
+    (void)madvise(data, f->size, MADV_WILLNEED);
+
+    const uint8_t *p = f->data;
+    uint32_t version = 0;
+    if (f->size < k_snap_header + 9 || memcmp(p, "SNAP", 4) != 0)
+    {
+        return "not a snapshot";
+    }
+    memcpy(&version, p + 4, 4);
+    f->time_ms = (int64_t)load_u64(p + 8);
+    // where SNAP_EOF is, and the chunks before it
+    size_t eof = 0;
+    std::vector<uint64_t> offs;
+    if (version == 1)
+    {
+        // one chunk
+        eof = f->size - 9;
+        offs.push_back(k_snap_header);
+    }
+    else if (version == k_snap_version)
+    {
+        uint64_t n = f->size >= k_snap_header + 17 ? load_u64(p + f->size - 8) : 0;
+        if (f->size < k_snap_header + 17 || n > (f->size - k_snap_header - 17) / 8)
+        {
+            return "bad index";
+        }
+        eof = f->size - 8 - 8 * n - 9;
+        for (uint64_t i = 0; i < n; i++)
+        {
+            offs.push_back(load_u64(p + eof + 9 + 8 * i));
+        }
+    }
+    else
+    {
+        return "unknown version";
+    }
+    if (p[eof] != SNAP_EOF)
+    {
+        return "no end of the records";
+    }
+    f->nrecords = load_u64(p + eof + 1);
+    for (size_t i = 0; i < offs.size(); i++)
+    {
+        uint64_t end = i + 1 < offs.size() ? offs[i + 1] : eof;
+        if (offs[i] < (i ? offs[i - 1] + 1 : k_snap_header) || offs[i] > end)
+        {
+            return "bad index";
+        }
+        SnapCursor c;
+        c.pos = p + offs[i];
+        c.end = p + end;
+        f->chunks.push_back(c);
+    }
+    if (f->chunks.empty() ? eof != k_snap_header : offs[0] != k_snap_header)
+    {
+        return "bad index";
+    }
+    return NULL;
+}
+
+void snap_unmap(SnapFile *f)
+{
+    if (f->data)
+    {
+        munmap((void *)f->data, f->size);
+    }
+    f->data = NULL;
+    f->size = 0;
+    f->chunks.clear();
+}
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <set>
+#include <vector>
 #include "avl.cpp" // lazy
 
 template <class P, class M>
@@ -197,6 +198,48 @@ static void test_remove(uint32_t sz)
     }
 }
 
+static void inorder(AVLNode *node, std::vector<AVLNode *> &out)
+{
+    if (!node)
+    {
+        return;
+    }
+    inorder(node->left, out);
+    out.push_back(node);
+    inorder(node->right, out);
+}
+
+// from every node by every offset, one past both ends included. the step
+// down into a subtree used to count the wrong side of the child.
+static void test_offset(uint32_t sz)
+{
+    Container c;
+    for (uint32_t i = 0; i < sz; ++i)
+    {
+        add(c, i);
+    }
+    std::vector<AVLNode *> nodes;
+    inorder(c.root, nodes);
+    assert(nodes.size() == sz);
+    for (int64_t i = 0; i < (int64_t)sz; ++i)
+    {
+        for (int64_t off = -i - 1; i + off <= (int64_t)sz; ++off)
+        {
+            AVLNode *node = avl_offset(nodes[i], off);
+            int64_t j = i + off;
+            if (j < 0 || j >= (int64_t)sz)
+            {
+                assert(!node);
+            }
+            else
+            {
+                assert(node == nodes[j]);
+            }
+        }
+    }
+    dispose(c);
+}
+
 int main()
 {
     Container c;
@@ -211,5 +254,33 @@ int main()
     }
 
     dispose(c);
+
+    // random insertion and deletion
+    ref.clear();
+    srand(1);
+    for (uint32_t i = 0; i < 2000; ++i)
+    {
+        uint32_t val = (uint32_t)rand() % 500;
+        if (ref.count(val))
+        {
+            assert(del(c, val));
+            ref.erase(val);
+        }
+        else
+        {
+            add(c, val);
+            ref.insert(val);
+        }
+        container_verify(c, ref);
+    }
+    dispose(c);
+
+    for (uint32_t i = 0; i < 100; ++i)
+    {
+        test_insert(i);
+        test_insert_dup(i);
+        test_remove(i);
+        test_offset(i);
+    }
     return 0;
 }
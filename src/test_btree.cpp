@@ -0,0 +1,320 @@
+// build with: g++ -std=c++17 -DUSE_BTREE -Iinclude src/test_btree.cpp
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include "slab.cpp"  // lazy
+#include "btree.cpp" // lazy
+
+typedef std::pair<double, std::string> Key;
+
+struct Container
+{
+    BTree tree;
+    std::map<Key, ZNode *> ref;
+};
+
+static ZNode *znode_new(const Key &key)
+{
+    ZNode *node = (ZNode *)calloc(1, sizeof(ZNode) + key.second.size());
+    node->score = key.first;
+    node->len = key.second.size();
+    memcpy(node->name, key.second.data(), node->len);
+    return node;
+}
+
+static void znode_del(ZNode *node)
+{
+    free(node);
+}
+
+static void add(Container &c, const Key &key)
+{
+    ZNode *node = znode_new(key);
+    bt_insert(&c.tree, node);
+    c.ref[key] = node;
+}
+
+static void del(Container &c, const Key &key)
+{
+    auto it = c.ref.find(key);
+    assert(it != c.ref.end());
+    bt_erase(&c.tree, it->second);
+    znode_del(it->second);
+    c.ref.erase(it);
+}
+
+// returns the depth of the leaves, which must all be the same
+static uint32_t node_verify(BNode *node, bool root, std::vector<BLeaf *> &leaves)
+{
+    assert(node->n <= k_bt_cap);
+    if (node->leaf)
+    {
+        BLeaf *leaf = (BLeaf *)node;
+        assert(root || node->n >= 1);
+        for (uint32_t i = 0; i < node->n; i++)
+        {
+            BKey key = key_of(leaf->keys.items[i]);
+            assert(leaf->keys.scores[i] == key.score);
+            assert(leaf->keys.prefixes[i] == key.prefix);
+            if (i > 0)
+            {
+                assert(key_cmp(key, &leaf->keys, i - 1) > 0);
+            }
+        }
+        leaves.push_back(leaf);
+        return 1;
+    }
+    BInner *inner = (BInner *)node;
+    assert(node->n >= 2);
+    uint32_t depth = 0;
+    for (uint32_t i = 0; i < node->n; i++)
+    {
+        BNode *kid = inner->kids[i];
+        uint32_t d = node_verify(kid, false, leaves);
+        assert(i == 0 || d == depth);
+        depth = d;
+        assert(inner->cnts[i] == node_count(kid));
+        if (i > 0)
+        {
+            // the key is the smallest item under the child, exactly
+            assert(inner->keys.items[i] == node_min(kid));
+            assert(inner->keys.scores[i] == node_min(kid)->score);
+            assert(inner->keys.prefixes[i] == key_of(node_min(kid)).prefix);
+        }
+    }
+    return depth + 1;
+}
+
+static void container_verify(Container &c)
+{
+    assert(c.tree.size == c.ref.size());
+    if (!c.tree.root)
+    {
+        assert(c.ref.empty());
+        return;
+    }
+    std::vector<BLeaf *> leaves;
+    node_verify(c.tree.root, true, leaves);
+    assert(node_count(c.tree.root) == c.ref.size());
+
+    // the leaf links visit the leaves of the tree in order
+    assert(!leaves.front()->prev && !leaves.back()->next);
+    for (size_t i = 0; i + 1 < leaves.size(); i++)
+    {
+        assert(leaves[i]->next == leaves[i + 1]);
+        assert(leaves[i + 1]->prev == leaves[i]);
+    }
+    auto it = c.ref.begin();
+    for (BLeaf *leaf : leaves)
+    {
+        for (uint32_t i = 0; i < leaf->base.n; i++, it++)
+        {
+            assert(leaf->keys.items[i] == it->second);
+        }
+    }
+    assert(it == c.ref.end());
+
+    // rank and at
+    uint64_t rank = 0;
+    for (auto &kv : c.ref)
+    {
+        assert(bt_rank(&c.tree, kv.second) == rank);
+        assert(bt_get(bt_at(&c.tree, rank)) == kv.second);
+        rank++;
+    }
+    assert(!bt_get(bt_at(&c.tree, rank)));
+}
+
+static void dispose(Container &c)
+{
+    bt_dispose(&c.tree, znode_del);
+    c.tree = BTree();
+    c.ref.clear();
+}
+
+// scores from a small range and names with a shared prefix longer
+// than 8 bytes, so the keys tie on the score and on the prefix
+static Key key_rand()
+{
+    double score = (double)(rand() % 8);
+    std::string name = rand() % 2 ? "member:" : "member:long-common-prefix:";
+    name += std::to_string(rand() % 200);
+    return Key(score, name);
+}
+
+static Key key_seq(uint32_t i)
+{
+    return Key((double)(i / 4), "k" + std::to_string(100000 + i));
+}
+
+static void queries_verify(Container &c, uint32_t nquery)
+{
+    std::vector<ZNode *> items;
+    for (auto &kv : c.ref)
+    {
+        items.push_back(kv.second);
+    }
+    int64_t n = (int64_t)items.size();
+    for (uint32_t q = 0; q < nquery; q++)
+    {
+        // seek against the reference lower bound
+        Key key = key_rand();
+        BIter it = bt_seek(&c.tree, key.first, key.second.data(), key.second.size());
+        auto lb = c.ref.lower_bound(key);
+        assert(bt_get(it) == (lb == c.ref.end() ? NULL : lb->second));
+
+        // then a range from there, over the leaf links
+        for (uint32_t k = 0; k < 40 && lb != c.ref.end(); k++, lb++)
+        {
+            assert(bt_get(it) == lb->second);
+            bt_offset(&c.tree, &it, 1);
+        }
+        if (lb == c.ref.end())
+        {
+            assert(!bt_get(it));
+        }
+
+        if (n == 0)
+        {
+            continue;
+        }
+        // short and long, forward and backward, out of range included
+        int64_t from = rand() % n;
+        int64_t span = rand() % 4 == 0 ? 3 * n : 2 * k_bt_cap;
+        int64_t offset = rand() % (2 * span + 1) - span;
+        it = bt_at(&c.tree, (uint64_t)from);
+        assert(bt_get(it) == items[from]);
+        bt_offset(&c.tree, &it, offset);
+        int64_t to = from + offset;
+        assert(bt_get(it) == (to < 0 || to >= n ? NULL : items[to]));
+    }
+}
+
+// insert in order, then delete every item in turn
+static void test_remove(uint32_t sz)
+{
+    for (uint32_t val = 0; val < sz; val++)
+    {
+        Container c;
+        for (uint32_t i = 0; i < sz; i++)
+        {
+            add(c, key_seq(i));
+        }
+        container_verify(c);
+        del(c, key_seq(val));
+        container_verify(c);
+        dispose(c);
+    }
+}
+
+// shrink to nothing from either end or the middle, crossing every merge
+static void test_drain(uint32_t sz)
+{
+    for (int mode = 0; mode < 3; mode++)
+    {
+        Container c;
+        for (uint32_t i = 0; i < sz; i++)
+        {
+            add(c, key_seq(mode == 2 ? sz - 1 - i : i));
+        }
+        container_verify(c);
+        while (!c.ref.empty())
+        {
+            auto it = c.ref.begin();
+            if (mode == 1)
+            {
+                it = std::prev(c.ref.end());
+            }
+            else if (mode == 2)
+            {
+                std::advance(it, c.ref.size() / 2);
+            }
+            del(c, it->first);
+            container_verify(c);
+        }
+        assert(!c.tree.root);
+        dispose(c);
+    }
+}
+
+static void test_build(uint32_t sz)
+{
+    Container c;
+    std::vector<ZNode *> items;
+    for (uint32_t i = 0; i < sz; i++)
+    {
+        ZNode *node = znode_new(key_seq(i));
+        c.ref[key_seq(i)] = node;
+        items.push_back(node);
+    }
+    bt_build(&c.tree, items.data(), items.size());
+    container_verify(c);
+    queries_verify(c, 50);
+    // a built tree takes updates like any other
+    for (uint32_t i = 0; i < sz; i += 3)
+    {
+        del(c, key_seq(i));
+    }
+    add(c, Key(-1, "first"));
+    add(c, Key(1e9, "last"));
+    container_verify(c);
+    dispose(c);
+}
+
+static void test_random(uint32_t nops)
+{
+    Container c;
+    for (uint32_t i = 0; i < nops; i++)
+    {
+        Key key = key_rand();
+        if (c.ref.count(key))
+        {
+            del(c, key);
+        }
+        else
+        {
+            add(c, key);
+        }
+        if (i % 64 == 0)
+        {
+            container_verify(c);
+            queries_verify(c, 20);
+        }
+    }
+    container_verify(c);
+    queries_verify(c, 1000);
+    dispose(c);
+}
+
+int main()
+{
+    srand(1);
+    // around a full leaf, and around a full inner node of full leaves
+    const uint32_t sizes[] = {
+        0, 1, 2, k_bt_min - 1, k_bt_min, k_bt_min + 1,
+        k_bt_cap - 1, k_bt_cap, k_bt_cap + 1, 2 * k_bt_cap, 2 * k_bt_cap + 1,
+        k_bt_cap * k_bt_cap - 1, k_bt_cap * k_bt_cap, k_bt_cap * k_bt_cap + 1,
+    };
+    for (uint32_t sz : sizes)
+    {
+        test_build(sz);
+        test_drain(sz);
+        if (sz <= 2 * k_bt_cap + 1)
+        {
+            test_remove(sz);
+        }
+    }
+    for (uint32_t sz = 0; sz < 3000; sz += 7)
+    {
+        test_build(sz);
+    }
+    test_random(100000);
+    printf("ok\n");
+    return 0;
+}
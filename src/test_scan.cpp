@@ -0,0 +1,158 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <random>
+#include <vector>
+#include "common.h"
+#include "hashtable.cpp" // lazy
+#include "flatmap.cpp"
+
+// hm_scan() while other keys come and go, and the table resizes under it.
+// build it with and without -DUSE_FLATMAP.
+
+struct Key
+{
+    HNode node;
+    uint32_t val = 0;
+};
+
+static uint64_t key_hash(uint32_t val)
+{
+    uint64_t h = val + 0x9E3779B97F4A7C15ull;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+    return h ^ (h >> 31);
+}
+
+static bool key_eq(HNode *lhs, HNode *rhs)
+{
+    return my_container_of(lhs, Key, node)->val == my_container_of(rhs, Key, node)->val;
+}
+
+static void add(HMap *hmap, uint32_t val)
+{
+    Key *key = new Key();
+    key->node.hcode = key_hash(val);
+    key->val = val;
+    hm_insert(hmap, &key->node);
+}
+
+static bool del(HMap *hmap, uint32_t val)
+{
+    Key key;
+    key.node.hcode = key_hash(val);
+    key.val = val;
+    HNode *node = hm_pop(hmap, &key.node, &key_eq);
+    if (!node)
+    {
+        return false;
+    }
+    delete my_container_of(node, Key, node);
+    return true;
+}
+
+static void cb_seen(HNode *node, void *arg)
+{
+    std::vector<uint32_t> *seen = (std::vector<uint32_t> *)arg;
+    (*seen)[my_container_of(node, Key, node)->val]++;
+}
+
+static void cb_collect(HNode *node, void *arg)
+{
+    ((std::vector<Key *> *)arg)->push_back(my_container_of(node, Key, node));
+}
+
+static void dispose(HMap *hmap)
+{
+    std::vector<Key *> keys;
+    hm_foreach(hmap, &cb_collect, &keys);
+    hm_destroy(hmap);
+    for (Key *key : keys)
+    {
+        delete key;
+    }
+}
+
+// nstable keys stay for the whole scan. between 2 steps of the scan, nops
+// random inserts and deletes of the other keys, so the table grows, and for
+// the flatmap, rehashes its tombstones away.
+static void test_scan(uint32_t nstable, uint32_t nchurn, uint32_t nops, uint32_t seed)
+{
+    std::mt19937 rng(seed);
+    HMap hmap;
+    for (uint32_t i = 0; i < nstable; ++i)
+    {
+        add(&hmap, i);
+    }
+    // the other keys are nstable and up
+    std::vector<bool> present(nchurn, false);
+    std::vector<uint32_t> seen(nstable + nchurn, 0);
+    uint64_t cursor = 0;
+    size_t steps = 0;
+    do
+    {
+        cursor = hm_scan(&hmap, cursor, &cb_seen, &seen);
+        for (uint32_t k = 0; k < nops; ++k)
+        {
+            uint32_t i = rng() % nchurn;
+            // mostly inserts, so it keeps growing
+            if (!present[i] && rng() % 4 != 0)
+            {
+                add(&hmap, nstable + i);
+                present[i] = true;
+            }
+            else if (present[i])
+            {
+                assert(del(&hmap, nstable + i));
+                present[i] = false;
+            }
+        }
+        steps++;
+    } while (cursor != 0);
+
+    for (uint32_t i = 0; i < nstable; ++i)
+    {
+        assert(seen[i] >= 1);
+    }
+    printf("stable=%u churn=%u ops=%u: %zu steps, %zu keys at the end\n",
+           nstable, nchurn, nops, steps, hm_size(&hmap));
+    dispose(&hmap);
+}
+
+// a scan with nothing changing visits every key exactly once
+static void test_scan_once(uint32_t n)
+{
+    HMap hmap;
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        add(&hmap, i);
+    }
+    std::vector<uint32_t> seen(n, 0);
+    uint64_t cursor = 0;
+    do
+    {
+        cursor = hm_scan(&hmap, cursor, &cb_seen, &seen);
+    } while (cursor != 0);
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        assert(seen[i] == 1);
+    }
+    dispose(&hmap);
+}
+
+int main()
+{
+    for (uint32_t n : {0u, 1u, 7u, 100u, 5000u})
+    {
+        test_scan_once(n);
+    }
+    for (uint32_t seed = 1; seed <= 5; ++seed)
+    {
+        test_scan(1000, 200000, 50, seed);
+        test_scan(10, 100000, 200, seed);
+        test_scan(20000, 20000, 5, seed);
+        test_scan(5000, 300000, 1000, seed);
+    }
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,169 @@
+#include <assert.h>
+#include "common.h"
+#include "timerwheel.h"
+
+/*
+- a timer goes to the lowest level where its expiry and now_ms only differ
+  in that level's slot bits, so the slot is always after the current one.
+- the timers of a slot above level 0 are placed again when now_ms reaches the
+  start of the slot, they move to a lower level. a timer moves at most
+  k_tw_levels times.
+- the far list is placed again each time now_ms enters a new range of 2^24 ms.
+- tw_advance() jumps from one occupied slot to the next, an idle period
+  costs nothing however long it is.
+*/
+
+const uint32_t k_slot_far = k_tw_levels * k_tw_slots;
+const uint32_t k_slot_due = k_slot_far + 1;
+const uint64_t k_tw_span = 1ull << (k_tw_bits * k_tw_levels);
+
+void tw_init(TimerWheel *tw, uint64_t now_ms)
+{
+    tw->now_ms = now_ms;
+    tw->size = 0;
+    for (size_t l = 0; l < k_tw_levels; l++)
+    {
+        tw->occupied[l] = 0;
+        for (size_t s = 0; s < k_tw_slots; s++)
+        {
+            dlist_init(&tw->slots[l][s]);
+        }
+    }
+    dlist_init(&tw->far);
+}
+
+// put the timer in its slot, or in `due` if it has expired
+static void tw_place(TimerWheel *tw, Timer *timer, DList *due)
+{
+    uint64_t expire = timer->expire_ms;
+    if (expire <= tw->now_ms)
+    {
+        if (due)
+        {
+            dlist_insert_before(due, &timer->link);
+            timer->slot = k_slot_due;
+            return;
+        }
+        expire = tw->now_ms + 1;
+    }
+    for (size_t l = 0; l < k_tw_levels; l++)
+    {
+        size_t shift = k_tw_bits * (l + 1);
+        if ((expire >> shift) == (tw->now_ms >> shift))
+        {
+            size_t s = (expire >> (k_tw_bits * l)) & (k_tw_slots - 1);
+            dlist_insert_before(&tw->slots[l][s], &timer->link);
+            tw->occupied[l] |= 1ull << s;
+            timer->slot = (uint32_t)(l * k_tw_slots + s);
+            return;
+        }
+    }
+    dlist_insert_before(&tw->far, &timer->link);
+    timer->slot = k_slot_far;
+}
+
+void tw_add(TimerWheel *tw, Timer *timer, uint64_t expire_ms)
+{
+    assert(!tw_pending(timer));
+    timer->expire_ms = expire_ms;
+    tw_place(tw, timer, NULL);
+    tw->size++;
+}
+
+void tw_cancel(TimerWheel *tw, Timer *timer)
+{
+    if (!tw_pending(timer))
+    {
+        return;
+    }
+    dlist_detach(&timer->link);
+    if (timer->slot < k_slot_far)
+    {
+        size_t l = timer->slot / k_tw_slots;
+        size_t s = timer->slot % k_tw_slots;
+        if (dlist_empty(&tw->slots[l][s]))
+        {
+            tw->occupied[l] &= ~(1ull << s);
+        }
+    }
+    timer->link = DList();
+    tw->size--;
+}
+
+uint64_t tw_next(TimerWheel *tw)
+{
+    uint64_t next = UINT64_MAX;
+    for (size_t l = 0; l < k_tw_levels; l++)
+    {
+        if (!tw->occupied[l])
+        {
+            continue;
+        }
+        // the start of the first occupied slot
+        size_t shift = k_tw_bits * (l + 1);
+        uint64_t s = __builtin_ctzll(tw->occupied[l]);
+        uint64_t start = (tw->now_ms >> shift << shift) | (s << (k_tw_bits * l));
+        next = start < next ? start : next;
+    }
+    if (!dlist_empty(&tw->far))
+    {
+        uint64_t start = (tw->now_ms / k_tw_span + 1) * k_tw_span;
+        next = start < next ? start : next;
+    }
+    return next;
+}
+
+// take all the timers out of a list and place them again.
+// the far list gets back the timers that are still too far, so move them out first.
+static void tw_replace(TimerWheel *tw, DList *list, DList *due)
+{
+    DList tmp;
+    dlist_init(&tmp);
+    if (!dlist_empty(list))
+    {
+        dlist_insert_before(list->next, &tmp);
+        dlist_detach(list);
+        dlist_init(list);
+    }
+    while (!dlist_empty(&tmp))
+    {
+        DList *node = tmp.next;
+        dlist_detach(node);
+        tw_place(tw, my_container_of(node, Timer, link), due);
+    }
+}
+
+void tw_advance(TimerWheel *tw, uint64_t now_ms, DList *due)
+{
+    for (uint64_t t = tw_next(tw); t <= now_ms; t = tw_next(tw))
+    {
+        assert(t > tw->now_ms);
+        tw->now_ms = t;
+        if (t % k_tw_span == 0)
+        {
+            tw_replace(tw, &tw->far, due);
+        }
+        // the slots that start now, they go down a level
+        for (size_t l = k_tw_levels - 1; l >= 1; l--)
+        {
+            size_t shift = k_tw_bits * l;
+            size_t s = (t >> shift) & (k_tw_slots - 1);
+            if ((t & ((1ull << shift) - 1)) == 0 && (tw->occupied[l] & (1ull << s)))
+            {
+                tw->occupied[l] &= ~(1ull << s);
+                tw_replace(tw, &tw->slots[l][s], due);
+            }
+        }
+        // level 0 is exact, everything there expires now
+        size_t s = t & (k_tw_slots - 1);
+        if (tw->occupied[0] & (1ull << s))
+        {
+            tw->occupied[0] &= ~(1ull << s);
+            tw_replace(tw, &tw->slots[0][s], due);
+        }
+    }
+    if (now_ms > tw->now_ms)
+    {
+        tw->now_ms = now_ms;
+    }
+}
@@ -0,0 +1,376 @@
+#ifdef __linux__
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+
+/*
+The rings are shared with the kernel:
+- we own the SQ tail and the CQ head, the kernel owns the SQ head and the CQ tail.
+- the other side's index is read with acquire, ours is published with release.
+*/
+
+static int sys_setup(unsigned entries, io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+                     unsigned flags, void *arg, size_t argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+bool ur_init(URing *ur, unsigned entries)
+{
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ur->fd = sys_setup(entries, &p);
+    if (ur->fd < 0)
+    {
+        return false;
+    }
+    // the timeout of ur_submit_and_wait() needs EXT_ARG (5.11)
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG))
+    {
+        ur_close(ur);
+        return false;
+    }
+
+    ur->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (cq_size > ur->sq_size)
+    {
+        ur->sq_size = cq_size;
+    }
+    // SQ and CQ rings share one mapping
+    ur->sq_ptr = mmap(NULL, ur->sq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+    if (ur->sq_ptr == MAP_FAILED)
+    {
+        ur->sq_ptr = NULL;
+        ur_close(ur);
+        return false;
+    }
+    ur->cq_ptr = ur->sq_ptr;
+
+    ur->sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        ur_close(ur);
+        return false;
+    }
+    ur->sqes = (io_uring_sqe *)sqes;
+
+    uint8_t *sq = (uint8_t *)ur->sq_ptr;
+    ur->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ur->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ur->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ur->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    ur->sq_entries = p.sq_entries;
+
+    uint8_t *cq = (uint8_t *)ur->cq_ptr;
+    ur->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ur->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ur->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    ur->cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+    return true;
+}
+
+void ur_close(URing *ur)
+{
+    free(ur->bufs);
+    free(ur->retry);
+    if (ur->sqes)
+    {
+        munmap(ur->sqes, ur->sqes_size);
+    }
+    if (ur->sq_ptr)
+    {
+        munmap(ur->sq_ptr, ur->sq_size);
+    }
+    if (ur->fd >= 0)
+    {
+        (void)close(ur->fd);
+    }
+    *ur = URing();
+}
+
+// publish the prepared SQEs to the kernel
+static void sq_flush(URing *ur)
+{
+    unsigned tail = *ur->sq_tail;
+    __atomic_store_n(ur->sq_tail, tail + ur->sq_pending, __ATOMIC_RELEASE);
+}
+
+static int sq_submit(URing *ur, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+    sq_flush(ur);
+    ur->sq_pending = 0;
+    // also the ones left over by a previous short submission
+    unsigned n = *ur->sq_tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+    int rv = 0;
+    do
+    {
+        rv = sys_enter(ur->fd, n, min_complete, flags, arg, argsz);
+    } while (rv < 0 && errno == EINTR);
+    return rv;
+}
+
+static io_uring_sqe *get_sqe(URing *ur)
+{
+    unsigned head = __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ur->sq_tail + ur->sq_pending;
+    if (tail - head >= ur->sq_entries)
+    {
+        // the SQ is full, hand the batch to the kernel
+        if (sq_submit(ur, 0, 0, NULL, 0) < 0)
+        {
+            return NULL;
+        }
+        head = __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+        tail = *ur->sq_tail;
+        if (tail - head >= ur->sq_entries)
+        {
+            return NULL;
+        }
+    }
+    unsigned idx = tail & ur->sq_mask;
+    ur->sq_array[idx] = idx;
+    ur->sq_pending++;
+    io_uring_sqe *sqe = &ur->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// the user_data of PROVIDE_BUFFERS: this bit, the first buffer at bit 32, and n
+const uint64_t k_ur_provide = 1ull << 63;
+
+// hand [first, first + n) of the provided buffers to the kernel.
+// ur_pop_cqe() takes the completion, and keeps them for a retry on an error.
+static bool provide_bufs(URing *ur, uint16_t first, uint32_t n)
+{
+    io_uring_sqe *sqe = get_sqe(ur);
+    if (!sqe)
+    {
+        return false;
+    }
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = (int)n;
+    sqe->addr = (uint64_t)ur_buf(ur, first);
+    sqe->len = ur->buf_size;
+    sqe->off = first;
+    sqe->buf_group = ur->bgid;
+    sqe->user_data = k_ur_provide | ((uint64_t)first << 32) | n;
+    return true;
+}
+
+static void retry_later(URing *ur, uint16_t first, uint32_t n)
+{
+    // a buffer is in the kernel, in use, or here: there's room for all of them
+    for (uint32_t i = 0; i < n; i++)
+    {
+        ur->retry[ur->nretry++] = (uint16_t)(first + i);
+    }
+}
+
+static void give_bufs(URing *ur, uint16_t first, uint32_t n)
+{
+    if (!provide_bufs(ur, first, n))
+    {
+        retry_later(ur, first, n); // the SQ is full
+        return;
+    }
+    ur->recycled += n;
+}
+
+static void retry_bufs(URing *ur)
+{
+    uint32_t n = ur->nretry;
+    ur->nretry = 0;
+    // one that fails again goes back at an index not past i
+    for (uint32_t i = 0; i < n; i++)
+    {
+        give_bufs(ur, ur->retry[i], 1);
+    }
+}
+
+// nbufs provided buffers for recv, the kernel picks one when data arrives,
+// so idle connections don't pin any receive memory in the kernel.
+bool ur_setup_bufs(URing *ur, uint16_t bgid, uint32_t nbufs, uint32_t buf_size)
+{
+    assert(nbufs > 0 && nbufs <= 65536);
+    ur->bgid = bgid;
+    ur->nbufs = nbufs;
+    ur->buf_size = buf_size;
+    ur->bufs = (uint8_t *)malloc((size_t)nbufs * buf_size);
+    ur->retry = (uint16_t *)malloc((size_t)nbufs * sizeof(uint16_t));
+    if (!ur->bufs || !ur->retry || !provide_bufs(ur, 0, nbufs))
+    {
+        return false;
+    }
+    // wait for it to check that the kernel supports it (5.7+)
+    if (sq_submit(ur, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+    {
+        return false;
+    }
+    unsigned head = *ur->cq_head;
+    if (head == __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return false;
+    }
+    int32_t res = ur->cqes[head & ur->cq_mask].res;
+    __atomic_store_n(ur->cq_head, head + 1, __ATOMIC_RELEASE);
+    return res >= 0;
+}
+
+// a multishot accept keeps producing completions (5.19+)
+bool ur_accept(URing *ur, int fd, bool multishot, uint64_t user_data)
+{
+    io_uring_sqe *sqe = get_sqe(ur);
+    if (!sqe)
+    {
+        return false;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = multishot ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool ur_recv(URing *ur, int fd, size_t len, uint64_t user_data)
+{
+    io_uring_sqe *sqe = get_sqe(ur);
+    if (!sqe)
+    {
+        return false;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    // the kernel picks a buffer from the group, len caps the bytes read
+    sqe->len = (uint32_t)(len < ur->buf_size ? len : ur->buf_size);
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = ur->bgid;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool ur_send(URing *ur, int fd, const void *buf, size_t len, uint64_t user_data)
+{
+    io_uring_sqe *sqe = get_sqe(ur);
+    if (!sqe)
+    {
+        return false;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool ur_poll(URing *ur, int fd, uint64_t user_data)
+{
+    io_uring_sqe *sqe = get_sqe(ur);
+    if (!sqe)
+    {
+        return false;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = user_data;
+    return true;
+}
+
+// one syscall per event loop iteration: submit the batch and wait for completions
+int ur_submit_and_wait(URing *ur, int timeout_ms)
+{
+    __kernel_timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)&ts;
+
+    retry_bufs(ur);
+    // don't wait if there are completions already
+    unsigned head = *ur->cq_head;
+    unsigned tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+    unsigned wait = (head == tail) ? 1 : 0;
+    int rv = sq_submit(ur, wait, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (rv < 0 && errno == ETIME)
+    {
+        return 0;
+    }
+    return rv;
+}
+
+bool ur_pop_cqe(URing *ur, URCqe *out)
+{
+    unsigned head = *ur->cq_head;
+    unsigned tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++)
+    {
+        io_uring_cqe *cqe = &ur->cqes[head & ur->cq_mask];
+        if (cqe->user_data & k_ur_provide)
+        {
+            if (cqe->res < 0)
+            {
+                // lost to the pool otherwise
+                retry_later(ur, (uint16_t)(cqe->user_data >> 32), (uint32_t)cqe->user_data);
+            }
+            continue;
+        }
+        out->user_data = cqe->user_data;
+        out->res = cqe->res;
+        out->flags = cqe->flags;
+        __atomic_store_n(ur->cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+    __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+    return false;
+}
+
+bool ur_cqe_more(const URCqe *cqe)
+{
+    return cqe->flags & IORING_CQE_F_MORE;
+}
+
+bool ur_cqe_buffer(const URCqe *cqe, uint16_t *bid)
+{
+    if (!(cqe->flags & IORING_CQE_F_BUFFER))
+    {
+        return false;
+    }
+    *bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    return true;
+}
+
+uint8_t *ur_buf(URing *ur, uint16_t bid)
+{
+    assert(bid < ur->nbufs);
+    return &ur->bufs[(size_t)bid * ur->buf_size];
+}
+
+// give a provided buffer back to the kernel, it goes with the next submission
+void ur_recycle_buf(URing *ur, uint16_t bid)
+{
+    give_bufs(ur, bid, 1);
+}
+
+#endif // __linux__
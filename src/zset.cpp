@@ -2,10 +2,18 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 // proj
 #include "zset.h"
 #include "common.h"
 #include "hashtable.h"
+#include "slab.h"
+#include "log.h"
 
 // a helper structure for the hashtable lookup
 struct HKey
@@ -33,8 +41,10 @@ static bool hcmp(HNode *node, HNode *key)
 static ZNode *
 znode_new(const char *name, size_t len, double score)
 {
-    ZNode *node = (ZNode *)malloc(sizeof(ZNode) + len);
+    ZNode *node = (ZNode *)slab_alloc(sizeof(ZNode) + len);
+#ifndef USE_BTREE
     avl_init(&node->tree);
+#endif
     node->hmap.next = NULL;
     node->hmap.hcode = str_hash((uint8_t *)name, len);
     node->score = score;
@@ -43,10 +53,10 @@ znode_new(const char *name, size_t len, double score)
     return node;
 }
 // lookup by name.
-ZNode *zset_lookup(ZSet *zset, const char *name, size_t len)
+static ZNode *tree_lookup(ZTree *zt, const char *name, size_t len)
 {
-    // if zset has no tree at all, return NULL
-    if (!zset->tree)
+    // if zset is empty, return NULL
+    if (hm_size(&zt->hmap) == 0)
     {
         return NULL;
     }
@@ -56,10 +66,21 @@ ZNode *zset_lookup(ZSet *zset, const char *name, size_t len)
     key.name = name;
     key.len = len;
     // search ths key in the zset's hmap
-    HNode *found = hm_lookup(&zset->hmap, &key.node, &hcmp);
+    HNode *found = hm_lookup(&zt->hmap, &key.node, &hcmp);
     return found ? my_container_of(found, ZNode, hmap) : NULL;
 }
 
+#ifdef USE_BTREE
+static void tree_add(ZTree *zt, ZNode *node)
+{
+    bt_insert(&zt->tree, node);
+}
+
+static void tree_del(ZTree *zt, ZNode *node)
+{
+    bt_erase(&zt->tree, node);
+}
+#else
 // compare by the (score, name) tuple
 static bool zless(
     AVLNode *lhs, double score, const char *name, size_t len)
@@ -71,8 +92,7 @@ static bool zless(
     assert(zl != NULL);       // 确保 my_container_of 返回合法地址
     assert(zl->name != NULL); // 确保 zl->name 不为 NULL
 
-    printf("zless: Comparing score and name\n");
-    printf("zless: zl->score = %f, score = %f\n", zl->score, score);
+    log_trace("zless: zl->score = %f, score = %f", zl->score, score);
 
     // 比较分数
     if (zl->score != score)
@@ -82,7 +102,7 @@ static bool zless(
 
     // 比较名字
     size_t cmp_len = min(zl->len, len);
-    printf("zless: zl->len = %zu, len = %zu, cmp_len = %zu\n", zl->len, len, cmp_len);
+    log_trace("zless: zl->len = %zu, len = %zu, cmp_len = %zu", zl->len, len, cmp_len);
 
     int rv = memcmp(zl->name, name, cmp_len);
     if (rv != 0)
@@ -105,109 +125,105 @@ static bool zless(AVLNode *lhs, AVLNode *rhs)
     return zless(lhs, zr->score, zr->name, zr->len);
 }
 
-static void tree_add(ZSet *zset, ZNode *node)
+static void tree_add(ZTree *zt, ZNode *node)
 {
-    printf("tree_add: Start\n");
-
-    // 检查 zset 和 node 是否为 NULL
-    if (!zset)
+    // 检查 zt 和 node 是否为 NULL
+    if (!zt)
     {
-        printf("tree_add: zset is NULL\n");
+        log_error("tree_add: zt is NULL");
         return;
     }
     if (!node)
     {
-        printf("tree_add: node is NULL\n");
+        log_error("tree_add: node is NULL");
         return;
     }
 
     // 初始化 node->tree
-    printf("tree_add: Initializing node tree structure\n");
     node->tree.parent = NULL;
     node->tree.left = NULL;
     node->tree.right = NULL;
 
     AVLNode *cur = NULL;
-    AVLNode **from = &zset->tree; // 指向树的根节点
-    printf("tree_add: Starting tree search. Initial zset->tree = %p\n", zset->tree);
+    AVLNode **from = &zt->tree; // 指向树的根节点
+    log_trace("tree_add: starting tree search, zt->tree = %p", (void *)zt->tree);
 
     // 遍历树查找插入点
     while (*from)
     {
         cur = *from;
-        printf("tree_add: Visiting node %p (left = %p, right = %p, parent = %p)\n",
-               cur, cur->left, cur->right, cur->parent);
+        log_trace("tree_add: visiting node %p (left = %p, right = %p, parent = %p)",
+                  (void *)cur, (void *)cur->left, (void *)cur->right, (void *)cur->parent);
         if (zless(&node->tree, cur))
         {
-            printf("tree_add: Moving left from node %p\n", cur);
             from = &cur->left;
         }
         else
         {
-            printf("tree_add: Moving right from node %p\n", cur);
             from = &cur->right;
         }
     }
 
     // 将新节点插入树中
-    printf("tree_add: Found insertion point. Attaching new node at %p\n", *from);
+    log_trace("tree_add: attaching the new node under %p", (void *)cur);
     *from = &node->tree;
     node->tree.parent = cur;
 
     // 修复 AVL 树的平衡性
-    printf("tree_add: Fixing AVL tree balance\n");
-    zset->tree = avl_fix(&node->tree);
+    zt->tree = avl_fix(&node->tree);
+}
 
-    printf("tree_add: Finished successfully\n");
+static void tree_del(ZTree *zt, ZNode *node)
+{
+    zt->tree = avl_del(&node->tree);
+    avl_init(&node->tree);
 }
-// update the score of an existing node (AVL tree reinsertion)
-static void zset_update(ZSet *zset, ZNode *node, double score)
+#endif
+
+// update the score of an existing node (tree reinsertion)
+static void tree_update(ZTree *zt, ZNode *node, double score)
 {
     if (node->score == score)
     {
         return;
     }
-    zset->tree = avl_del(&node->tree);
+    tree_del(zt, node);
     node->score = score;
-    avl_init(&node->tree);
-    tree_add(zset, node);
+    tree_add(zt, node);
 }
 
 // add a new (score, name) tuple, or update the score of the existing tuple
-bool zset_add(ZSet *zset, const char *name, size_t len, double score)
+static bool tree_set(ZTree *zt, const char *name, size_t len, double score)
 {
-    printf("zset_add starts, we want to add a new tuple to the zset\n");
-    printf("score is %f\n", score);
+    log_debug("tree_set: %.*s, score %f", (int)len, name, score);
     // check if ZSet already has this name
-    ZNode *node = zset_lookup(zset, name, len);
+    ZNode *node = tree_lookup(zt, name, len);
 
     // if has, update its score
     if (node)
     {
-        printf("zset has this name, we want to update its score\n");
-        zset_update(zset, node, score);
+        log_debug("tree_set: the name exists, update its score");
+        tree_update(zt, node, score);
         return false;
     }
     else
     { // create a ZNode
-        printf("zset doesn't have that name\n");
         ZNode *node = znode_new(name, len, score);
         // add to the hashmap.
-        hm_insert(&zset->hmap, &node->hmap);
-        printf("successfully insert the znode's hnode to zset's hmap\n");
+        hm_insert(&zt->hmap, &node->hmap);
         // add to the tree
-        tree_add(zset, node);
-        printf("successfully insert the znode's avlnode to zset's avltree\n");
+        tree_add(zt, node);
+        log_debug("tree_set: inserted a new node");
         return true;
     }
 }
 
 // deletion by name
-ZNode *zset_pop(ZSet *zset, const char *name, size_t len)
+static ZNode *tree_pop(ZTree *zt, const char *name, size_t len)
 {
-    if (!zset->tree)
+    if (hm_size(&zt->hmap) == 0)
     {
-        printf("zset_pop: zset->tree is NULL\n");
+        log_debug("tree_pop: zset is empty");
         return NULL;
     }
     HKey key;
@@ -215,7 +231,7 @@ ZNode *zset_pop(ZSet *zset, const char *name, size_t len)
     key.name = name;
     key.len = len;
     // search the key in the zset's hmap, try to delete it
-    HNode *found = hm_pop(&zset->hmap, &key.node, &hcmp);
+    HNode *found = hm_pop(&zt->hmap, &key.node, &hcmp);
     if (!found)
     {
         return NULL;
@@ -224,15 +240,44 @@ ZNode *zset_pop(ZSet *zset, const char *name, size_t len)
     // get the ZNode from the HNode
     ZNode *node = my_container_of(found, ZNode, hmap);
     // get the tree
-    zset->tree = avl_del(&node->tree);
+    tree_del(zt, node);
     return node;
 }
 
+#ifdef USE_BTREE
 // find the (score, name) tuple that is greater or equal to the argument.
-ZNode *zset_query(ZSet *zset, double score, const char *name, size_t len)
+static ZIter tree_query(ZTree *zt, double score, const char *name, size_t len)
+{
+    ZIter it;
+    it.pos = bt_seek(&zt->tree, score, name, len);
+    it.node = bt_get(it.pos);
+    return it;
+}
+
+static void tree_offset(ZTree *zt, ZIter *it, int64_t offset)
+{
+    bt_offset(&zt->tree, &it->pos, offset);
+    it->node = bt_get(it->pos);
+}
+
+static int64_t tree_rank(ZTree *zt, ZNode *node)
+{
+    return (int64_t)bt_rank(&zt->tree, node);
+}
+
+static ZIter tree_at(ZTree *zt, int64_t rank)
+{
+    ZIter it;
+    it.pos = bt_at(&zt->tree, (uint64_t)rank);
+    it.node = bt_get(it.pos);
+    return it;
+}
+#else
+// find the (score, name) tuple that is greater or equal to the argument.
+static ZIter tree_query(ZTree *zt, double score, const char *name, size_t len)
 {
     AVLNode *found = NULL;
-    for (AVLNode *cur = zset->tree; cur;)
+    for (AVLNode *cur = zt->tree; cur;)
     {
         if (zless(cur, score, name, len))
         {
@@ -244,35 +289,671 @@ ZNode *zset_query(ZSet *zset, double score, const char *name, size_t len)
             cur = cur->left;
         }
     }
-    return found ? my_container_of(found, ZNode, tree) : NULL;
+    ZIter it;
+    it.node = found ? my_container_of(found, ZNode, tree) : NULL;
+    return it;
 }
 
 // offset into the succeeding or preceding node.
-ZNode *znode_offset(ZNode *node, int64_t offset)
+static void tree_offset(ZTree *, ZIter *it, int64_t offset)
 {
-    AVLNode *tnode = node ? avl_offset(&node->tree, offset) : NULL;
-    return tnode ? my_container_of(tnode, ZNode, tree) : NULL;
+    AVLNode *tnode = it->node ? avl_offset(&it->node->tree, offset) : NULL;
+    it->node = tnode ? my_container_of(tnode, ZNode, tree) : NULL;
 }
 
-void znode_del(ZNode *node)
+// the nodes on the left, counted on the way up to the root
+static int64_t tree_rank(ZTree *, ZNode *node)
 {
-    free(node);
+    AVLNode *cur = &node->tree;
+    int64_t rank = avl_cnt(cur->left);
+    for (; cur->parent; cur = cur->parent)
+    {
+        if (cur->parent->right == cur)
+        {
+            rank += avl_cnt(cur->parent->left) + 1;
+        }
+    }
+    return rank;
 }
 
-static void tree_dispose(AVLNode *node)
+// from the root, whose rank is the size of its left subtree
+static ZIter tree_at(ZTree *zt, int64_t rank)
 {
-    if (!node)
+    ZIter it;
+    AVLNode *root = zt->tree;
+    AVLNode *found = root ? avl_offset(root, rank - avl_cnt(root->left)) : NULL;
+    it.node = found ? my_container_of(found, ZNode, tree) : NULL;
+    return it;
+}
+#endif
+
+static void znode_del(ZNode *node)
+{
+    slab_free(node, sizeof(ZNode) + node->len);
+}
+
+#ifndef USE_BTREE
+// without recursion, a tree of millions of nodes would take a deep stack.
+// rotate the left children up until there's none, then the node can go.
+static void nodes_dispose(AVLNode *node)
+{
+    while (node)
     {
-        return;
+        AVLNode *left = node->left;
+        if (left)
+        {
+            node->left = left->right;
+            left->right = node;
+            node = left;
+        }
+        else
+        {
+            AVLNode *right = node->right;
+            znode_del(my_container_of(node, ZNode, tree));
+            node = right;
+        }
+    }
+}
+
+#endif
+
+static void tree_dispose(ZTree *zt)
+{
+#ifdef USE_BTREE
+    bt_dispose(&zt->tree, &znode_del);
+#else
+    nodes_dispose(zt->tree);
+#endif
+    hm_destroy(&zt->hmap);
+}
+
+// the nodes in order, and the tree emptied without freeing them
+static void tree_detach(ZTree *zt, std::vector<ZNode *> &nodes)
+{
+    size_t size = hm_size(&zt->hmap);
+    nodes.reserve(nodes.size() + size);
+    ZIter it = tree_at(zt, 0);
+    for (size_t i = 0; i < size; i++)
+    {
+        nodes.push_back(it.node);
+        tree_offset(zt, &it, +1);
+    }
+#ifdef USE_BTREE
+    bt_dispose(&zt->tree, [](ZNode *) {});
+#else
+    zt->tree = NULL;
+#endif
+}
+
+// an empty tree from the nodes in order
+static void tree_build(ZTree *zt, std::vector<ZNode *> &nodes)
+{
+#ifdef USE_BTREE
+    bt_build(&zt->tree, nodes.data(), nodes.size());
+#else
+    std::vector<AVLNode *> tnodes(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        tnodes[i] = &nodes[i]->tree;
+    }
+    zt->tree = avl_build(tnodes.data(), tnodes.size());
+#endif
+}
+
+// by the (score, name) tuple
+static bool znode_less(const ZNode *lhs, const ZNode *rhs)
+{
+    if (lhs->score != rhs->score)
+    {
+        return lhs->score < rhs->score;
+    }
+    int rv = memcmp(lhs->name, rhs->name, min(lhs->len, rhs->len));
+    return rv != 0 ? rv < 0 : lhs->len < rhs->len;
+}
+
+static void nodes_sort(std::vector<ZNode *> &nodes)
+{
+    if (!std::is_sorted(nodes.begin(), nodes.end(), &znode_less))
+    {
+        std::sort(nodes.begin(), nodes.end(), &znode_less);
+    }
+}
+
+ZSetLimits g_zset_limits;
+
+static double *pack_scores(ZPack *pack)
+{
+    return (double *)(pack + 1);
+}
+
+static uint32_t *pack_offs(ZPack *pack)
+{
+    return (uint32_t *)(pack_scores(pack) + pack->cap);
+}
+
+static uint8_t *pack_tags(ZPack *pack)
+{
+    return (uint8_t *)(pack_offs(pack) + pack->cap + 1);
+}
+
+static char *pack_names(ZPack *pack)
+{
+    return (char *)(pack_tags(pack) + pack->cap);
+}
+
+static size_t pack_bytes(uint32_t cap, uint32_t room)
+{
+    return sizeof(ZPack) + cap * sizeof(double) + (cap + 1) * sizeof(uint32_t) + cap + room;
+}
+
+// a byte of the hash, to skip most names in a lookup
+static uint8_t name_tag(const char *name, size_t len)
+{
+    return (uint8_t)(str_hash((const uint8_t *)name, len) >> 56);
+}
+
+static ZPack *pack_new(uint32_t cap, uint32_t room)
+{
+    ZPack *pack = (ZPack *)slab_alloc(pack_bytes(cap, room));
+    pack->n = 0;
+    pack->cap = cap;
+    pack->used = 0;
+    pack->room = room;
+    pack_offs(pack)[0] = 0;
+    return pack;
+}
+
+static void pack_free(ZPack *pack)
+{
+    slab_free(pack, pack_bytes(pack->cap, pack->room));
+}
+
+// make room for one more member, the pack moves if it grows
+static ZPack *pack_reserve(ZPack *pack, size_t len)
+{
+    uint32_t cap = pack->cap, room = pack->room;
+    if (pack->n == cap)
+    {
+        cap *= 2;
+    }
+    while (pack->used + len > room)
+    {
+        room *= 2;
+    }
+    if (cap == pack->cap && room == pack->room)
+    {
+        return pack;
+    }
+    ZPack *bigger = pack_new(cap, room);
+    bigger->n = pack->n;
+    bigger->used = pack->used;
+    memcpy(pack_scores(bigger), pack_scores(pack), pack->n * sizeof(double));
+    memcpy(pack_offs(bigger), pack_offs(pack), (pack->n + 1) * sizeof(uint32_t));
+    memcpy(pack_tags(bigger), pack_tags(pack), pack->n);
+    memcpy(pack_names(bigger), pack_names(pack), pack->used);
+    pack_free(pack);
+    return bigger;
+}
+
+// the tags are compared 16 at a time, the names only where the tag matches.
+// a load past the last tag stays in the block: the names take at least 32 bytes.
+static int64_t pack_find(ZPack *pack, const char *name, size_t len)
+{
+    uint32_t *offs = pack_offs(pack);
+    uint8_t *tags = pack_tags(pack);
+    char *names = pack_names(pack);
+    uint8_t tag = name_tag(name, len);
+    for (uint32_t base = 0; base < pack->n; base += 16)
+    {
+#ifdef __SSE2__
+        __m128i group = _mm_loadu_si128((const __m128i *)&tags[base]);
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+#else
+        uint32_t mask = 0;
+        for (uint32_t k = 0; k < 16 && base + k < pack->n; k++)
+        {
+            mask |= (uint32_t)(tags[base + k] == tag) << k;
+        }
+#endif
+        if (pack->n - base < 16)
+        {
+            mask &= (1u << (pack->n - base)) - 1;
+        }
+        for (; mask; mask &= mask - 1)
+        {
+            uint32_t i = base + (uint32_t)__builtin_ctz(mask);
+            if (offs[i + 1] - offs[i] == len && 0 == memcmp(&names[offs[i]], name, len))
+            {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+// the number of scores < score. they are sorted, so it stops at the first
+// pair that isn't all below.
+static uint32_t pack_count_less(ZPack *pack, double score)
+{
+    const double *scores = pack_scores(pack);
+    uint32_t i = 0;
+#ifdef __SSE2__
+    __m128d key = _mm_set1_pd(score);
+    for (; i + 2 <= pack->n; i += 2)
+    {
+        int mask = _mm_movemask_pd(_mm_cmplt_pd(_mm_loadu_pd(&scores[i]), key));
+        if (mask != 3)
+        {
+            return i + (mask & 1);
+        }
     }
-    tree_dispose(node->left);
-    tree_dispose(node->right);
-    znode_del(my_container_of(node, ZNode, tree));
+#endif
+    while (i < pack->n && scores[i] < score)
+    {
+        i++;
+    }
+    return i;
+}
+
+// the first member >= (score, name)
+static uint32_t pack_lower(ZPack *pack, double score, const char *name, size_t len)
+{
+    const double *scores = pack_scores(pack);
+    uint32_t *offs = pack_offs(pack);
+    char *names = pack_names(pack);
+    uint32_t i = pack_count_less(pack, score);
+    for (; i < pack->n && scores[i] == score; i++)
+    {
+        size_t ilen = offs[i + 1] - offs[i];
+        int rv = memcmp(&names[offs[i]], name, min(ilen, len));
+        if (rv > 0 || (rv == 0 && ilen >= len))
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+// there must be room for it
+static void pack_insert(ZPack *pack, uint32_t i, double score, const char *name, size_t len)
+{
+    double *scores = pack_scores(pack);
+    uint32_t *offs = pack_offs(pack);
+    char *names = pack_names(pack);
+    uint8_t *tags = pack_tags(pack);
+    memmove(&scores[i + 1], &scores[i], (pack->n - i) * sizeof(double));
+    scores[i] = score;
+    memmove(&tags[i + 1], &tags[i], pack->n - i);
+    tags[i] = name_tag(name, len);
+    memmove(&names[offs[i] + len], &names[offs[i]], pack->used - offs[i]);
+    memcpy(&names[offs[i]], name, len);
+    for (uint32_t k = pack->n + 1; k > i; k--)
+    {
+        offs[k] = offs[k - 1] + (uint32_t)len;
+    }
+    pack->n++;
+    pack->used += (uint32_t)len;
+}
+
+// remove the members [i, i + cnt) in one move
+static void pack_erase(ZPack *pack, uint32_t i, uint32_t cnt)
+{
+    double *scores = pack_scores(pack);
+    uint32_t *offs = pack_offs(pack);
+    char *names = pack_names(pack);
+    uint8_t *tags = pack_tags(pack);
+    uint32_t end = i + cnt;
+    uint32_t len = offs[end] - offs[i];
+    memmove(&scores[i], &scores[end], (pack->n - end) * sizeof(double));
+    memmove(&tags[i], &tags[end], pack->n - end);
+    memmove(&names[offs[i]], &names[offs[end]], pack->used - offs[end]);
+    for (uint32_t k = end; k <= pack->n; k++)
+    {
+        offs[k - cnt] = offs[k] - len;
+    }
+    pack->n -= cnt;
+    pack->used -= len;
+}
+
+// the members are already in order
+static ZTree *pack_to_tree(ZPack *pack)
+{
+    ZTree *zt = new ZTree();
+    double *scores = pack_scores(pack);
+    uint32_t *offs = pack_offs(pack);
+    char *names = pack_names(pack);
+    for (uint32_t i = 0; i < pack->n; i++)
+    {
+        ZNode *node = znode_new(&names[offs[i]], offs[i + 1] - offs[i], scores[i]);
+        hm_insert(&zt->hmap, &node->hmap);
+        tree_add(zt, node);
+    }
+    return zt;
+}
+
+bool zset_add(ZSet *zset, const char *name, size_t len, double score)
+{
+    if (!zset->tree)
+    {
+        ZPack *pack = zset->pack;
+        int64_t i = pack ? pack_find(pack, name, len) : -1;
+        if (i >= 0)
+        {
+            // the erase makes room for the insert
+            if (pack_scores(pack)[i] != score)
+            {
+                pack_erase(pack, (uint32_t)i, 1);
+                pack_insert(pack, pack_lower(pack, score, name, len), score, name, len);
+            }
+            return false;
+        }
+        if (len <= g_zset_limits.pack_name && (pack ? pack->n : 0) < g_zset_limits.pack_members)
+        {
+            pack = pack_reserve(pack ? pack : pack_new(4, 32), len);
+            pack_insert(pack, pack_lower(pack, score, name, len), score, name, len);
+            zset->pack = pack;
+            return true;
+        }
+        // past the limits
+        log_debug("zset_add: %u members, converted to a tree", pack ? pack->n : 0);
+        zset->tree = pack ? pack_to_tree(pack) : new ZTree();
+        if (pack)
+        {
+            pack_free(pack);
+            zset->pack = NULL;
+        }
+    }
+    return tree_set(zset->tree, name, len, score);
+}
+
+bool zset_score(ZSet *zset, const char *name, size_t len, double *score)
+{
+    if (zset->tree)
+    {
+        ZNode *node = tree_lookup(zset->tree, name, len);
+        if (node)
+        {
+            *score = node->score;
+        }
+        return node != NULL;
+    }
+    int64_t i = zset->pack ? pack_find(zset->pack, name, len) : -1;
+    if (i >= 0)
+    {
+        *score = pack_scores(zset->pack)[i];
+    }
+    return i >= 0;
+}
+
+bool zset_rem(ZSet *zset, const char *name, size_t len)
+{
+    if (zset->tree)
+    {
+        ZNode *node = tree_pop(zset->tree, name, len);
+        if (node)
+        {
+            znode_del(node);
+        }
+        return node != NULL;
+    }
+    int64_t i = zset->pack ? pack_find(zset->pack, name, len) : -1;
+    if (i < 0)
+    {
+        return false;
+    }
+    pack_erase(zset->pack, (uint32_t)i, 1);
+    if (zset->pack->n == 0)
+    {
+        pack_free(zset->pack);
+        zset->pack = NULL;
+    }
+    return true;
+}
+
+size_t zset_size(ZSet *zset)
+{
+    if (zset->tree)
+    {
+        return hm_size(&zset->tree->hmap);
+    }
+    return zset->pack ? zset->pack->n : 0;
 }
 
-// destroy the zset
 void zset_dispose(ZSet *zset)
 {
-    tree_dispose(zset->tree);
-    hm_destroy(&zset->hmap);
-}
\ No newline at end of file
+    if (zset->tree)
+    {
+        tree_dispose(zset->tree);
+        delete zset->tree;
+        zset->tree = NULL;
+    }
+    if (zset->pack)
+    {
+        pack_free(zset->pack);
+        zset->pack = NULL;
+    }
+}
+
+// copy out the tuple at the position
+static void iter_load(ZSet *zset, ZIter *it)
+{
+    if (zset->tree)
+    {
+        it->valid = it->node != NULL;
+        if (it->valid)
+        {
+            it->score = it->node->score;
+            it->name = it->node->name;
+            it->len = it->node->len;
+        }
+        return;
+    }
+    ZPack *pack = zset->pack;
+    it->valid = pack && it->idx < pack->n;
+    if (it->valid)
+    {
+        uint32_t *offs = pack_offs(pack);
+        it->score = pack_scores(pack)[it->idx];
+        it->name = &pack_names(pack)[offs[it->idx]];
+        it->len = offs[it->idx + 1] - offs[it->idx];
+    }
+}
+
+ZIter zset_query(ZSet *zset, double score, const char *name, size_t len)
+{
+    ZIter it;
+    if (zset->tree)
+    {
+        it = tree_query(zset->tree, score, name, len);
+    }
+    else if (zset->pack)
+    {
+        it.idx = pack_lower(zset->pack, score, name, len);
+    }
+    iter_load(zset, &it);
+    return it;
+}
+
+void zset_offset(ZSet *zset, ZIter *it, int64_t offset)
+{
+    if (!it->valid)
+    {
+        return;
+    }
+    if (zset->tree)
+    {
+        tree_offset(zset->tree, it, offset);
+    }
+    else
+    {
+        int64_t idx = (int64_t)it->idx + offset;
+        it->idx = (idx < 0 || idx >= (int64_t)zset->pack->n) ? zset->pack->n : (uint32_t)idx;
+    }
+    iter_load(zset, it);
+}
+
+int64_t zset_rank(ZSet *zset, const char *name, size_t len)
+{
+    if (zset->tree)
+    {
+        ZNode *node = tree_lookup(zset->tree, name, len);
+        return node ? tree_rank(zset->tree, node) : -1;
+    }
+    // packed in order
+    return zset->pack ? pack_find(zset->pack, name, len) : -1;
+}
+
+ZIter zset_at(ZSet *zset, int64_t rank)
+{
+    ZIter it;
+    if (rank < 0 || rank >= (int64_t)zset_size(zset))
+    {
+        return it;
+    }
+    if (zset->tree)
+    {
+        it = tree_at(zset->tree, rank);
+    }
+    else
+    {
+        it.idx = (uint32_t)rank;
+    }
+    iter_load(zset, &it);
+    return it;
+}
+
+int64_t zset_count_below(ZSet *zset, double score, bool inclusive)
+{
+    if (inclusive)
+    {
+        if (score == INFINITY)
+        {
+            return (int64_t)zset_size(zset);
+        }
+        // <= score is < the next double
+        score = nextafter(score, INFINITY);
+    }
+    if (zset->tree)
+    {
+        ZIter it = tree_query(zset->tree, score, "", 0);
+        return it.node ? tree_rank(zset->tree, it.node) : (int64_t)zset_size(zset);
+    }
+    return zset->pack ? pack_count_less(zset->pack, score) : 0;
+}
+
+// removing at least 1 / k_rem_rebuild of the tree rebuilds it
+const size_t k_rem_rebuild = 4;
+
+size_t zset_rem_range(ZSet *zset, int64_t start, int64_t stop)
+{
+    int64_t size = (int64_t)zset_size(zset);
+    start = start < 0 ? 0 : start;
+    stop = stop > size ? size : stop;
+    if (start >= stop)
+    {
+        return 0;
+    }
+    size_t cnt = (size_t)(stop - start);
+    if (!zset->tree)
+    {
+        pack_erase(zset->pack, (uint32_t)start, (uint32_t)cnt);
+        if (zset->pack->n == 0)
+        {
+            pack_free(zset->pack);
+            zset->pack = NULL;
+        }
+        return cnt;
+    }
+    // a big range is cut out of the nodes in order and the rest rebuilt in
+    // O(n), instead of a rebalancing delete each. a small one is collected
+    // first, a removal moves the other nodes around.
+    ZTree *zt = zset->tree;
+    std::vector<ZNode *> nodes;
+    bool cut = cnt >= (size_t)size / k_rem_rebuild;
+    if (cut)
+    {
+        tree_detach(zt, nodes);
+    }
+    else
+    {
+        nodes.reserve(cnt);
+        ZIter it = tree_at(zt, start);
+        for (size_t i = 0; i < cnt; i++)
+        {
+            nodes.push_back(it.node);
+            tree_offset(zt, &it, +1);
+        }
+    }
+    size_t first = cut ? (size_t)start : 0;
+    for (size_t i = first; i < first + cnt; i++)
+    {
+        ZNode *node = nodes[i];
+        HKey key;
+        key.node.hcode = node->hmap.hcode;
+        key.name = node->name;
+        key.len = node->len;
+        hm_pop(&zt->hmap, &key.node, &hcmp);
+        if (!cut)
+        {
+            tree_del(zt, node);
+        }
+        znode_del(node);
+    }
+    if (cut)
+    {
+        nodes.erase(nodes.begin() + first, nodes.begin() + first + cnt);
+        tree_build(zt, nodes);
+    }
+    return cnt;
+}
+
+size_t zset_add_many(ZSet *zset, const ZTuple *tuples, size_t n)
+{
+    // small for a tree, or small next to the zset: one at a time
+    if (n <= g_zset_limits.pack_members || n < zset_size(zset))
+    {
+        size_t added = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            added += zset_add(zset, tuples[i].name, tuples[i].len, tuples[i].score);
+        }
+        return added;
+    }
+    if (!zset->tree)
+    {
+        zset->tree = zset->pack ? pack_to_tree(zset->pack) : new ZTree();
+        if (zset->pack)
+        {
+            pack_free(zset->pack);
+            zset->pack = NULL;
+        }
+    }
+    // the hashtable takes the tuples, the tree is rebuilt with all of them.
+    // an update can put an old node out of order, then the old ones are sorted too.
+    ZTree *zt = zset->tree;
+    std::vector<ZNode *> old, fresh;
+    tree_detach(zt, old);
+    fresh.reserve(n);
+    hm_reserve(&zt->hmap, old.size() + n);
+    for (size_t i = 0; i < n; i++)
+    {
+        const ZTuple &t = tuples[i];
+        ZNode *node = tree_lookup(zt, t.name, t.len);
+        if (node)
+        {
+            node->score = t.score;
+            continue;
+        }
+        node = znode_new(t.name, t.len, t.score);
+        hm_insert(&zt->hmap, &node->hmap);
+        fresh.push_back(node);
+    }
+    size_t added = fresh.size();
+    nodes_sort(old);
+    nodes_sort(fresh);
+    std::vector<ZNode *> nodes(old.size() + fresh.size());
+    std::merge(old.begin(), old.end(), fresh.begin(), fresh.end(), nodes.begin(), &znode_less);
+    tree_build(zt, nodes);
+    log_debug("zset_add_many: %zu tuples, %zu added, rebuilt with %zu", n, added, nodes.size());
+    return added;
+}